@@ -0,0 +1,291 @@
+/*
+ * instancecache.h
+ *
+ * Copyright (C) 2018 by Julian Fong. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * The binary instance cache written by mis2rib --instance-cache, and
+ * read by the mis2rib_instancer procedural and the mis2rib_instances
+ * tool.
+ *
+ * A cache holds the instances of one archive instance JSON file,
+ * grouped by master. Everything is in native byte order and aligned,
+ * so the file can be mapped and used in place:
+ *
+ *   header
+ *   float[16] matrix of every instance, as written by ConcatTransform
+ *   uint64_t string table offset of the name of every instance
+ *   master records
+ *   string table of NUL terminated strings
+ */
+
+#ifndef INSTANCECACHE_H
+#define INSTANCECACHE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace instancecache
+{
+
+static const char magic[8] = {'M', 'I', 'S', '2', 'I', 'N', 'S', 'T'};
+static const uint32_t version = 1;
+
+struct header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t masterCount;
+    uint64_t instanceCount;
+    uint64_t matrixOffset;
+    uint64_t nameOffset;
+    uint64_t masterOffset;
+    uint64_t stringOffset;
+    uint64_t stringSize;
+};
+
+// The instances first .. first + count - 1 are all of one master,
+// which is the object named name (the OBJ file in the JSON) defined
+// by the RIB archive
+struct master
+{
+    uint64_t name;
+    uint64_t archive;
+    uint64_t first;
+    uint64_t count;
+};
+
+// Writes a cache in a single pass. The matrices go straight to the
+// file; the names and strings, whose positions aren't known until
+// the end, go to temporary files which are appended by close(). A
+// failed write is remembered and reported by close()
+class writer
+{
+public:
+    writer() : m_file(0), m_names(0), m_strings(0), m_stringSize(0), m_failed(false) {}
+    ~writer()
+    {
+        if (m_file) fclose(m_file);
+        if (m_names) fclose(m_names);
+        if (m_strings) fclose(m_strings);
+    }
+
+    bool open(const std::string& filename)
+    {
+        m_file = fopen(filename.c_str(), "wb");
+        m_names = tmpfile();
+        m_strings = tmpfile();
+        if (!m_file || !m_names || !m_strings) return false;
+        header h = header();
+        return fwrite(&h, sizeof(h), 1, m_file) == 1;
+    }
+
+    void beginMaster(const std::string& name, const std::string& archive)
+    {
+        master m;
+        m.name = addString(name);
+        m.archive = addString(archive);
+        m.first = instanceCount();
+        m.count = 0;
+        m_masters.push_back(m);
+    }
+
+    void instance(const std::string& name, const float matrix[16])
+    {
+        uint64_t offset = addString(name);
+        if (fwrite(matrix, sizeof(float), 16, m_file) != 16 ||
+            fwrite(&offset, sizeof(offset), 1, m_names) != 1)
+        {
+            m_failed = true;
+        }
+        m_masters.back().count++;
+    }
+
+    bool close()
+    {
+        header h;
+        memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.masterCount = uint32_t(m_masters.size());
+        h.instanceCount = instanceCount();
+        h.matrixOffset = sizeof(header);
+        h.nameOffset = h.matrixOffset + h.instanceCount * 16 * sizeof(float);
+        h.masterOffset = h.nameOffset + h.instanceCount * sizeof(uint64_t);
+        h.stringOffset = h.masterOffset + m_masters.size() * sizeof(master);
+        h.stringSize = m_stringSize;
+
+        bool ok = !m_failed && !ferror(m_file) && append(m_names) &&
+                  fwrite(m_masters.data(), sizeof(master), m_masters.size(), m_file) ==
+                      m_masters.size() &&
+                  append(m_strings) && fseek(m_file, 0, SEEK_SET) == 0 &&
+                  fwrite(&h, sizeof(h), 1, m_file) == 1;
+        ok = fclose(m_file) == 0 && ok;
+        m_file = 0;
+        return ok;
+    }
+
+private:
+    writer(const writer&);
+    writer& operator=(const writer&);
+
+    uint64_t instanceCount() const
+    {
+        return m_masters.empty() ? 0 : m_masters.back().first + m_masters.back().count;
+    }
+
+    uint64_t addString(const std::string& s)
+    {
+        uint64_t offset = m_stringSize;
+        if (fwrite(s.c_str(), 1, s.size() + 1, m_strings) != s.size() + 1) m_failed = true;
+        m_stringSize += s.size() + 1;
+        return offset;
+    }
+
+    bool append(FILE* f)
+    {
+        char buffer[1 << 16];
+        size_t n;
+        // rewind() would clear the error of a write which failed
+        if (fflush(f) != 0 || ferror(f)) return false;
+        rewind(f);
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        {
+            if (fwrite(buffer, 1, n, m_file) != n) return false;
+        }
+        return !ferror(f);
+    }
+
+    FILE* m_file;
+    FILE* m_names;
+    FILE* m_strings;
+    uint64_t m_stringSize;
+    bool m_failed;
+    std::vector<master> m_masters;
+};
+
+// A cache mapped into memory. Everything is checked to lie within the
+// file when it is opened, so the accessors don't need to
+class reader
+{
+public:
+    reader() : m_data(0), m_size(0) {}
+    ~reader()
+    {
+        if (m_data) munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    bool open(const std::string& filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return fail(filename + ": unable to open");
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(header))
+        {
+            void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                m_data = static_cast<const char*>(p);
+                m_size = st.st_size;
+            }
+        }
+        ::close(fd);
+        if (!m_data) return fail(filename + ": unable to map");
+
+        const header& h = *this->h();
+        if (memcmp(h.magic, magic, sizeof(magic)) != 0)
+            return fail(filename + ": not an instance cache");
+        if (h.version != version) return fail(filename + ": unsupported version");
+        if (h.matrixOffset != sizeof(header) ||
+            h.instanceCount > (m_size - h.matrixOffset) / (16 * sizeof(float) + sizeof(uint64_t)) ||
+            h.nameOffset != h.matrixOffset + h.instanceCount * 16 * sizeof(float) ||
+            h.masterOffset != h.nameOffset + h.instanceCount * sizeof(uint64_t) ||
+            h.stringOffset != h.masterOffset + uint64_t(h.masterCount) * sizeof(master) ||
+            h.stringOffset > m_size || h.stringSize != m_size - h.stringOffset ||
+            (h.stringSize > 0 && m_data[m_size - 1] != 0))
+        {
+            return fail(filename + ": truncated or corrupt");
+        }
+        uint64_t next = 0;
+        for (uint32_t i = 0; i < h.masterCount; ++i)
+        {
+            const master& m = masters()[i];
+            if (m.first != next || m.count > h.instanceCount - next || m.name >= h.stringSize ||
+                m.archive >= h.stringSize)
+            {
+                return fail(filename + ": corrupt master table");
+            }
+            next += m.count;
+        }
+        if (next != h.instanceCount) return fail(filename + ": corrupt master table");
+        const uint64_t* names = reinterpret_cast<const uint64_t*>(m_data + h.nameOffset);
+        for (uint64_t i = 0; i < h.instanceCount; ++i)
+        {
+            if (names[i] >= h.stringSize) return fail(filename + ": corrupt instance names");
+        }
+        return true;
+    }
+
+    const std::string& error() const { return m_error; }
+
+    uint32_t masterCount() const { return h()->masterCount; }
+    uint64_t instanceCount() const { return h()->instanceCount; }
+    const master* masters() const
+    {
+        return reinterpret_cast<const master*>(m_data + h()->masterOffset);
+    }
+    const float* matrix(uint64_t i) const
+    {
+        return reinterpret_cast<const float*>(m_data + h()->matrixOffset) + 16 * i;
+    }
+    const char* name(uint64_t i) const
+    {
+        return string(reinterpret_cast<const uint64_t*>(m_data + h()->nameOffset)[i]);
+    }
+    const char* string(uint64_t offset) const { return m_data + h()->stringOffset + offset; }
+
+private:
+    reader(const reader&);
+    reader& operator=(const reader&);
+
+    const header* h() const { return reinterpret_cast<const header*>(m_data); }
+
+    bool fail(const std::string& error)
+    {
+        m_error = error;
+        return false;
+    }
+
+    const char* m_data;
+    size_t m_size;
+    std::string m_error;
+};
+
+} // namespace instancecache
+
+#endif
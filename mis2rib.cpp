@@ -35,16 +35,85 @@
  */
 
 #include <boost/filesystem.hpp>
+#include <zlib.h>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cfloat>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 #include "json.hpp"
+#include "instancecache.h"
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MIS2RIB_WITH_URING
+#endif
+#ifdef MIS2RIB_WITH_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // for convenience
 using json = nlohmann::json;
 using namespace std;
 
+// Command line options
+struct Options
+{
+    bool binary = false;
+    string compress;
+    int compressLevel = -1;
+    int compressThreads = 0;
+    int precision = 0;
+    int threads = 0;
+    int splitObj = 0;
+    int jsonWindow = 1024;
+    bool incremental = false;
+    bool dedupGeometry = false;
+    bool instanceCache = false;
+    bool delayed = false;
+    string cullCamera;
+    float cullMargin = 0;
+    string facingCamera;
+    int decimateLevels = 0;
+    float decimateError = 0.01f;
+    string lodCamera;
+    float lodError = 1;
+    int lodResolution = 2444;
+    bool lodThin = false;
+    bool objCache = false;
+    bool objCacheQuantize = false;
+    string stats;
+    bool sharedMaterials = false;
+    bool pipeline = false;
+    int pipelineDepth = 4;
+    int pipelineBlock = 4;
+    string outputSink = "posix";
+};
+static Options options;
+
 struct Float3
 {
     float x, y, z;
@@ -71,986 +140,8611 @@ static void normalize(Float3& a)
     a.z /= len;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// OBJ file
-////////////////////////////////////////////////////////////////////////////////
+// An axis aligned bounding box, stored in the order of a RIB bound:
+// xmin xmax ymin ymax zmin zmax
+struct Bound
+{
+    float b[6] = {FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX};
 
-struct objstate
+    bool empty() const { return b[0] > b[1]; }
+
+    void extend(float x, float y, float z)
+    {
+        b[0] = min(b[0], x);
+        b[1] = max(b[1], x);
+        b[2] = min(b[2], y);
+        b[3] = max(b[3], y);
+        b[4] = min(b[4], z);
+        b[5] = max(b[5], z);
+    }
+
+    void extend(const Bound& o)
+    {
+        if (o.empty()) return;
+        extend(o.b[0], o.b[2], o.b[4]);
+        extend(o.b[1], o.b[3], o.b[5]);
+    }
+
+    void pad(float d)
+    {
+        if (empty()) return;
+        for (int i = 0; i < 6; i += 2)
+        {
+            b[i] -= d;
+            b[i + 1] += d;
+        }
+    }
+
+    // The bound of this box transformed by a RIB matrix, which
+    // multiplies row vectors on the right. A projective matrix which
+    // takes part of the box to infinity gives an unbounded box
+    Bound transformed(const float* m) const
+    {
+        Bound r;
+        if (empty()) return r;
+        for (int c = 0; c < 8; ++c)
+        {
+            float x = b[c & 1], y = b[2 + ((c >> 1) & 1)], z = b[4 + (c >> 2)];
+            float w = x * m[3] + y * m[7] + z * m[11] + m[15];
+            if (!(w > 0))
+            {
+                r.extend(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+                r.extend(FLT_MAX, FLT_MAX, FLT_MAX);
+                return r;
+            }
+            r.extend(
+                (x * m[0] + y * m[4] + z * m[8] + m[12]) / w,
+                (x * m[1] + y * m[5] + z * m[9] + m[13]) / w,
+                (x * m[2] + y * m[6] + z * m[10] + m[14]) / w);
+        }
+        return r;
+    }
+};
+
+// The view of the --cull-camera camera, as the planes bounding the
+// half spaces it can see, in world space: ax + by + cz + d >= 0
+struct frustum
 {
-    string elementName;
-    string currentName;
-    string currentMaterial;
-    vector<Float3> P;
-    vector<Float3> N;
-    map<int, int> Pmap, Prevmap;
-    map<int, int> Nmap;
-    int nverts = 0;
-    int nfaces = 0;
-    vector<int> facesize;
-    vector<int> faceidx, faceNidx;
+    float planes[5][4];
+    float margin = 0;
+
+    // False only if every point of the box is further than margin
+    // outside one of the planes
+    bool visible(const Bound& box) const
+    {
+        if (box.empty()) return false;
+        for (auto& p : planes)
+        {
+            float x = box.b[p[0] >= 0 ? 1 : 0];
+            float y = box.b[p[1] >= 0 ? 3 : 2];
+            float z = box.b[p[2] >= 0 ? 5 : 4];
+            if (p[0] * x + p[1] * y + p[2] * z + p[3] < -margin) return false;
+        }
+        return true;
+    }
 };
 
-static void flushfaces(
-    ofstream& ostr, struct objstate& s, const unordered_map<string, string>& materials)
+// The places the contents of an element appear in the world, which
+// they are culled against: anything which may be visible in any of
+// them is kept
+struct cullplaces
 {
-    if (!s.facesize.empty())
+    const frustum* view = nullptr;
+    vector<vector<float>> matrices;
+    // Identifies the view and the places, since the files written
+    // with culling depend on both
+    uint64_t hash = 0;
+
+    bool visible(const Bound& box) const
     {
-        // If the mesh is made of triangles, outputting a
-        // Catmull-Clark subdiv is not a great idea
-        bool polygons = (s.facesize[0] == 3);
-        ostr << "AttributeBegin" << endl;
-        auto mat = materials.find(s.currentMaterial);
-        if (mat != materials.end())
+        for (auto& m : matrices)
         {
-            string material = mat->second;
+            if (view->visible(box.transformed(m.data()))) return true;
+        }
+        return false;
+    }
+};
+
+// Totals of what was culled by --cull-camera
+static struct
+{
+    atomic<uint64_t> groups, groupsCulled;
+    atomic<uint64_t> instances, instancesCulled;
+    atomic<uint64_t> curves, curvesCulled;
+    atomic<uint64_t> copies, copiesCulled;
+} cullStats;
 
-            // May need to perform two substitutions because of
-            // displacement
-            for (int i = 0; i < 2; ++i)
+// The level of detail of the curves of an element seen from the
+// --lod-camera camera, at each place the element appears
+struct curvelod
+{
+    Float3 eye;
+    // Pixels covered by a unit length at unit distance from the eye
+    float pixelsPerUnit = 0;
+    // Largest error allowed, in pixels
+    float error = 1;
+    bool thin = false;
+    vector<vector<float>> matrices;
+    // Identifies the camera, settings and places
+    uint64_t hash = 0;
+
+    // Pixels covered by a unit length of an object in box, where it is
+    // closest to the eye in any of the places, or FLT_MAX if the eye
+    // is inside. The stretch of a matrix is taken as the longest of
+    // its axes
+    float pixels(const Bound& box) const
+    {
+        float most = 0;
+        for (auto& m : matrices)
+        {
+            Bound b = box.transformed(m.data());
+            float dx = max(max(b.b[0] - eye.x, eye.x - b.b[1]), 0.0f);
+            float dy = max(max(b.b[2] - eye.y, eye.y - b.b[3]), 0.0f);
+            float dz = max(max(b.b[4] - eye.z, eye.z - b.b[5]), 0.0f);
+            float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+            if (!(distance > 0)) return FLT_MAX;
+            float stretch = 0;
+            for (int r = 0; r < 3; ++r)
             {
-                size_t pos = material.find("%", 0);
-                if (pos != string::npos)
-                {
-                    string ptxfile = s.currentName + ".ptx";
-                    material.replace(pos, 1, ptxfile);
-                }
-                else
+                const float* a = &m[4 * r];
+                stretch = max(stretch, sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]));
+            }
+            most = max(most, pixelsPerUnit * stretch / distance);
+        }
+        return most;
+    }
+
+    // Drop the control points of a strand, packed as xyz in points,
+    // which lie within the error of the polygon through those kept,
+    // always keeping both ends
+    void simplify(vector<float>& points) const
+    {
+        size_t n = points.size() / 3;
+        if (n <= 2) return;
+        Bound box;
+        for (size_t i = 0; i < n; ++i)
+            box.extend(points[3 * i], points[3 * i + 1], points[3 * i + 2]);
+        float tolerance = error / pixels(box);
+        if (!(tolerance > 0)) return;
+
+        vector<char> keep(n, 0);
+        keep[0] = keep[n - 1] = 1;
+        vector<pair<size_t, size_t>> spans = {{0, n - 1}};
+        while (!spans.empty())
+        {
+            size_t a = spans.back().first, b = spans.back().second;
+            spans.pop_back();
+            const float* p = &points[3 * a];
+            const float* q = &points[3 * b];
+            Float3 d(q[0] - p[0], q[1] - p[1], q[2] - p[2]);
+            float dd = dot(d, d);
+            float worst = 0;
+            size_t split = a;
+            for (size_t i = a + 1; i < b; ++i)
+            {
+                const float* r = &points[3 * i];
+                Float3 v(r[0] - p[0], r[1] - p[1], r[2] - p[2]);
+                float t = dd > 0 ? min(max(dot(v, d) / dd, 0.0f), 1.0f) : 0;
+                Float3 e(v.x - t * d.x, v.y - t * d.y, v.z - t * d.z);
+                float error = dot(e, e);
+                if (error > worst)
                 {
-                    break;
+                    worst = error;
+                    split = i;
                 }
             }
-
-            ostr << material << endl;
+            if (worst > tolerance * tolerance)
+            {
+                keep[split] = 1;
+                spans.push_back({a, split});
+                spans.push_back({split, b});
+            }
         }
-        ostr << "    Attribute \"identifier\" \"string name\" \"" << s.currentName << "\"" << endl;
-        ostr << "    Attribute \"identifier\" \"string object\" \"" << s.currentName << "\""
-             << endl;
-        if (polygons)
+        size_t k = 0;
+        for (size_t i = 0; i < n; ++i)
         {
-            ostr << "    PointsPolygons [";
+            if (!keep[i]) continue;
+            points[3 * k] = points[3 * i];
+            points[3 * k + 1] = points[3 * i + 1];
+            points[3 * k + 2] = points[3 * i + 2];
+            ++k;
         }
-        else
+        points.resize(3 * k);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// RIB output
+////////////////////////////////////////////////////////////////////////////////
+
+static double seconds()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Peak resident set size of the process in MB
+static double peakMemory()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+// All RIB is emitted through a RibWriter, which knows how to write
+// either the ASCII encoding or the binary encoding described in
+// Appendix C of the RenderMan Interface Specification. The two
+// encodings can be freely intermixed, so pre-formatted ASCII (such as
+// the material definitions and comments) is simply passed through
+// in binary mode as well.
+//
+// The writer does its own formatting into a large buffer which is
+// handed to the underlying streambuf only when full, bypassing the
+// ostream and locale machinery entirely. Floats are written in the
+// shortest form which reads back as exactly the same float, unless a
+// fixed number of significant digits is requested with --precision.
+class RibWriter
+{
+public:
+    RibWriter(ostream& ostr, bool binary)
+        : m_sink(ostr.rdbuf()), m_binary(binary), m_space(false), m_buffer(bufferSize)
+    {
+        m_ptr = &m_buffer[0];
+        m_end = m_ptr + m_buffer.size();
+    }
+    ~RibWriter() { flush(); }
+
+    bool binary() const { return m_binary; }
+
+    // Write the complete output of another writer, typically one
+    // which produced part of the RIB in parallel into memory
+    void append(const string& data)
+    {
+        write(data.data(), data.size());
+        // The other writer may have reassigned any of our binary
+        // request codes and string tokens
+        m_requests.clear();
+        m_strings.clear();
+        m_space = false;
+    }
+
+    void flush()
+    {
+        m_sink->sputn(&m_buffer[0], m_ptr - &m_buffer[0]);
+        m_written += m_ptr - &m_buffer[0];
+        m_ptr = &m_buffer[0];
+    }
+
+    // Number of bytes written so far
+    uint64_t tell() const { return m_written + (m_ptr - &m_buffer[0]); }
+
+    // Layout which is only meaningful in the ASCII encoding
+    void indent(int levels = 1)
+    {
+        if (!m_binary)
         {
-            ostr << "    SubdivisionMesh \"catmull-clark\" [";
+            for (int i = 0; i < levels; ++i) write("    ", 4);
         }
-        for (auto i = s.facesize.begin(); i != s.facesize.end(); ++i)
+        m_space = false;
+    }
+    void newline()
+    {
+        if (!m_binary) put('\n');
+        m_space = false;
+    }
+
+    // A comment is terminated by a newline in both encodings
+    void comment(const string& text)
+    {
+        put('#');
+        write(text.data(), text.size());
+        put('\n');
+        m_space = false;
+    }
+
+    // Pre-formatted ASCII RIB
+    void verbatim(const string& text)
+    {
+        write(text.data(), text.size());
+        if (m_binary) put('\n');
+        m_space = false;
+    }
+
+    // Write segments verbatim with fill between each of them
+    void verbatim(const vector<string>& segments, const string& fill)
+    {
+        for (size_t i = 0; i < segments.size(); ++i)
         {
-            ostr << *i << ' ';
+            if (i > 0) write(fill.data(), fill.size());
+            write(segments[i].data(), segments[i].size());
         }
-        ostr << "] [";
-        int maxvert = -1;
-        for (auto i = s.faceidx.begin(); i != s.faceidx.end(); ++i)
+        if (m_binary) put('\n');
+        m_space = false;
+    }
+
+    void request(const char* name)
+    {
+        if (m_binary)
         {
-            ostr << *i << ' ';
-            if (*i > maxvert) maxvert = *i;
+            auto i = m_requests.find(name);
+            if (i == m_requests.end())
+            {
+                int code = (int)m_requests.size();
+                if (code > 0xff)
+                {
+                    // Out of request codes; fall back to ASCII
+                    write(name, strlen(name));
+                    put(' ');
+                    return;
+                }
+                i = m_requests.insert(make_pair(string(name), code)).first;
+                put(char(0314));
+                put(char(code));
+                encodeString(name);
+            }
+            put(char(0246));
+            put(char(i->second));
         }
-        ostr << "] ";
-        if (!polygons)
+        else
         {
-            ostr << "[\"interpolateboundary\"] [1 0] [1] [] ";
+            write(name, strlen(name));
+            m_space = true;
         }
-        ostr << "\"vertex point P\" [";
+    }
 
-        for (int i = 0; i <= maxvert; ++i)
+    // Strings which are expected to be repeated many times, such as
+    // parameter declarations, become defined strings in the binary
+    // encoding and are thereafter referenced by token
+    void token(const string& s)
+    {
+        if (m_binary)
         {
-            auto j = s.Prevmap.find(i);
-            if (j != s.Prevmap.end())
+            auto i = m_strings.find(s);
+            if (i == m_strings.end())
             {
-                ostr << s.P[j->second].x << ' ' << s.P[j->second].y << ' ' << s.P[j->second].z
-                     << ' ';
+                int token = (int)m_strings.size();
+                if (token > 0xffff)
+                {
+                    encodeString(s);
+                    return;
+                }
+                i = m_strings.insert(make_pair(s, token)).first;
+                if (token > 0xff)
+                {
+                    put(char(0316));
+                    put(char(token >> 8));
+                }
+                else
+                {
+                    put(char(0315));
+                }
+                put(char(token));
+                encodeString(s);
             }
-            else
+            if (i->second > 0xff)
             {
-                ostr << "-666 -666 -666 ";
+                put(char(0320));
+                put(char(i->second >> 8));
             }
-        }
-        ostr << "] ";
-        // I'm not terribly convinced that for subdivision meshes, the
-        // provided normals are better than what RenderMan would
-        // compute on the limit surface
-        if (polygons)
-        {
-            if (!s.N.empty())
+            else
             {
-                ostr << "\"vertex normal N\" [";
-                for (int i = 0; i <= maxvert; ++i)
-                {
-                    int n = s.Nmap[i];
-                    ostr << s.N[n].x << ' ' << s.N[n].y << ' ' << s.N[n].z << ' ';
-                }
-                ostr << "] ";
+                put(char(0317));
             }
+            put(char(i->second));
         }
-        ostr << "\"uniform float __faceindex\" [";
-        for (int i = 0; i < (int)s.facesize.size(); ++i)
+        else
         {
-            ostr << i << ' ';
+            str(s);
         }
-        ostr << "]" << endl;
-        s.nverts = 0;
-        s.nfaces = 0;
-        s.Pmap.clear();
-        s.Prevmap.clear();
-        s.Nmap.clear();
-        s.facesize.clear();
-        s.faceidx.clear();
-        ostr << "AttributeEnd" << endl;
     }
-}
 
-static int vertmap(struct objstate& s, int v)
-{
-    auto i = s.Pmap.find(v);
-    if (i == s.Pmap.end())
+    // A token given as a literal. In the binary encoding it is looked
+    // up through a string kept between calls, which saves making a
+    // string of it every time
+    void token(const char* s)
     {
-        s.Pmap[v] = s.nverts;
-        s.Prevmap[s.nverts] = v;
-        return s.nverts++;
+        if (m_binary)
+        {
+            m_key.assign(s);
+            token(m_key);
+        }
+        else
+        {
+            separate();
+            put('"');
+            write(s, strlen(s));
+            put('"');
+        }
     }
-    else
+
+    void str(const string& s)
     {
-        return i->second;
+        if (m_binary)
+        {
+            encodeString(s);
+        }
+        else
+        {
+            separate();
+            put('"');
+            write(s.data(), s.size());
+            put('"');
+        }
     }
-}
 
-static void parseobj(
-    const string& elementName,
-    const unordered_map<string, string>& materials,
-    ifstream& istr,
-    ofstream& ostr)
-{
-    struct objstate s;
-    s.elementName = elementName;
-    string bufStr;
-    while (getline(istr, bufStr))
+    void integer(int i)
     {
-        if (!bufStr.empty() && bufStr[bufStr.length() - 1] == '\n')
+        if (m_binary)
         {
-            bufStr.erase(bufStr.length() - 1);
+            encodeInteger(i);
         }
-        if (bufStr.empty()) continue;
-        const char* buf = bufStr.c_str();
-
-        if (buf[0] != 'f')
+        else
         {
-            // Flush faces in the queue if we encounter a new
-            // directive
-            flushfaces(ostr, s, materials);
+            separate();
+            formatInteger(i);
         }
+    }
 
-        if (buf[0] == '#')
+    void real(float f)
+    {
+        if (m_binary)
         {
-            // Comment
-            ostr << buf << endl;
+            put(char(0244));
+            encodeFloat(f);
         }
-        else if (buf[0] == 'g')
+        else
         {
-            // Name of geometry, sometimes used for Ptx binding
-            // purposes
-            s.currentName = string(buf + 2);
+            separate();
+            formatFloat(f);
         }
-        else if (strncmp(buf, "usemtl ", 7) == 0)
+    }
+
+    // Small fixed size arrays, written as [a b c] in ASCII
+    void floats(const float* f, size_t n)
+    {
+        if (m_binary)
         {
-            // Material binding
-            s.currentMaterial = string(buf + 7);
+            encodeFloatArrayHeader(n);
+            for (size_t i = 0; i < n; ++i) encodeFloat(f[i]);
         }
-        else if (buf[0] == 'v' && buf[1] == 'n')
+        else
         {
-            // Normal
-            float x, y, z;
-            if (sscanf(buf, "vn %f %f %f", &x, &y, &z) == 3)
-            {
-                s.N.push_back(Float3(x, y, z));
-            }
-            else
+            separate();
+            put('[');
+            for (size_t i = 0; i < n; ++i)
             {
-                cerr << "Bad normal directive:" << buf << endl;
+                if (i) put(' ');
+                formatFloat(f[i]);
             }
+            put(']');
         }
-        else if (buf[0] == 'v')
+    }
+    void ints(const int* v, size_t n)
+    {
+        if (!m_binary) separate();
+        put('[');
+        for (size_t i = 0; i < n; ++i)
         {
-            // Point
-            float x, y, z;
-            if (sscanf(buf, "v %f %f %f", &x, &y, &z) == 3)
+            if (m_binary)
             {
-                s.P.push_back(Float3(x, y, z));
+                encodeInteger(v[i]);
             }
             else
             {
-                cerr << "Bad point directive:" << buf << endl;
+                if (i) put(' ');
+                formatInteger(v[i]);
             }
         }
-        else if (buf[0] == 'f')
+        put(']');
+    }
+    void tokens(const char* const* s, size_t n)
+    {
+        if (!m_binary) separate();
+        put('[');
+        m_space = false;
+        for (size_t i = 0; i < n; ++i) token(s[i]);
+        put(']');
+        m_space = true;
+    }
+
+    // Large arrays written an element at a time, as [a b c ] in
+    // ASCII. The binary encoding of a float array needs to know its
+    // length up front.
+    void beginFloatArray(size_t n)
+    {
+        m_floatArray = true;
+        if (m_binary)
         {
-            int v[4], vn[4];
-            // Quad face
-            if (sscanf(
-                    buf,
-                    "f %d//%d %d//%d %d//%d %d//%d",
-                    &v[0],
-                    &vn[0],
-                    &v[1],
-                    &vn[1],
-                    &v[2],
-                    &vn[2],
-                    &v[3],
-                    &vn[3]) == 8)
-            {
-                s.facesize.push_back(4);
-                s.faceidx.push_back(vertmap(s, v[0] - 1));
-                s.faceidx.push_back(vertmap(s, v[1] - 1));
-                s.faceidx.push_back(vertmap(s, v[2] - 1));
-                s.faceidx.push_back(vertmap(s, v[3] - 1));
-                s.Nmap[vertmap(s, v[0] - 1)] = vn[0] - 1;
-                s.Nmap[vertmap(s, v[1] - 1)] = vn[1] - 1;
-                s.Nmap[vertmap(s, v[2] - 1)] = vn[2] - 1;
-                s.Nmap[vertmap(s, v[3] - 1)] = vn[3] - 1;
-                s.nfaces++;
-            }
-            // Triangle face
-            else if (
-                sscanf(
-                    buf, "f %d//%d %d//%d %d//%d", &v[0], &vn[0], &v[1], &vn[1], &v[2], &vn[2]) ==
-                6)
-            {
-                s.facesize.push_back(3);
-                s.faceidx.push_back(vertmap(s, v[0] - 1));
-                s.faceidx.push_back(vertmap(s, v[1] - 1));
-                s.faceidx.push_back(vertmap(s, v[2] - 1));
-                s.Nmap[vertmap(s, v[0] - 1)] = vn[0] - 1;
-                s.Nmap[vertmap(s, v[1] - 1)] = vn[1] - 1;
-                s.Nmap[vertmap(s, v[2] - 1)] = vn[2] - 1;
-                s.nfaces++;
-            }
+            encodeFloatArrayHeader(n);
+        }
+        else
+        {
+            separate();
+            put('[');
+        }
+    }
+    void beginIntArray()
+    {
+        m_floatArray = false;
+        if (!m_binary) separate();
+        put('[');
+    }
+    void element(float f)
+    {
+        if (m_binary)
+        {
+            encodeFloat(f);
+        }
+        else
+        {
+            formatFloat(f);
+            put(' ');
+        }
+    }
+    void element(int i)
+    {
+        if (m_binary)
+        {
+            if (m_floatArray)
+                encodeFloat(float(i));
             else
-            {
-                cerr << "Bad face directive:" << buf << endl;
-            }
+                encodeInteger(i);
+        }
+        else
+        {
+            formatInteger(i);
+            put(' ');
         }
     }
-    flushfaces(ostr, s, materials);
-}
+    void endArray()
+    {
+        if (!m_binary || !m_floatArray) put(']');
+        m_space = true;
+    }
 
-static void objFile(
-    ostream& ostr,
-    const string& elementName,
-    const string& filename,
-    const unordered_map<string, string>& materials,
-    bool isMaster)
-{
-    string ofilename = filename;
+private:
+    static const size_t bufferSize = 1 << 20;
 
-    size_t pos = ofilename.find(".obj", 0);
-    if (pos != string::npos)
+    void reserve(size_t n)
     {
-        ofilename.replace(pos, 4, ".rib");
+        if (size_t(m_end - m_ptr) < n) flush();
     }
-    pos = ofilename.find("obj/", 0);
-    if (pos != string::npos)
+    void put(char c)
     {
-        ofilename.replace(pos, 4, "rib/");
+        if (m_ptr == m_end) flush();
+        *m_ptr++ = c;
+    }
+    void write(const char* s, size_t n)
+    {
+        if (n > m_buffer.size())
+        {
+            flush();
+            m_sink->sputn(s, n);
+            m_written += n;
+            return;
+        }
+        reserve(n);
+        memcpy(m_ptr, s, n);
+        m_ptr += n;
     }
 
-    ifstream istr(filename.c_str());
-    boost::filesystem::path p(ofilename);
-    p.remove_filename();
-    if (!boost::filesystem::exists(p))
+    void separate()
     {
-        boost::filesystem::create_directories(p);
+        if (m_space) put(' ');
+        m_space = true;
     }
 
-    ofstream ribostr(ofilename.c_str());
-    parseobj(elementName, materials, istr, ribostr);
+    void formatInteger(int i)
+    {
+        static const char digits[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        reserve(12);
+        unsigned u = i;
+        if (i < 0)
+        {
+            *m_ptr++ = '-';
+            u = 0u - u;
+        }
+        char buf[10];
+        char* p = buf + sizeof(buf);
+        while (u >= 100)
+        {
+            unsigned r = (u % 100) * 2;
+            u /= 100;
+            *--p = digits[r + 1];
+            *--p = digits[r];
+        }
+        if (u >= 10)
+        {
+            *--p = digits[u * 2 + 1];
+            *--p = digits[u * 2];
+        }
+        else
+        {
+            *--p = char('0' + u);
+        }
+        size_t n = buf + sizeof(buf) - p;
+        memcpy(m_ptr, p, n);
+        m_ptr += n;
+    }
 
-    if (!isMaster)
+    // The longest float, with at most 9 significant digits, is
+    // -1.23456789e-38
+    void formatFloat(float f)
     {
-        ostr << endl;
-        ostr << "    #begin objFile " << filename << endl;
+        reserve(32);
+        int precision = options.precision;
+        to_chars_result r = precision > 0
+                                ? to_chars(m_ptr, m_end, f, chars_format::general, precision)
+                                : to_chars(m_ptr, m_end, f);
+        if (r.ec != errc())
+        {
+            cerr << "Unable to format " << f << endl;
+            return;
+        }
+        m_ptr = r.ptr;
     }
-    ostr << "    ReadArchive \"" << ofilename << "\"" << endl;
-    if (!isMaster)
+
+    void encodeInteger(int i)
     {
-        ostr << "    #end objFile " << filename << endl;
+        int bytes = 4;
+        if (i >= -0x80 && i < 0x80)
+            bytes = 1;
+        else if (i >= -0x8000 && i < 0x8000)
+            bytes = 2;
+        else if (i >= -0x800000 && i < 0x800000)
+            bytes = 3;
+        put(char(0200 + bytes - 1));
+        for (int b = bytes - 1; b >= 0; --b) put(char(i >> (8 * b)));
     }
-}
 
-////////////////////////////////////////////////////////////////////////////////
+    void encodeFloat(float f)
+    {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        reserve(4);
+        m_ptr[0] = char(bits >> 24);
+        m_ptr[1] = char(bits >> 16);
+        m_ptr[2] = char(bits >> 8);
+        m_ptr[3] = char(bits);
+        m_ptr += 4;
+    }
+
+    void encodeLength(int code, size_t n)
+    {
+        int bytes = n < 0x100 ? 1 : n < 0x10000 ? 2 : n < 0x1000000 ? 3 : 4;
+        put(char(code + bytes - 1));
+        for (int b = bytes - 1; b >= 0; --b) put(char(n >> (8 * b)));
+    }
+
+    void encodeFloatArrayHeader(size_t n) { encodeLength(0310, n); }
+
+    void encodeString(const string& s)
+    {
+        if (s.size() < 16)
+            put(char(0220 + s.size()));
+        else
+            encodeLength(0240, s.size());
+        write(s.data(), s.size());
+    }
+
+    streambuf* m_sink;
+    bool m_binary;
+    bool m_space;
+    bool m_floatArray = false;
+    vector<char> m_buffer;
+    char* m_ptr;
+    char* m_end;
+    uint64_t m_written = 0;
+    unordered_map<string, int> m_requests;
+    unordered_map<string, int> m_strings;
+    string m_key;
+};
+
+// An output stream which discards everything written to it
+class nullstream : public ostream
+{
+public:
+    nullstream() : ostream(&m_buf) {}
+
+private:
+    struct nullbuf : streambuf
+    {
+        streamsize xsputn(const char*, streamsize n) override { return n; }
+        int overflow(int c) override { return c; }
+    } m_buf;
+};
+
+// Write a bound, rounded outwards if floats are being written with
+// fewer digits than they need
+static void outputBound(RibWriter& rib, const Bound& bound)
+{
+    float b[6] = {0, 0, 0, 0, 0, 0};
+    if (!bound.empty())
+    {
+        float slack = options.precision > 0 ? powf(10.0f, 1.0f - options.precision) : 0;
+        for (int i = 0; i < 6; ++i)
+        {
+            float d = (i & 1 ? 1 : -1) * slack * fabsf(bound.b[i]);
+            b[i] = fabsf(d) < FLT_MAX - fabsf(bound.b[i]) ? bound.b[i] + d : bound.b[i];
+        }
+    }
+    rib.floats(b, 6);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Dependencies
+////////////////////////////////////////////////////////////////////////////////
+
+// With --incremental, scene mode records the files read and written
+// while converting each unit, so that a later run can skip the units
+// whose inputs haven't changed (see class manifest). The record of
+// the unit being converted is attached to the thread converting it,
+// and passed on to any tasks that thread starts.
+struct dependencies
+{
+    mutex lock;
+    set<string> inputs;
+    set<string> outputs;
+};
+
+static thread_local dependencies* t_dependencies = nullptr;
+
+// Make d the record of the current thread until the end of the scope
+struct dependencyscope
+{
+    explicit dependencyscope(dependencies* d) : saved(t_dependencies) { t_dependencies = d; }
+    ~dependencyscope() { t_dependencies = saved; }
+    dependencies* saved;
+};
+
+static void addInput(const string& filename)
+{
+    if (dependencies* d = t_dependencies)
+    {
+        lock_guard<mutex> lock(d->lock);
+        d->inputs.insert(filename);
+    }
+}
+
+static void addOutput(const string& filename)
+{
+    if (dependencies* d = t_dependencies)
+    {
+        lock_guard<mutex> lock(d->lock);
+        d->outputs.insert(filename);
+    }
+}
+
+static bool sameContents(const string& a, const string& b)
+{
+    struct stat sa, sb;
+    if (stat(a.c_str(), &sa) != 0 || stat(b.c_str(), &sb) != 0 || sa.st_size != sb.st_size)
+    {
+        return false;
+    }
+    ifstream fa(a.c_str(), ios::binary), fb(b.c_str(), ios::binary);
+    vector<char> ba(1 << 20), bb(1 << 20);
+    while (fa && fb)
+    {
+        fa.read(ba.data(), ba.size());
+        fb.read(bb.data(), bb.size());
+        if (fa.gcount() != fb.gcount() || memcmp(ba.data(), bb.data(), fa.gcount()) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Number of outputs left untouched because they were already up to
+// date
+static atomic<int> outputsUnchanged(0);
+
+// Move a newly written temporary file over filename, unless filename
+// already has the same contents, in which case it's left alone so
+// that its modification time doesn't change. Returns false if the
+// file couldn't be moved
+static bool replaceIfChanged(const string& temp, const string& filename)
+{
+    if (sameContents(temp, filename))
+    {
+        unlink(temp.c_str());
+        outputsUnchanged++;
+    }
+    else if (rename(temp.c_str(), filename.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// 64 bit hash of n bytes, continuing from the hash h of any bytes
+// before them. All but the last block hashed must be a multiple of 8
+// bytes long
+static uint64_t hashBytes(const void* data, size_t n, uint64_t h = 0)
+{
+    const char* p = static_cast<const char*>(data);
+    auto mix = [&h](uint64_t w) {
+        h ^= w * 0x87c37b91114253d5ull;
+        h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937full;
+    };
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        mix(w);
+    }
+    if (n > 0)
+    {
+        uint64_t w = 0;
+        memcpy(&w, p, n);
+        mix(w ^ n);
+    }
+    return h;
+}
+
+// 64 bit hash of the contents of a file
+static uint64_t hashFile(const string& filename)
+{
+    ifstream file(filename.c_str(), ios::binary);
+    vector<char> buffer(1 << 20);
+    uint64_t h = 0xcbf29ce484222325ull;
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+    {
+        h = hashBytes(buffer.data(), file.gcount(), h);
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+static string hex(uint64_t h)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    return buf;
+}
+
+struct filestate
+{
+    int64_t size = -1;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+};
+
+static bool statFile(const string& filename, filestate& state)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return false;
+    state.size = st.st_size;
+    state.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// Identifies the converter, so that a new build of mis2rib converts
+// everything again
+static const string& converterVersion()
+{
+    static const string version = hex(hashFile("/proc/self/exe"));
+    return version;
+}
+
+// The options which change the RIB written
+static string optionsSignature()
+{
+    ostringstream ostr;
+    ostr << "binary=" << options.binary << " compress=" << options.compress
+         << " level=" << options.compressLevel << " precision=" << options.precision
+         << " dedup=" << options.dedupGeometry << " instancecache=" << options.instanceCache
+         << " delayed=" << options.delayed << " cull=" << options.cullCamera
+         << " margin=" << options.cullMargin << " facing=" << options.facingCamera
+         << " lod=" << options.lodCamera << " lodError=" << options.lodError
+         << " lodResolution=" << options.lodResolution << " lodThin=" << options.lodThin
+         << " decimate=" << options.decimateLevels << " decimateError=" << options.decimateError
+         << " objCacheQuantize=" << options.objCacheQuantize
+         << " sharedMaterials=" << options.sharedMaterials;
+    return ostr.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////////////
+
+// With --stats file.json, the time spent in each phase of converting
+// every element and every archive is recorded, along with counts of
+// what was read and written, and written to file.json at the end.
+// Like the dependencies, the record of the element or archive being
+// converted is attached to the thread converting it and passed on to
+// any tasks that thread starts, so the work of several threads adds up
+// in the same record. The times of nested phases are exclusive: the
+// time spent parsing an OBJ file leaves out writing the RIB of its
+// groups. Wall times of phases are summed over the threads doing them.
+// The allocations made in each phase are counted the same way.
+enum statsphase
+{
+    phaseJson,
+    phaseMaterials,
+    phaseObjParse,
+    phaseRib,
+    phaseInstances,
+    phaseCurves,
+    phaseCount
+};
+static const char* phaseNames[phaseCount] = {
+    "jsonLoad", "materials", "objParse", "ribEmit", "instances", "curves"};
+
+enum statscounter
+{
+    statBytesRead,
+    statBytesWritten,
+    statFaces,
+    statVertices,
+    statInstances,
+    statCurveCVs,
+    statCount
+};
+static const char* counterNames[statCount] = {
+    "bytesRead", "bytesWritten", "faces", "vertices", "instances", "curveCVs"};
+
+// Nanoseconds of each phase, and the counters, of an element or
+// archive. elapsed is the wall time from the start to the end of its
+// conversion, and peakMemory the peak resident set size of the
+// process in MB at the end
+struct unitstats
+{
+    atomic<uint64_t> wall[phaseCount]{};
+    atomic<uint64_t> cpu[phaseCount]{};
+    atomic<uint64_t> allocations[phaseCount]{};
+    atomic<uint64_t> counters[statCount]{};
+    atomic<uint64_t> elapsed{0};
+    atomic<double> peakMemory{0};
+};
+
+static mutex statsLock;
+static map<string, unique_ptr<unitstats>> elementStats, archiveStats;
+static thread_local unitstats* t_stats = nullptr;
+
+// Every allocation made through operator new is counted for the
+// thread making it, which costs next to nothing, so it is always done.
+// None of these are inlined, so that the compiler doesn't take freeing
+// what operator new returned for a mismatch
+static thread_local uint64_t t_allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    t_allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const nothrow_t&) noexcept
+{
+    t_allocations++;
+    return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, const nothrow_t&) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static uint64_t wallClock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return uint64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+static uint64_t threadClock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return uint64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// The record of the element or archive name, or null without --stats
+static unitstats* statsUnit(map<string, unique_ptr<unitstats>>& units, const string& name)
+{
+    if (options.stats.empty()) return nullptr;
+    lock_guard<mutex> lock(statsLock);
+    unique_ptr<unitstats>& u = units[name];
+    if (!u) u.reset(new unitstats);
+    return u.get();
+}
+
+// Make u the record of the current thread until the end of the scope.
+// If timed, the scope is the whole conversion of u
+struct statsscope
+{
+    explicit statsscope(unitstats* u, bool timed = false)
+        : saved(t_stats), unit(timed ? u : nullptr), start(unit ? wallClock() : 0)
+    {
+        t_stats = u;
+    }
+    ~statsscope()
+    {
+        if (unit)
+        {
+            unit->elapsed += wallClock() - start;
+            unit->peakMemory = peakMemory();
+        }
+        t_stats = saved;
+    }
+    unitstats* saved;
+    unitstats* unit;
+    uint64_t start;
+};
+
+// Time the rest of the scope as phase of the current record, if any
+struct phasescope
+{
+    explicit phasescope(statsphase phase) : phase(phase), unit(t_stats), parent(t_phase)
+    {
+        if (!unit) return;
+        t_phase = this;
+        wall = wallClock();
+        cpu = threadClock();
+        allocations = t_allocations;
+    }
+    ~phasescope()
+    {
+        if (!unit) return;
+        uint64_t w = wallClock() - wall, c = threadClock() - cpu;
+        uint64_t a = t_allocations - allocations;
+        unit->wall[phase].fetch_add(w - min(w, childWall), memory_order_relaxed);
+        unit->cpu[phase].fetch_add(c - min(c, childCpu), memory_order_relaxed);
+        unit->allocations[phase].fetch_add(a - min(a, childAllocations), memory_order_relaxed);
+        if (parent)
+        {
+            parent->childWall += w;
+            parent->childCpu += c;
+            parent->childAllocations += a;
+        }
+        t_phase = parent;
+    }
+
+    statsphase phase;
+    unitstats* unit;
+    phasescope* parent;
+    uint64_t wall = 0, cpu = 0, childWall = 0, childCpu = 0;
+    uint64_t allocations = 0, childAllocations = 0;
+    static thread_local phasescope* t_phase;
+};
+thread_local phasescope* phasescope::t_phase = nullptr;
+
+static void addStat(statscounter counter, uint64_t n)
+{
+    if (unitstats* u = t_stats) u->counters[counter].fetch_add(n, memory_order_relaxed);
+}
+
+static void addRead(const string& filename)
+{
+    struct stat st;
+    if (t_stats && stat(filename.c_str(), &st) == 0) addStat(statBytesRead, st.st_size);
+}
+
+static json unitJson(const unitstats& u)
+{
+    json j;
+    j["seconds"] = u.elapsed * 1e-9;
+    j["peakRSSMB"] = u.peakMemory.load();
+    for (int p = 0; p < phaseCount; ++p)
+    {
+        j["phases"][phaseNames[p]] = {{"wallSeconds", u.wall[p] * 1e-9},
+            {"cpuSeconds", u.cpu[p] * 1e-9}, {"allocations", u.allocations[p].load()}};
+    }
+    for (int c = 0; c < statCount; ++c) j[counterNames[c]] = u.counters[c].load();
+    return j;
+}
+
+// Write the records of every element and archive, and their totals,
+// to the --stats file
+static void writeStats(double elapsed)
+{
+    if (options.stats.empty()) return;
+    lock_guard<mutex> lock(statsLock);
+    unitstats total;
+    json j;
+    auto add = [&](const char* kind, const map<string, unique_ptr<unitstats>>& units) {
+        j[kind] = json::object();
+        for (auto& u : units)
+        {
+            j[kind][u.first] = unitJson(*u.second);
+            for (int p = 0; p < phaseCount; ++p)
+            {
+                total.wall[p] += u.second->wall[p];
+                total.cpu[p] += u.second->cpu[p];
+                total.allocations[p] += u.second->allocations[p];
+            }
+            for (int c = 0; c < statCount; ++c) total.counters[c] += u.second->counters[c];
+        }
+    };
+    add("elements", elementStats);
+    add("archives", archiveStats);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    total.elapsed = uint64_t(elapsed * 1e9);
+    total.peakMemory = peakMemory();
+    j["totals"] = unitJson(total);
+    j["totals"]["cpuSeconds"] = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+                                usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    j["threads"] = options.threads > 0 ? options.threads : int(thread::hardware_concurrency());
+    j["options"] = optionsSignature();
+
+    ofstream file(options.stats.c_str());
+    file << j.dump(1) << endl;
+    if (!file) cerr << "Unable to write " << options.stats << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output sinks
+////////////////////////////////////////////////////////////////////////////////
+
+// Every RIB file is written through one of several sinks, chosen with
+// --output-sink:
+//
+//   posix  buffered write() calls
+//   uring  several large writes kept in flight at once with io_uring
+//   mmap   copies into a shared mapping of the file, which is extended
+//          with fallocate a window at a time
+//
+// A sink is a streambuf, so compression and the pipeline stack on top
+// of any of them. close() finishes the file and reports whether
+// everything was written.
+class outputsink : public streambuf
+{
+public:
+    outputsink() : m_fd(-1), m_written(0), m_failed(false) {}
+    virtual ~outputsink() {}
+
+    virtual bool open(const string& filename) = 0;
+    virtual bool close() = 0;
+
+    // Bytes written, once closed
+    uint64_t written() const { return m_written; }
+
+protected:
+    // Flushing the ostream mustn't force out a tiny write
+    int sync() { return 0; }
+
+    // Write all of data at offset, whatever the sink
+    void pwriteAll(const char* data, size_t n, uint64_t offset)
+    {
+        while (n > 0 && !m_failed)
+        {
+            ssize_t w = pwrite(m_fd, data, n, offset);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0)
+            {
+                m_failed = true;
+                break;
+            }
+            data += w;
+            n -= w;
+            offset += w;
+        }
+    }
+
+    int m_fd;
+    uint64_t m_written;
+    bool m_failed;
+};
+
+class posixsink : public outputsink
+{
+public:
+    posixsink() : m_buffer(bufferSize) { setp(&m_buffer[0], &m_buffer[0] + m_buffer.size()); }
+    ~posixsink() { close(); }
+
+    bool open(const string& filename)
+    {
+        m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        return m_fd >= 0;
+    }
+
+    bool close()
+    {
+        if (m_fd < 0) return false;
+        drain();
+        m_failed = ::close(m_fd) != 0 || m_failed;
+        m_fd = -1;
+        return !m_failed;
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        drain();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // Writes at least as large as the buffer skip it
+    streamsize xsputn(const char* s, streamsize n)
+    {
+        if (size_t(n) < m_buffer.size()) return streambuf::xsputn(s, n);
+        drain();
+        pwriteAll(s, n, m_written);
+        m_written += n;
+        return n;
+    }
+
+private:
+    static const size_t bufferSize = 4 << 20;
+
+    void drain()
+    {
+        size_t n = pptr() - pbase();
+        pwriteAll(pbase(), n, m_written);
+        m_written += n;
+        setp(&m_buffer[0], &m_buffer[0] + m_buffer.size());
+    }
+
+    vector<char> m_buffer;
+};
+
+#ifdef MIS2RIB_WITH_URING
+// Fills blocks in turn, each of which is written by the kernel while
+// the next is filled, through an io_uring set up with raw system calls
+// so as not to need liburing. A block only waits for its last write to
+// finish when its turn to be filled comes round again. Should the ring
+// be unavailable, or a write fail or come up short, the rest is
+// written with pwrite instead
+class uringsink : public outputsink
+{
+public:
+    uringsink() : m_ring(-1), m_fallback(false), m_current(0), m_offset(0), m_inflight(0)
+    {
+        for (auto& b : m_blocks)
+        {
+            b.data.reset(new char[blockSize]);
+            b.size = 0;
+            b.busy = false;
+        }
+        setp(m_blocks[0].data.get(), m_blocks[0].data.get() + blockSize);
+    }
+    ~uringsink() { close(); }
+
+    bool open(const string& filename)
+    {
+        m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (m_fd < 0) return false;
+        setupRing();
+        return true;
+    }
+
+    bool close()
+    {
+        if (m_fd < 0) return false;
+        submit();
+        while (m_inflight > 0) reap();
+        if (m_ring >= 0)
+        {
+            munmap(m_sq, m_sqSize);
+            if (m_cq != m_sq) munmap(m_cq, m_cqSize);
+            munmap(m_sqes, m_sqesSize);
+            ::close(m_ring);
+            m_ring = -1;
+        }
+        m_failed = ::close(m_fd) != 0 || m_failed;
+        m_fd = -1;
+        m_written = m_offset;
+        return !m_failed;
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        submit();
+        m_current = (m_current + 1) % depth;
+        while (m_blocks[m_current].busy) reap();
+        setp(m_blocks[m_current].data.get(), m_blocks[m_current].data.get() + blockSize);
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    static const size_t blockSize = 4 << 20;
+    static const unsigned depth = 4;
+
+    struct block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+        uint64_t offset;
+        bool busy;
+    };
+
+    void setupRing()
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        m_ring = int(syscall(__NR_io_uring_setup, depth, &p));
+        if (m_ring < 0)
+        {
+            static once_flag warned;
+            call_once(warned, []() {
+                cerr << "io_uring is unavailable; writing with pwrite" << endl;
+            });
+            return;
+        }
+        m_sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) m_sqSize = m_cqSize = max(m_sqSize, m_cqSize);
+        m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        const int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+        m_sq = static_cast<char*>(mmap(0, m_sqSize, prot, flags, m_ring, IORING_OFF_SQ_RING));
+        m_cq = (p.features & IORING_FEAT_SINGLE_MMAP)
+                   ? m_sq
+                   : static_cast<char*>(mmap(0, m_cqSize, prot, flags, m_ring, IORING_OFF_CQ_RING));
+        m_sqes = static_cast<io_uring_sqe*>(
+            mmap(0, m_sqesSize, prot, flags, m_ring, IORING_OFF_SQES));
+        if (m_sq == MAP_FAILED || m_cq == MAP_FAILED || m_sqes == MAP_FAILED)
+        {
+            ::close(m_ring);
+            m_ring = -1;
+            return;
+        }
+        m_sqTail = reinterpret_cast<unsigned*>(m_sq + p.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(m_sq + p.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(m_sq + p.sq_off.array);
+        m_cqHead = reinterpret_cast<unsigned*>(m_cq + p.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(m_cq + p.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(m_cq + p.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(m_cq + p.cq_off.cqes);
+    }
+
+    // Start writing the current block. There are never more writes in
+    // flight than entries in the ring, so there is always room. If the
+    // kernel won't take the write, it and every block after it are
+    // written with pwrite instead; the entry left in the ring is never
+    // submitted
+    void submit()
+    {
+        block& b = m_blocks[m_current];
+        b.size = pptr() - pbase();
+        b.offset = m_offset;
+        m_offset += b.size;
+        setp(nullptr, nullptr);
+        if (b.size == 0) return;
+        if (m_ring < 0 || m_fallback)
+        {
+            pwriteAll(b.data.get(), b.size, b.offset);
+            return;
+        }
+        unsigned tail = *m_sqTail;
+        unsigned index = tail & m_sqMask;
+        io_uring_sqe& e = m_sqes[index];
+        memset(&e, 0, sizeof(e));
+        e.opcode = IORING_OP_WRITE;
+        e.fd = m_fd;
+        e.addr = uint64_t(uintptr_t(b.data.get()));
+        e.len = unsigned(b.size);
+        e.off = b.offset;
+        e.user_data = m_current;
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        b.busy = true;
+        for (;;)
+        {
+            long n = syscall(__NR_io_uring_enter, m_ring, 1, 0, 0, nullptr, 0);
+            if (n > 0)
+            {
+                m_inflight++;
+                return;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EBUSY) && m_inflight > 0)
+            {
+                // Out of resources until an earlier write finishes
+                reap();
+                continue;
+            }
+            break;
+        }
+        static once_flag warned;
+        call_once(warned, []() {
+            cerr << "io_uring write failed; writing with pwrite" << endl;
+        });
+        m_fallback = true;
+        b.busy = false;
+        pwriteAll(b.data.get(), b.size, b.offset);
+    }
+
+    // Wait for a write to finish. If the kernel can't be asked for
+    // completions any more, there is no telling what was written, so
+    // the sink fails
+    void reap()
+    {
+        unsigned head = *m_cqHead;
+        while (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+        {
+            long n = syscall(__NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (n < 0 && errno != EINTR)
+            {
+                m_failed = true;
+                m_fallback = true;
+                for (auto& b : m_blocks) b.busy = false;
+                m_inflight = 0;
+                return;
+            }
+        }
+        const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+        block& b = m_blocks[cqe.user_data];
+        size_t done = cqe.res > 0 ? size_t(cqe.res) : 0;
+        __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+        if (done < b.size) pwriteAll(b.data.get() + done, b.size - done, b.offset + done);
+        b.busy = false;
+        m_inflight--;
+    }
+
+    block m_blocks[depth];
+    int m_ring;
+    bool m_fallback;
+    unsigned m_current;
+    uint64_t m_offset;
+    unsigned m_inflight;
+    char* m_sq = nullptr;
+    char* m_cq = nullptr;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqSize = 0, m_cqSize = 0, m_sqesSize = 0;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+#endif
+
+// Copies straight into the page cache through a shared mapping of a
+// window of the file, so there is no write() call or copy into the
+// kernel. Windows start small, for the many small archives, and double
+// up to a limit. Each is allocated with fallocate before it is mapped,
+// since writing to a page of a sparse file which the disk has no room
+// for would raise SIGBUS; where the filesystem can't allocate, the
+// file is extended with ftruncate instead. The file is cut back to
+// what was written when it is closed
+class mmapsink : public outputsink
+{
+public:
+    mmapsink() : m_window(nullptr), m_windowSize(0), m_offset(0) {}
+    ~mmapsink() { close(); }
+
+    bool open(const string& filename)
+    {
+        m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (m_fd < 0) return false;
+        map();
+        return true;
+    }
+
+    bool close()
+    {
+        if (m_fd < 0) return false;
+        uint64_t size = m_offset + (pptr() - pbase());
+        unmap();
+        m_failed = ftruncate(m_fd, size) != 0 || m_failed;
+        m_failed = ::close(m_fd) != 0 || m_failed;
+        m_fd = -1;
+        m_written = size;
+        return !m_failed;
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        m_offset += pptr() - pbase();
+        unmap();
+        map();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    static const size_t minWindowSize = 1 << 20;
+    static const size_t maxWindowSize = 64 << 20;
+
+    void map()
+    {
+        size_t size = m_windowSize = clamp(2 * m_windowSize, minWindowSize, maxWindowSize);
+        if (!m_failed && posix_fallocate(m_fd, m_offset, size) != 0 &&
+            ftruncate(m_fd, m_offset + size) != 0)
+        {
+            m_failed = true;
+        }
+        void* p = m_failed ? MAP_FAILED
+                           : mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                                 m_offset);
+        if (p == MAP_FAILED)
+        {
+            // Carry on into memory which goes nowhere, and report the
+            // failure on closing
+            m_failed = true;
+            m_scratch.resize(size);
+            setp(&m_scratch[0], &m_scratch[0] + size);
+            return;
+        }
+        m_window = static_cast<char*>(p);
+        madvise(m_window, size, MADV_SEQUENTIAL);
+        setp(m_window, m_window + size);
+    }
+
+    void unmap()
+    {
+        if (m_window) munmap(m_window, m_windowSize);
+        m_window = nullptr;
+        setp(nullptr, nullptr);
+    }
+
+    char* m_window;
+    size_t m_windowSize;
+    uint64_t m_offset;
+    vector<char> m_scratch;
+};
+
+static unique_ptr<outputsink> outputSink()
+{
+#ifdef MIS2RIB_WITH_URING
+    if (options.outputSink == "uring") return unique_ptr<outputsink>(new uringsink);
+#endif
+    if (options.outputSink == "mmap") return unique_ptr<outputsink>(new mmapsink);
+    return unique_ptr<outputsink>(new posixsink);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipelined I/O
+////////////////////////////////////////////////////////////////////////////////
+
+// With --pipeline, an OBJ file is converted by three stages running on
+// threads of their own, so that reading the file, converting it and
+// writing the RIB all overlap: a reader which pages the file in ahead
+// of the parser (see prefetcher), the parser, which writes the RIB of
+// each group as it goes, and a writer which passes the RIB on to the
+// file, or to its compression (see pipebuf). Both work in blocks of
+// --pipeline-block MB, and neither gets more than --pipeline-depth
+// blocks ahead of the other side.
+
+// A bounded queue between one producer and one consumer thread. The
+// ring itself is lock free; a side which finds it full or empty spins
+// for a little, then sleeps until the other side moves
+template <typename T>
+class spscqueue
+{
+public:
+    explicit spscqueue(size_t capacity) : m_ring(capacity + 1), m_head(0), m_tail(0), m_sleepers(0)
+    {
+    }
+
+    void push(T value)
+    {
+        size_t tail = m_tail.load(memory_order_relaxed);
+        size_t next = (tail + 1) % m_ring.size();
+        waitUntil([&]() { return next != m_head.load(); });
+        m_ring[tail] = move(value);
+        m_tail.store(next);
+        wake();
+    }
+
+    T pop()
+    {
+        size_t head = m_head.load(memory_order_relaxed);
+        waitUntil([&]() { return head != m_tail.load(); });
+        T value = move(m_ring[head]);
+        m_head.store((head + 1) % m_ring.size());
+        wake();
+        return value;
+    }
+
+private:
+    spscqueue(const spscqueue&);
+    spscqueue& operator=(const spscqueue&);
+
+    // A sleeper counts itself before checking the ring under the
+    // lock, and the other side checks for sleepers after moving, so
+    // one of them always sees the other
+    template <typename F>
+    void waitUntil(F ready)
+    {
+        for (int i = 0; i < 64; ++i)
+        {
+            if (ready()) return;
+            this_thread::yield();
+        }
+        unique_lock<mutex> lock(m_lock);
+        m_sleepers++;
+        m_moved.wait(lock, ready);
+        m_sleepers--;
+    }
+
+    void wake()
+    {
+        if (m_sleepers.load() == 0) return;
+        lock_guard<mutex> lock(m_lock);
+        m_moved.notify_all();
+    }
+
+    vector<T> m_ring;
+    atomic<size_t> m_head, m_tail;
+    atomic<int> m_sleepers;
+    mutex m_lock;
+    condition_variable m_moved;
+};
+
+// The reader stage: pages a mapped file in, a block at a time, on a
+// thread of its own
+class prefetcher
+{
+public:
+    prefetcher(const char* begin, const char* end)
+        : m_begin(begin),
+          m_end(end),
+          m_read(begin),
+          m_done(begin == end),
+          m_ready(max(options.pipelineDepth, 1)),
+          m_stop(false)
+    {
+        if (!m_done) m_thread = thread(&prefetcher::run, this);
+    }
+    ~prefetcher()
+    {
+        // Unblock the reader if it's waiting for room in the queue
+        m_stop = true;
+        while (!m_done) next();
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    // Wait until everything before p has been read
+    void wait(const char* p)
+    {
+        while (m_read < p && !m_done) next();
+    }
+
+private:
+    prefetcher(const prefetcher&);
+    prefetcher& operator=(const prefetcher&);
+
+    void next()
+    {
+        const char* p = m_ready.pop();
+        if (p)
+            m_read = p;
+        else
+            m_done = true;
+    }
+
+    // Touch a byte of every page of each block, which makes this
+    // thread wait for the disk instead of the parser
+    void run()
+    {
+        const size_t block = size_t(max(options.pipelineBlock, 1)) << 20;
+        const size_t page = size_t(sysconf(_SC_PAGESIZE));
+        const uintptr_t mask = ~uintptr_t(page - 1);
+        for (const char* p = m_begin; p < m_end && !m_stop;)
+        {
+            const char* e = p + min(block, size_t(m_end - p));
+            char* start = reinterpret_cast<char*>(uintptr_t(p) & mask);
+            madvise(start, e - start, MADV_WILLNEED);
+            for (const char* q = p; q < e; q += page) (void)*(const volatile char*)q;
+            m_ready.push(e);
+            p = e;
+        }
+        m_ready.push(nullptr);
+    }
+
+    const char* m_begin;
+    const char* m_end;
+    const char* m_read;
+    bool m_done;
+    spscqueue<const char*> m_ready;
+    atomic<bool> m_stop;
+    thread m_thread;
+};
+
+// The writer stage: a streambuf which hands what's written to it, in
+// blocks, to a thread which writes them to another streambuf. The
+// blocks go back and forth between the two threads, so nothing is
+// allocated once the pipeline is full
+class pipebuf : public streambuf
+{
+public:
+    explicit pipebuf(streambuf* sink)
+        : m_sink(sink),
+          m_blockSize(size_t(max(options.pipelineBlock, 1)) << 20),
+          m_depth(max(options.pipelineDepth, 1)),
+          m_full(m_depth),
+          m_free(m_depth),
+          m_current(nullptr),
+          m_finished(false)
+    {
+        m_thread = thread(&pipebuf::run, this);
+        next();
+    }
+    ~pipebuf() { finish(); }
+
+    // Write out everything, and wait for the writer to finish
+    void finish()
+    {
+        if (m_finished) return;
+        m_finished = true;
+        if (pptr() > pbase()) submit();
+        m_full.push(nullptr);
+        m_thread.join();
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        submit();
+        next();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // Flushing the ostream mustn't force out a tiny block
+    int sync() { return 0; }
+
+private:
+    struct block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    // Take a block to fill: a new one until there are depth of them,
+    // then whichever the writer finishes with first
+    void next()
+    {
+        if (m_blocks.size() < m_depth)
+        {
+            m_blocks.push_back({unique_ptr<char[]>(new char[m_blockSize]), 0});
+            m_current = &m_blocks.back();
+        }
+        else
+        {
+            m_current = m_free.pop();
+        }
+        setp(m_current->data.get(), m_current->data.get() + m_blockSize);
+    }
+
+    void submit()
+    {
+        m_current->size = pptr() - pbase();
+        m_full.push(m_current);
+        setp(nullptr, nullptr);
+    }
+
+    void run()
+    {
+        while (block* b = m_full.pop())
+        {
+            m_sink->sputn(b->data.get(), b->size);
+            m_free.push(b);
+        }
+    }
+
+    streambuf* m_sink;
+    size_t m_blockSize;
+    size_t m_depth;
+    deque<block> m_blocks;
+    spscqueue<block*> m_full, m_free;
+    block* m_current;
+    bool m_finished;
+    thread m_thread;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Compressed output
+////////////////////////////////////////////////////////////////////////////////
+
+// Totals of compressed streams
+struct compresstotals
+{
+    atomic<int> streams{0};
+    atomic<uint64_t> bytesIn{0}, bytesOut{0}, nanoseconds{0};
+};
+
+// The totals over every stream written by this process, and those of
+// the element the current thread is converting, if any, which are
+// passed on to the tasks it starts like the --stats record
+static compresstotals compressStats;
+static thread_local compresstotals* t_compress = nullptr;
+
+struct compressscope
+{
+    explicit compressscope(compresstotals* c) : saved(t_compress) { t_compress = c; }
+    ~compressscope() { t_compress = saved; }
+    compresstotals* saved;
+};
+
+// The number of blocks being compressed on threads of their own, over
+// every stream. Many streams are written at once in scene mode, so the
+// limit of --compress-threads is shared by all of them; a block which
+// finds them all busy is compressed by the thread writing the stream
+static atomic<int> compressJobs(0);
+
+static bool startCompressJob(int limit)
+{
+    int n = compressJobs.load();
+    while (n < limit)
+    {
+        if (compressJobs.compare_exchange_weak(n, n + 1)) return true;
+    }
+    return false;
+}
+
+// A streambuf which compresses everything written to it in large
+// blocks, in parallel, before passing it on to another streambuf.
+//
+// For gzip we follow the same approach as pigz: each block is raw
+// deflated independently, primed with the last 32K of the previous
+// block as a dictionary and ended with a sync flush, so the
+// concatenation is a single ordinary gzip member which any zlib based
+// reader (including the renderer's) can decompress. Since nothing
+// depends on which thread compressed what, the output is identical
+// regardless of the number of threads. zstd output is a sequence of
+// independent frames.
+class compressbuf : public streambuf
+{
+public:
+    compressbuf(streambuf* sink)
+        : m_sink(sink), m_unit(t_compress), m_crc(crc32(0, 0, 0)), m_length(0),
+          m_finished(false), m_failed(false)
+    {
+        m_zstd = (options.compress == "zstd");
+        m_level = options.compressLevel >= 0 ? options.compressLevel : (m_zstd ? 3 : 6);
+        m_threads = options.compressThreads > 0 ? options.compressThreads
+                                                : max(1u, thread::hardware_concurrency());
+        m_block.resize(blockSize);
+        setp(&m_block[0], &m_block[0] + m_block.size());
+        if (!m_zstd)
+        {
+            // gzip header, with no name and a zero timestamp so that
+            // the output is reproducible
+            static const char header[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+            m_sink->sputn(header, sizeof(header));
+            count(0, 0, sizeof(header), 0);
+        }
+        count(1, 0, 0, 0);
+    }
+    ~compressbuf() { finish(); }
+
+    void finish()
+    {
+        if (m_finished) return;
+        m_finished = true;
+        submit(true);
+        while (!m_pending.empty()) retire();
+        if (!m_zstd)
+        {
+            char trailer[8];
+            for (int i = 0; i < 4; ++i)
+            {
+                trailer[i] = char(m_crc >> (8 * i));
+                trailer[4 + i] = char(m_length >> (8 * i));
+            }
+            m_sink->sputn(trailer, sizeof(trailer));
+            count(0, 0, sizeof(trailer), 0);
+        }
+        m_sink->pubsync();
+    }
+
+    // Whether a block couldn't be compressed, leaving the output
+    // unreadable
+    bool failed() const { return m_failed; }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        submit(false);
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // Flushing the ostream (std::endl!) mustn't force out a tiny block
+    int sync() { return 0; }
+
+private:
+    static const size_t blockSize = 4 << 20;
+    static const size_t dictionarySize = 32768;
+
+    struct block
+    {
+        string data;
+        uLong crc;
+        size_t length;
+        uint64_t nanoseconds;
+        bool ok;
+    };
+
+    // Add to the totals of the process and of the element
+    void count(int streams, uint64_t in, uint64_t out, uint64_t nanoseconds)
+    {
+        for (compresstotals* t : {&compressStats, m_unit})
+        {
+            if (!t) continue;
+            t->streams += streams;
+            t->bytesIn += in;
+            t->bytesOut += out;
+            t->nanoseconds += nanoseconds;
+        }
+    }
+
+    void submit(bool last)
+    {
+        size_t n = pptr() - pbase();
+        if (n == 0 && (!last || m_zstd))
+        {
+            return;
+        }
+        auto input = make_shared<vector<char>>(m_block.begin(), m_block.begin() + n);
+        auto dictionary = make_shared<string>(m_dictionary);
+        if (!m_zstd)
+        {
+            // Prime the next block with the tail of this one
+            m_dictionary.assign(
+                m_block.begin() + (n > dictionarySize ? n - dictionarySize : 0),
+                m_block.begin() + n);
+        }
+        setp(&m_block[0], &m_block[0] + m_block.size());
+
+        bool zstd = m_zstd;
+        int level = m_level;
+        if (m_pending.size() >= (size_t)m_threads) retire();
+        if (m_threads > 1 && startCompressJob(m_threads))
+        {
+            m_pending.push_back(async(launch::async, [input, dictionary, last, zstd, level]() {
+                block b = compressBlock(*input, *dictionary, last, zstd, level);
+                compressJobs--;
+                return b;
+            }));
+        }
+        else
+        {
+            promise<block> p;
+            p.set_value(compressBlock(*input, *dictionary, last, zstd, level));
+            m_pending.push_back(p.get_future());
+        }
+        // Pass on what's finished, so that blocks compressed here
+        // aren't held behind the others
+        while (!m_pending.empty() &&
+               m_pending.front().wait_for(chrono::seconds(0)) == future_status::ready)
+        {
+            retire();
+        }
+    }
+
+    void retire()
+    {
+        block b = m_pending.front().get();
+        m_pending.pop_front();
+        if (!b.ok) m_failed = true;
+        m_sink->sputn(b.data.data(), b.data.size());
+        m_crc = crc32_combine(m_crc, b.crc, b.length);
+        m_length += b.length;
+        count(0, b.length, b.data.size(), b.nanoseconds);
+    }
+
+    static block compressBlock(
+        const vector<char>& input, const string& dictionary, bool last, bool zstd, int level)
+    {
+        double start = seconds();
+        block b;
+        b.length = input.size();
+        b.crc = crc32(crc32(0, 0, 0), (const Bytef*)input.data(), input.size());
+        if (zstd)
+        {
+#ifdef MIS2RIB_WITH_ZSTD
+            b.data.resize(ZSTD_compressBound(input.size()));
+            size_t n = ZSTD_compress(&b.data[0], b.data.size(), input.data(), input.size(), level);
+            b.ok = !ZSTD_isError(n);
+            b.data.resize(b.ok ? n : 0);
+#else
+            b.ok = false;
+#endif
+        }
+        else
+        {
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            b.ok = deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            if (!dictionary.empty())
+            {
+                b.ok = b.ok &&
+                       deflateSetDictionary(&z, (const Bytef*)dictionary.data(),
+                           dictionary.size()) == Z_OK;
+            }
+            b.data.resize(deflateBound(&z, input.size()) + 16);
+            z.next_in = (Bytef*)input.data();
+            z.avail_in = input.size();
+            z.next_out = (Bytef*)&b.data[0];
+            z.avail_out = b.data.size();
+            int status = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+            b.ok = b.ok && z.avail_in == 0 && status == (last ? Z_STREAM_END : Z_OK);
+            b.data.resize(z.total_out);
+            deflateEnd(&z);
+        }
+        b.nanoseconds = uint64_t((seconds() - start) * 1e9);
+        return b;
+    }
+
+    streambuf* m_sink;
+    compresstotals* m_unit;
+    vector<char> m_block;
+    string m_dictionary;
+    deque<future<block>> m_pending;
+    uLong m_crc;
+    uint64_t m_length;
+    bool m_zstd;
+    int m_level;
+    int m_threads;
+    bool m_finished;
+    bool m_failed;
+};
+
+// An output stream for a RIB file, or for standard output if no
+// filename is given, which is compressed if requested on the command
+// line. With --incremental the file is written under a temporary
+// name first, and only replaces the existing file if it differs.
+// If pipelined, it is written by a thread of its own with --pipeline.
+// Files are written through the --output-sink.
+//
+// The output is only complete once commit() succeeds. A temporary file
+// which isn't committed, because the conversion failed part way, is
+// removed, leaving the last good output in place.
+class ribstream
+{
+public:
+    explicit ribstream(const string& filename = string(), bool pipelined = false)
+        : m_opened(false), m_finished(false), m_ostr(0)
+    {
+        streambuf* sink = cout.rdbuf();
+        if (!filename.empty())
+        {
+            addOutput(filename);
+            m_filename = filename;
+            string name = filename;
+            if (options.incremental)
+            {
+                static atomic<int> count(0);
+                m_temp = filename + ".tmp" + to_string(getpid()) + "." + to_string(count++);
+                name = m_temp;
+            }
+            m_file = outputSink();
+            m_opened = m_file->open(name);
+            if (!m_opened)
+            {
+                cerr << "Unable to write " << filename << endl;
+            }
+            sink = m_file.get();
+        }
+        if (!options.compress.empty())
+        {
+            m_compress.reset(new compressbuf(sink));
+            sink = m_compress.get();
+        }
+        if (pipelined && options.pipeline)
+        {
+            m_pipe.reset(new pipebuf(sink));
+            sink = m_pipe.get();
+        }
+        m_ostr.rdbuf(sink);
+    }
+    ~ribstream()
+    {
+        finish();
+        if (!m_temp.empty()) unlink(m_temp.c_str());
+    }
+    ostream& stream() { return m_ostr; }
+
+    // Finish writing, and move a temporary file into place. Returns
+    // false if the output couldn't be written
+    bool commit()
+    {
+        bool ok = finish();
+        if (ok && !m_temp.empty())
+        {
+            ok = replaceIfChanged(m_temp, m_filename);
+            m_temp.clear();
+        }
+        return ok;
+    }
+
+private:
+    bool finish()
+    {
+        if (m_finished) return m_ok;
+        m_finished = true;
+        m_ostr.flush();
+        if (m_pipe) m_pipe->finish();
+        if (m_compress) m_compress->finish();
+        m_ok = !m_ostr.bad() && (m_filename.empty() || m_opened) &&
+               !(m_compress && m_compress->failed());
+        if (m_opened)
+        {
+            if (!m_file->close()) m_ok = false;
+            addStat(statBytesWritten, m_file->written());
+        }
+        return m_ok;
+    }
+
+    string m_filename, m_temp;
+    unique_ptr<outputsink> m_file;
+    bool m_opened, m_finished, m_ok;
+    unique_ptr<compressbuf> m_compress;
+    unique_ptr<pipebuf> m_pipe;
+    ostream m_ostr;
+};
+
+static void reportCompression(const string& name, const compresstotals& totals = compressStats)
+{
+    if (totals.streams == 0) return;
+    double in = totals.bytesIn * 1e-6, out = totals.bytesOut * 1e-6;
+    double cpu = totals.nanoseconds * 1e-9;
+    cerr << name << ": compressed " << totals.streams << " streams, " << in << " MB -> "
+         << out << " MB (" << (out > 0 ? in / out : 0) << ":1), " << (cpu > 0 ? in / cpu : 0)
+         << " MB/s per thread" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Thread pool
+////////////////////////////////////////////////////////////////////////////////
+
+// A small work stealing thread pool. Tasks submitted from outside the
+// pool go on a shared queue and are started in the order they were
+// submitted. Tasks submitted from within a task go on the submitting
+// worker's own deque; a worker takes its most recent task first,
+// while idle workers steal the oldest tasks from the others.
+//
+// The thread which creates the pool counts as one of its threads:
+// it runs tasks while waiting on a TaskGroup, as do workers waiting
+// on subtasks, so a pool of one thread simply runs everything inline.
+// Each task may belong to a group, and a thread can be restricted to
+// running only the tasks of the group it waits on.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int nthreads) : m_queued(0), m_done(false)
+    {
+        nthreads = max(nthreads, 1);
+        for (int i = 0; i < nthreads - 1; ++i) m_queues.emplace_back(new queue);
+        for (int i = 0; i < nthreads - 1; ++i)
+        {
+            m_threads.emplace_back(&ThreadPool::worker, this, i);
+        }
+    }
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(m_lock);
+            m_done = true;
+        }
+        m_wakeup.notify_all();
+        for (auto& t : m_threads) t.join();
+    }
+
+    int size() const { return (int)m_threads.size() + 1; }
+
+    void submit(function<void()> task, const void* group = nullptr)
+    {
+        queue& q = (t_pool == this && t_worker >= 0) ? *m_queues[t_worker] : m_shared;
+        {
+            lock_guard<mutex> lock(q.lock);
+            q.tasks.push_back({move(task), group});
+        }
+        {
+            lock_guard<mutex> lock(m_lock);
+            ++m_queued;
+        }
+        m_wakeup.notify_one();
+    }
+
+    // Run one queued task on the calling thread, if there is one, only
+    // considering the tasks of group if one is given
+    bool runPending(const void* group = nullptr)
+    {
+        function<void()> task;
+        if (!take(t_pool == this ? t_worker : -1, task, group)) return false;
+        task();
+        return true;
+    }
+
+private:
+    struct pending
+    {
+        function<void()> task;
+        const void* group;
+    };
+
+    struct queue
+    {
+        mutex lock;
+        deque<pending> tasks;
+    };
+
+    void worker(int index)
+    {
+        t_pool = this;
+        t_worker = index;
+        for (;;)
+        {
+            function<void()> task;
+            if (take(index, task))
+            {
+                task();
+                continue;
+            }
+            unique_lock<mutex> lock(m_lock);
+            m_wakeup.wait(lock, [this]() { return m_queued > 0 || m_done; });
+            if (m_done && m_queued == 0) return;
+        }
+    }
+
+    bool take(int index, function<void()>& task, const void* group = nullptr)
+    {
+        if (index >= 0 && popBack(*m_queues[index], task, group)) return true;
+        if (popFront(m_shared, task, group)) return true;
+        for (size_t i = 1; i <= m_queues.size(); ++i)
+        {
+            if (popFront(*m_queues[(index + i) % m_queues.size()], task, group)) return true;
+        }
+        return false;
+    }
+
+    bool popBack(queue& q, function<void()>& task, const void* group)
+    {
+        lock_guard<mutex> lock(q.lock);
+        auto i = q.tasks.rbegin();
+        while (group && i != q.tasks.rend() && i->group != group) ++i;
+        if (i == q.tasks.rend()) return false;
+        task = move(i->task);
+        q.tasks.erase(next(i).base());
+        --m_queued;
+        return true;
+    }
+
+    bool popFront(queue& q, function<void()>& task, const void* group)
+    {
+        lock_guard<mutex> lock(q.lock);
+        auto i = q.tasks.begin();
+        while (group && i != q.tasks.end() && i->group != group) ++i;
+        if (i == q.tasks.end()) return false;
+        task = move(i->task);
+        q.tasks.erase(i);
+        --m_queued;
+        return true;
+    }
+
+    vector<unique_ptr<queue>> m_queues;
+    queue m_shared;
+    vector<thread> m_threads;
+    mutex m_lock;
+    condition_variable m_wakeup;
+    atomic<int> m_queued;
+    bool m_done;
+
+    static thread_local ThreadPool* t_pool;
+    static thread_local int t_worker;
+};
+
+thread_local ThreadPool* ThreadPool::t_pool = 0;
+thread_local int ThreadPool::t_worker = -1;
+
+// The number of locks the current thread holds which another process
+// may be waiting for. While it holds any, waiting on a TaskGroup only
+// helps with the group's own tasks: any other task could wait for a
+// lock held by that process, which may itself be waiting for ours
+static thread_local int t_locksHeld = 0;
+
+// A set of tasks which can be waited on together. The first exception
+// thrown by any of the tasks is rethrown by wait().
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool& pool) : m_pool(pool), m_count(0) {}
+    ~TaskGroup()
+    {
+        try
+        {
+            wait();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void run(function<void()> task)
+    {
+        ++m_count;
+        function<void()> wrapped = [this, task, d = t_dependencies, s = t_stats,
+                                       c = t_compress]() {
+            dependencyscope scope(d);
+            statsscope stats(s);
+            compressscope compress(c);
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                lock_guard<mutex> lock(m_lock);
+                if (!m_exception) m_exception = current_exception();
+            }
+            lock_guard<mutex> lock(m_lock);
+            if (--m_count == 0) m_finished.notify_all();
+        };
+        m_pool.submit(move(wrapped), this);
+    }
+
+    void wait()
+    {
+        while (m_count > 0)
+        {
+            if (!m_pool.runPending(t_locksHeld > 0 ? this : nullptr))
+            {
+                // Nothing to help with; sleep until our tasks finish,
+                // checking back now and then for new work to steal
+                unique_lock<mutex> lock(m_lock);
+                m_finished.wait_for(
+                    lock, chrono::milliseconds(1), [this]() { return m_count == 0; });
+            }
+        }
+        lock_guard<mutex> lock(m_lock);
+        if (m_exception)
+        {
+            exception_ptr e = m_exception;
+            m_exception = nullptr;
+            rethrow_exception(e);
+        }
+    }
+
+private:
+    ThreadPool& m_pool;
+    atomic<int> m_count;
+    mutex m_lock;
+    condition_variable m_finished;
+    exception_ptr m_exception;
+};
+
+// The pool shared by every parallel part of the conversion
+static ThreadPool& threadPool()
+{
+    static ThreadPool pool(options.threads > 0 ? options.threads : thread::hardware_concurrency());
+    return pool;
+}
+
+// Run f(RibWriter&) as a task, collecting its RIB in *result so that
+// the caller can stitch the output of several tasks back together in
+// order once they have finished
+template <typename F>
+static void runBuffered(TaskGroup& tasks, bool binary, string* result, F f)
+{
+    tasks.run([binary, result, f]() {
+        ostringstream buffer;
+        {
+            RibWriter rib(buffer, binary);
+            f(rib);
+        }
+        *result = buffer.str();
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Arenas
+////////////////////////////////////////////////////////////////////////////////
+
+// Memory for the short lived containers of one piece of work, such as
+// decimating a group, handed out from large blocks. Nothing is freed
+// on its own; reset() releases everything at once and keeps the
+// blocks, so that once an arena has grown to the size of the largest
+// piece of work it stops allocating
+class arena
+{
+public:
+    arena() : m_block(0), m_ptr(nullptr), m_end(nullptr) {}
+
+    void* allocate(size_t n, size_t align)
+    {
+        char* p = align_up(m_ptr, align);
+        if (!m_ptr || n > size_t(m_end - p))
+        {
+            next(n + align);
+            p = align_up(m_ptr, align);
+        }
+        m_ptr = p + n;
+        return p;
+    }
+
+    void reset()
+    {
+        m_block = 0;
+        m_ptr = m_blocks.empty() ? nullptr : m_blocks[0].data.get();
+        m_end = m_blocks.empty() ? nullptr : m_ptr + m_blocks[0].size;
+    }
+
+private:
+    arena(const arena&);
+    arena& operator=(const arena&);
+
+    static const size_t blockSize = 1 << 16;
+
+    struct block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    static char* align_up(char* p, size_t align)
+    {
+        return reinterpret_cast<char*>((uintptr_t(p) + align - 1) & ~uintptr_t(align - 1));
+    }
+
+    // Move on to the next block which holds at least n bytes, adding
+    // one of at least twice the size of the last if there is none
+    void next(size_t n)
+    {
+        size_t b = m_ptr ? m_block + 1 : 0;
+        while (b < m_blocks.size() && m_blocks[b].size < n) ++b;
+        if (b == m_blocks.size())
+        {
+            size_t size = max(n, m_blocks.empty() ? blockSize : 2 * m_blocks.back().size);
+            m_blocks.push_back({unique_ptr<char[]>(new char[size]), size});
+        }
+        m_block = b;
+        m_ptr = m_blocks[b].data.get();
+        m_end = m_ptr + m_blocks[b].size;
+    }
+
+    vector<block> m_blocks;
+    size_t m_block;
+    char* m_ptr;
+    char* m_end;
+};
+
+// An allocator for standard containers whose memory lives in an arena
+template <typename T>
+struct arenaallocator
+{
+    typedef T value_type;
+
+    explicit arenaallocator(arena& a) : a(&a) {}
+    template <typename U>
+    arenaallocator(const arenaallocator<U>& o) : a(o.a)
+    {
+    }
+
+    T* allocate(size_t n) { return static_cast<T*>(a->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const arenaallocator<U>& o) const
+    {
+        return a == o.a;
+    }
+    template <typename U>
+    bool operator!=(const arenaallocator<U>& o) const
+    {
+        return a != o.a;
+    }
+
+    arena* a;
+};
+
+template <typename T>
+using arenavector = vector<T, arenaallocator<T>>;
+
+////////////////////////////////////////////////////////////////////////////////
+// Mesh decimation
+////////////////////////////////////////////////////////////////////////////////
+
+// A sum of squared distances to planes, as a symmetric 4x4 matrix
+// stored as its upper triangle
+struct quadric
+{
+    double q[10] = {};
+
+    void addPlane(double a, double b, double c, double d)
+    {
+        const double p[4] = {a, b, c, d};
+        for (int i = 0, k = 0; i < 4; ++i)
+        {
+            for (int j = i; j < 4; ++j) q[k++] += p[i] * p[j];
+        }
+    }
+
+    quadric& operator+=(const quadric& o)
+    {
+        for (int k = 0; k < 10; ++k) q[k] += o.q[k];
+        return *this;
+    }
+
+    double error(const Float3& v) const
+    {
+        const double p[4] = {v.x, v.y, v.z, 1};
+        double e = 0;
+        for (int i = 0, k = 0; i < 4; ++i)
+        {
+            for (int j = i; j < 4; ++j, ++k) e += (i == j ? 1 : 2) * q[k] * p[i] * p[j];
+        }
+        return e;
+    }
+};
+
+// A triangle mesh, with the face of the original mesh each triangle
+// came from
+struct trimesh
+{
+    vector<Float3> P;
+    vector<int> triangles;
+    vector<int> faces;
+};
+
+static Float3 trinormal(const Float3& a, const Float3& b, const Float3& c)
+{
+    return cross(
+        Float3(b.x - a.x, b.y - a.y, b.z - a.z), Float3(c.x - a.x, c.y - a.y, c.z - a.z));
+}
+
+// Simplify a mesh by quadric error edge collapses (Garland and
+// Heckbert), each moving one end of an edge onto the other so that
+// no new points are made and the mesh stays within its bound. Every
+// point accumulates the planes of the triangles merged into it, and
+// of planes through the boundary edges perpendicular to their
+// triangle, which keeps holes and the outlines of leaves in place.
+// The error of a collapse is the sum of the squared distances to all
+// of those planes, so collapses stop once a point would be further
+// than error from any of them. Collapses which would flip a triangle
+// are skipped. Everything made along the way lives in an arena of the
+// thread, reset for each mesh
+static void decimate(trimesh& mesh, float error)
+{
+    static thread_local arena scratch;
+    scratch.reset();
+    arenaallocator<char> alloc(scratch);
+
+    const size_t npoints = mesh.P.size();
+    const size_t ntriangles = mesh.triangles.size() / 3;
+    arenavector<quadric> Q(npoints, alloc);
+    arenavector<arenavector<int>> around(npoints, arenavector<int>(alloc), alloc);
+    unordered_map<uint64_t, int, hash<uint64_t>, equal_to<uint64_t>,
+        arenaallocator<pair<const uint64_t, int>>>
+        edges(0, hash<uint64_t>(), equal_to<uint64_t>(), alloc);
+    auto edgekey = [](int a, int b) { return uint64_t(min(a, b)) << 32 | uint32_t(max(a, b)); };
+    for (size_t t = 0; t < ntriangles; ++t)
+    {
+        const int* v = &mesh.triangles[3 * t];
+        Float3 n = trinormal(mesh.P[v[0]], mesh.P[v[1]], mesh.P[v[2]]);
+        double len = sqrt(double(dot(n, n)));
+        for (int k = 0; k < 3; ++k)
+        {
+            around[v[k]].push_back(int(t));
+            edges[edgekey(v[k], v[(k + 1) % 3])]++;
+            if (len > 0)
+            {
+                const Float3& p = mesh.P[v[k]];
+                Q[v[k]].addPlane(n.x / len, n.y / len, n.z / len, -dot(n, p) / len);
+            }
+        }
+    }
+    for (size_t t = 0; t < ntriangles; ++t)
+    {
+        const int* v = &mesh.triangles[3 * t];
+        Float3 n = trinormal(mesh.P[v[0]], mesh.P[v[1]], mesh.P[v[2]]);
+        for (int k = 0; k < 3; ++k)
+        {
+            int a = v[k], b = v[(k + 1) % 3];
+            if (edges[edgekey(a, b)] != 1) continue;
+            const Float3& p = mesh.P[a];
+            const Float3& q = mesh.P[b];
+            Float3 m = cross(Float3(q.x - p.x, q.y - p.y, q.z - p.z), n);
+            double len = sqrt(double(dot(m, m)));
+            if (!(len > 0)) continue;
+            quadric boundary;
+            boundary.addPlane(m.x / len, m.y / len, m.z / len, -dot(m, p) / len);
+            Q[a] += boundary;
+            Q[b] += boundary;
+        }
+    }
+
+    // Candidate collapses of u onto v, which are stale once either
+    // point has changed since
+    struct collapse
+    {
+        double cost;
+        int u, v;
+        unsigned versionU, versionV;
+        bool operator<(const collapse& o) const { return cost > o.cost; }
+    };
+    arenavector<unsigned> version(npoints, 0, alloc);
+    arenavector<char> dead(npoints, 0, alloc), deleted(ntriangles, 0, alloc);
+    priority_queue<collapse, arenavector<collapse>> heap{
+        less<collapse>(), arenavector<collapse>(alloc)};
+    auto consider = [&](int a, int b) {
+        quadric q = Q[a];
+        q += Q[b];
+        double ea = q.error(mesh.P[a]), eb = q.error(mesh.P[b]);
+        if (eb <= ea)
+            heap.push({eb, a, b, version[a], version[b]});
+        else
+            heap.push({ea, b, a, version[b], version[a]});
+    };
+    for (auto& e : edges) consider(int(e.first >> 32), int(uint32_t(e.first)));
+    edges.clear();
+
+    const double limit = double(error) * error;
+    while (!heap.empty())
+    {
+        collapse c = heap.top();
+        heap.pop();
+        if (dead[c.u] || dead[c.v] || version[c.u] != c.versionU || version[c.v] != c.versionV)
+        {
+            continue;
+        }
+        if (c.cost > limit) break;
+
+        // Reject collapses which would turn a triangle over
+        bool flips = false;
+        for (int t : around[c.u])
+        {
+            int* v = &mesh.triangles[3 * t];
+            if (deleted[t] || v[0] == c.v || v[1] == c.v || v[2] == c.v) continue;
+            Float3 before = trinormal(mesh.P[v[0]], mesh.P[v[1]], mesh.P[v[2]]);
+            Float3 p[3];
+            for (int k = 0; k < 3; ++k) p[k] = mesh.P[v[k] == c.u ? c.v : v[k]];
+            if (dot(trinormal(p[0], p[1], p[2]), before) <= 0)
+            {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) continue;
+
+        for (int t : around[c.u])
+        {
+            int* v = &mesh.triangles[3 * t];
+            if (deleted[t]) continue;
+            if (v[0] == c.v || v[1] == c.v || v[2] == c.v)
+            {
+                deleted[t] = 1;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k)
+            {
+                if (v[k] == c.u) v[k] = c.v;
+            }
+            around[c.v].push_back(t);
+        }
+        around[c.u].clear();
+        dead[c.u] = 1;
+        Q[c.v] += Q[c.u];
+        version[c.v]++;
+
+        // Drop the deleted triangles around v, and reconsider its edges
+        auto& tv = around[c.v];
+        tv.erase(remove_if(tv.begin(), tv.end(), [&](int t) { return deleted[t]; }), tv.end());
+        set<int, less<int>, arenaallocator<int>> neighbours(alloc);
+        for (int t : tv)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                int w = mesh.triangles[3 * t + k];
+                if (w != c.v) neighbours.insert(w);
+            }
+        }
+        for (int w : neighbours) consider(c.v, w);
+    }
+
+    // Compact what's left
+    arenavector<int> remap(npoints, -1, alloc);
+    arenavector<Float3> P(alloc);
+    arenavector<int> triangles(alloc), faces(alloc);
+    for (size_t t = 0; t < ntriangles; ++t)
+    {
+        if (deleted[t]) continue;
+        for (int k = 0; k < 3; ++k)
+        {
+            int& r = remap[mesh.triangles[3 * t + k]];
+            if (r < 0)
+            {
+                r = int(P.size());
+                P.push_back(mesh.P[mesh.triangles[3 * t + k]]);
+            }
+            triangles.push_back(r);
+        }
+        faces.push_back(mesh.faces[t]);
+    }
+    mesh.P.assign(P.begin(), P.end());
+    mesh.triangles.assign(triangles.begin(), triangles.end());
+    mesh.faces.assign(faces.begin(), faces.end());
+}
+
+// A simplified level of detail of an archive, whose groups are
+// decimated to within error of the original
+struct decimation
+{
+    float error = 0;
+    atomic<uint64_t> trianglesIn{0}, trianglesOut{0};
+};
+
+// Triangles written at each level of detail, the original first
+static atomic<uint64_t> levelTriangles[9];
+static atomic<int> archivesDecimated(0);
+
+////////////////////////////////////////////////////////////////////////////////
+// OBJ file
+////////////////////////////////////////////////////////////////////////////////
+
+// A material of an element as RIB (see material()), split at each %
+// token, which stands for the Ptex file of the group bound to it, so
+// binding a group needs no searching of the text. With
+// --shared-materials, the segments only hold the lines which name a
+// Ptex file, and the rest of the material is defined once per element
+// as an inline archive named handle, which each group reads
+struct materialdef
+{
+    string text;
+    vector<string> segments;
+    string shared;
+    string handle;
+};
+
+// Bind the material m to what follows, with ptxfile in place of %
+static void writeMaterial(RibWriter& rib, const materialdef& m, const string& ptxfile)
+{
+    if (!m.segments.empty())
+    {
+        rib.verbatim(m.segments, ptxfile);
+        rib.newline();
+    }
+    if (!m.handle.empty())
+    {
+        rib.indent();
+        rib.request("ReadArchive");
+        rib.str(m.handle);
+        rib.newline();
+    }
+}
+
+// Groups with identical geometry found by --dedup-geometry. An OBJ
+// file is then converted in two passes: the first only hashes the
+// geometry of every group, and the second writes the geometry of each
+// group found more than once into an object master where it first
+// occurs, and an instance of that master for every occurrence, which
+// keeps its own name and material.
+struct geometrydedup
+{
+    struct group
+    {
+        int count = 0;
+        // First line of the first group with this geometry
+        const char* first = nullptr;
+        // Size of the geometry
+        uint64_t bytes = 0;
+        // The geometry itself, which is compared so that groups whose
+        // hashes collide are never merged
+        string geometry;
+    };
+
+    bool counting = true;
+    // Masters are named after the archive and the geometry hash
+    string prefix;
+    mutex lock;
+    // The groups of each hash, almost always just one
+    unordered_map<uint64_t, deque<group>> groups;
+    // Size of the ObjectBegin, ObjectEnd and ObjectInstance requests
+    uint64_t overhead = 0;
+
+    // Count an occurrence of geometry, whose first line is first
+    void add(uint64_t hash, const string& geometry, const char* first)
+    {
+        lock_guard<mutex> guard(lock);
+        deque<group>& same = groups[hash];
+        for (auto& g : same)
+        {
+            if (g.geometry != geometry) continue;
+            g.count++;
+            if (first < g.first) g.first = first;
+            return;
+        }
+        same.emplace_back();
+        same.back().count = 1;
+        same.back().first = first;
+        same.back().geometry = geometry;
+    }
+
+    // The group counted for geometry, and its rank by first line among
+    // any other groups with the same hash, which names its master
+    // whatever order the groups were counted in
+    group* find(uint64_t hash, const string& geometry, int& rank)
+    {
+        lock_guard<mutex> guard(lock);
+        deque<group>& same = groups[hash];
+        for (auto& g : same)
+        {
+            if (g.geometry != geometry) continue;
+            rank = 0;
+            for (auto& other : same) rank += other.first < g.first;
+            return &g;
+        }
+        return nullptr;
+    }
+
+    uint64_t saved() const
+    {
+        uint64_t bytes = 0;
+        for (auto& same : groups)
+        {
+            for (auto& g : same.second)
+            {
+                if (g.count > 1) bytes += (g.count - 1) * g.bytes;
+            }
+        }
+        return bytes > overhead ? bytes - overhead : 0;
+    }
+};
+
+struct objstate
+{
+    string elementName;
+    string currentName;
+    string currentMaterial;
+    vector<Float3> P;
+    vector<Float3> N;
+    // When a file is converted in parts (see parseobjSplit), the
+    // vertex data of the whole file is shared instead, and only the
+    // first nP points and nN normals precede the current line
+    const vector<Float3>* sharedP = nullptr;
+    const vector<Float3>* sharedN = nullptr;
+    size_t nP = 0, nN = 0;
+    // Global to local vertex index remapping for the current
+    // group. An entry of Pmap is only valid if the matching entry of
+    // Pepoch equals epoch, so that starting a new group is O(1)
+    vector<int> Pmap;
+    vector<unsigned> Pepoch;
+    unsigned epoch = 1;
+    // Global index of the first entry of Pmap; a part of a file
+    // usually references only vertices close to its own
+    int Pbase = 0;
+    // Local to global vertex index, and local vertex to normal index
+    vector<int> Prevmap;
+    vector<int> Nmap;
+    int nverts = 0;
+    int nfaces = 0;
+    vector<int> facesize;
+    vector<int> faceidx, faceNidx;
+    // First line of the faces in the queue, and the duplicate
+    // geometry being looked for, if any
+    const char* runStart = nullptr;
+    geometrydedup* dedup = nullptr;
+    // Bound of every point written, and what to cull groups against
+    Bound bound;
+    const cullplaces* cull = nullptr;
+    // The level of detail being written, if any
+    decimation* decimate = nullptr;
+    // If set, the directives are recorded for a geometry cache
+    // instead of being converted
+    struct objrecord* record = nullptr;
+    // Scratch space for writing a group, kept from one group to the
+    // next so that it stops allocating once it has grown
+    string ptxfile;
+    vector<float> hashdata;
+    string geometry;
+    trimesh mesh;
+    vector<Float3> meshN;
+};
+
+// The geometry of the faces in the queue: vertex i of the mesh is
+// point Prevmap[i], with normal Nmap[i]
+struct objgeometry
+{
+    bool polygons;
+    int maxvert;
+    const vector<Float3>& P;
+    size_t nP;
+    const vector<Float3>& N;
+    size_t nN;
+};
+
+static void writegeometry(RibWriter& rib, const objstate& s, const objgeometry& g)
+{
+    const bool polygons = g.polygons;
+    const int maxvert = g.maxvert;
+    const vector<Float3>& P = g.P;
+    const vector<Float3>& N = g.N;
+    const size_t nP = g.nP, nN = g.nN;
+
+    rib.indent();
+    if (polygons)
+    {
+        rib.request("PointsPolygons");
+    }
+    else
+    {
+        rib.request("SubdivisionMesh");
+        rib.token("catmull-clark");
+    }
+    rib.beginIntArray();
+    for (auto i = s.facesize.begin(); i != s.facesize.end(); ++i)
+    {
+        rib.element(*i);
+    }
+    rib.endArray();
+    rib.beginIntArray();
+    for (auto i = s.faceidx.begin(); i != s.faceidx.end(); ++i)
+    {
+        rib.element(*i);
+    }
+    rib.endArray();
+    if (!polygons)
+    {
+        static const char* const tags[] = {"interpolateboundary"};
+        static const int nargs[] = {1, 0};
+        static const int intargs[] = {1};
+        rib.tokens(tags, 1);
+        rib.ints(nargs, 2);
+        rib.ints(intargs, 1);
+        rib.ints(0, 0);
+    }
+    rib.token("vertex point P");
+    rib.beginFloatArray(3 * (maxvert + 1));
+    for (int i = 0; i <= maxvert; ++i)
+    {
+        int j = s.Prevmap[i];
+        if (j >= 0 && j < (int)nP)
+        {
+            rib.element(P[j].x);
+            rib.element(P[j].y);
+            rib.element(P[j].z);
+        }
+        else
+        {
+            rib.element(-666);
+            rib.element(-666);
+            rib.element(-666);
+        }
+    }
+    rib.endArray();
+    // I'm not terribly convinced that for subdivision meshes, the
+    // provided normals are better than what RenderMan would
+    // compute on the limit surface
+    if (polygons)
+    {
+        if (nN > 0)
+        {
+            rib.token("vertex normal N");
+            rib.beginFloatArray(3 * (maxvert + 1));
+            for (int i = 0; i <= maxvert; ++i)
+            {
+                int n = s.Nmap[i];
+                if (n >= 0 && n < (int)nN)
+                {
+                    rib.element(N[n].x);
+                    rib.element(N[n].y);
+                    rib.element(N[n].z);
+                }
+                else
+                {
+                    rib.element(-666);
+                    rib.element(-666);
+                    rib.element(-666);
+                }
+            }
+            rib.endArray();
+        }
+    }
+    rib.token("uniform float __faceindex");
+    rib.beginFloatArray(s.facesize.size());
+    for (int i = 0; i < (int)s.facesize.size(); ++i)
+    {
+        rib.element(i);
+    }
+    rib.endArray();
+    rib.newline();
+}
+
+// Write the faces in the queue as triangles decimated for a level of
+// detail, or as they are if none could be removed
+static void writedecimated(RibWriter& rib, objstate& s, const objgeometry& g, decimation& level)
+{
+    trimesh& mesh = s.mesh;
+    mesh.P.clear();
+    mesh.triangles.clear();
+    mesh.faces.clear();
+    for (int i = 0; i <= g.maxvert; ++i)
+    {
+        int j = s.Prevmap[i];
+        mesh.P.push_back(j >= 0 && j < (int)g.nP ? g.P[j] : Float3(-666, -666, -666));
+    }
+    const int* idx = s.faceidx.data();
+    for (int f = 0; f < (int)s.facesize.size(); ++f)
+    {
+        int n = s.facesize[f];
+        for (int k = 1; k + 1 < n; ++k)
+        {
+            mesh.triangles.insert(mesh.triangles.end(), {idx[0], idx[k], idx[k + 1]});
+            mesh.faces.push_back(f);
+        }
+        idx += n;
+    }
+    size_t before = mesh.faces.size();
+    decimate(mesh, level.error);
+    level.trianglesIn += before;
+    level.trianglesOut += mesh.faces.size();
+    if (mesh.faces.size() == before)
+    {
+        writegeometry(rib, s, g);
+        return;
+    }
+
+    // Smooth normals, weighted by the area of each triangle
+    vector<Float3>& N = s.meshN;
+    N.assign(mesh.P.size(), Float3(0, 0, 0));
+    for (size_t t = 0; t < mesh.faces.size(); ++t)
+    {
+        const int* v = &mesh.triangles[3 * t];
+        Float3 n = trinormal(mesh.P[v[0]], mesh.P[v[1]], mesh.P[v[2]]);
+        for (int k = 0; k < 3; ++k)
+        {
+            N[v[k]].x += n.x;
+            N[v[k]].y += n.y;
+            N[v[k]].z += n.z;
+        }
+    }
+
+    rib.indent();
+    rib.request("PointsPolygons");
+    rib.beginIntArray();
+    for (size_t t = 0; t < mesh.faces.size(); ++t) rib.element(3);
+    rib.endArray();
+    rib.beginIntArray();
+    for (int v : mesh.triangles) rib.element(v);
+    rib.endArray();
+    rib.token("vertex point P");
+    rib.beginFloatArray(3 * mesh.P.size());
+    for (auto& p : mesh.P)
+    {
+        rib.element(p.x);
+        rib.element(p.y);
+        rib.element(p.z);
+    }
+    rib.endArray();
+    rib.token("vertex normal N");
+    rib.beginFloatArray(3 * N.size());
+    for (auto& n : N)
+    {
+        if (dot(n, n) > 0) normalize(n);
+        rib.element(n.x);
+        rib.element(n.y);
+        rib.element(n.z);
+    }
+    rib.endArray();
+    // Each triangle keeps the index of the face it came from
+    rib.token("uniform float __faceindex");
+    rib.beginFloatArray(mesh.faces.size());
+    for (int f : mesh.faces) rib.element(f);
+    rib.endArray();
+    rib.newline();
+}
+
+// The hash of the geometry of the faces in the queue, leaving the
+// geometry itself in s.geometry
+static uint64_t geometryhash(objstate& s, const objgeometry& g)
+{
+    int header[4] = {g.polygons, int(s.facesize.size()), int(s.faceidx.size()), g.maxvert};
+    uint64_t h = hashBytes(header, sizeof(header));
+    h = hashBytes(s.facesize.data(), s.facesize.size() * sizeof(int), h);
+    h = hashBytes(s.faceidx.data(), s.faceidx.size() * sizeof(int), h);
+    vector<float>& data = s.hashdata;
+    data.clear();
+    for (int i = 0; i <= g.maxvert; ++i)
+    {
+        int j = s.Prevmap[i];
+        Float3 p = j >= 0 && j < (int)g.nP ? g.P[j] : Float3(-666, -666, -666);
+        data.insert(data.end(), {p.x, p.y, p.z});
+    }
+    if (g.polygons && g.nN > 0)
+    {
+        for (int i = 0; i <= g.maxvert; ++i)
+        {
+            int n = s.Nmap[i];
+            Float3 v = n >= 0 && n < (int)g.nN ? g.N[n] : Float3(-666, -666, -666);
+            data.insert(data.end(), {v.x, v.y, v.z});
+        }
+    }
+    s.geometry.assign(reinterpret_cast<const char*>(header), sizeof(header));
+    s.geometry.append(reinterpret_cast<const char*>(s.facesize.data()),
+        s.facesize.size() * sizeof(int));
+    s.geometry.append(
+        reinterpret_cast<const char*>(s.faceidx.data()), s.faceidx.size() * sizeof(int));
+    s.geometry.append(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+    return hashBytes(data.data(), data.size() * sizeof(float), h);
+}
+
+static void clearfaces(struct objstate& s)
+{
+    s.nverts = 0;
+    s.nfaces = 0;
+    if (++s.epoch == 0)
+    {
+        fill(s.Pepoch.begin(), s.Pepoch.end(), 0);
+        s.epoch = 1;
+    }
+    s.Prevmap.clear();
+    s.Nmap.clear();
+    s.facesize.clear();
+    s.faceidx.clear();
+}
+
+static void flushfaces(
+    RibWriter& rib, struct objstate& s, const unordered_map<string, materialdef>& materials)
+{
+    if (!s.facesize.empty())
+    {
+        phasescope phase(phaseRib);
+        int maxvert = -1;
+        for (int i : s.faceidx) maxvert = max(maxvert, i);
+        objgeometry g = {
+            // If the mesh is made of triangles, outputting a
+            // Catmull-Clark subdiv is not a great idea
+            s.facesize[0] == 3,
+            maxvert,
+            s.sharedP ? *s.sharedP : s.P,
+            s.sharedP ? s.nP : s.P.size(),
+            s.sharedN ? *s.sharedN : s.N,
+            s.sharedN ? s.nN : s.N.size()};
+        Bound bound;
+        for (int i = 0; i <= maxvert; ++i)
+        {
+            int j = s.Prevmap[i];
+            Float3 p = j >= 0 && j < (int)g.nP ? g.P[j] : Float3(-666, -666, -666);
+            bound.extend(p.x, p.y, p.z);
+        }
+        if (s.cull)
+        {
+            bool visible = s.cull->visible(bound);
+            if (!s.dedup || !s.dedup->counting)
+            {
+                cullStats.groups++;
+                if (!visible) cullStats.groupsCulled++;
+            }
+            if (!visible)
+            {
+                clearfaces(s);
+                return;
+            }
+        }
+        s.bound.extend(bound);
+
+        string master;
+        if (s.dedup)
+        {
+            uint64_t hash = geometryhash(s, g);
+            if (s.dedup->counting)
+            {
+                s.dedup->add(hash, s.geometry, s.runStart);
+                clearfaces(s);
+                return;
+            }
+            int rank = 0;
+            geometrydedup::group* group = s.dedup->find(hash, s.geometry, rank);
+            if (group && group->count > 1)
+            {
+                master = s.dedup->prefix + ":" + hex(hash);
+                if (rank > 0) master += "." + to_string(rank);
+                if (s.runStart == group->first)
+                {
+                    uint64_t start = rib.tell();
+                    rib.request("ObjectBegin");
+                    rib.str(master);
+                    rib.newline();
+                    uint64_t geometry = rib.tell();
+                    writegeometry(rib, s, g);
+                    group->bytes = rib.tell() - geometry;
+                    rib.request("ObjectEnd");
+                    rib.newline();
+                    lock_guard<mutex> lock(s.dedup->lock);
+                    s.dedup->overhead += rib.tell() - start - group->bytes;
+                }
+            }
+        }
+
+        addStat(statFaces, s.nfaces);
+        addStat(statVertices, maxvert + 1);
+        rib.request("AttributeBegin");
+        rib.newline();
+        auto mat = materials.find(s.currentMaterial);
+        if (mat != materials.end())
+        {
+            s.ptxfile.assign(s.currentName).append(".ptx");
+            writeMaterial(rib, mat->second, s.ptxfile);
+        }
+        rib.indent();
+        rib.request("Attribute");
+        rib.token("identifier");
+        rib.token("string name");
+        rib.str(s.currentName);
+        rib.newline();
+        rib.indent();
+        rib.request("Attribute");
+        rib.token("identifier");
+        rib.token("string object");
+        rib.str(s.currentName);
+        rib.newline();
+        if (s.decimate)
+        {
+            writedecimated(rib, s, g, *s.decimate);
+        }
+        else if (master.empty())
+        {
+            writegeometry(rib, s, g);
+        }
+        else
+        {
+            uint64_t start = rib.tell();
+            rib.indent();
+            rib.request("ObjectInstance");
+            rib.str(master);
+            rib.newline();
+            lock_guard<mutex> lock(s.dedup->lock);
+            s.dedup->overhead += rib.tell() - start;
+        }
+        clearfaces(s);
+        rib.request("AttributeEnd");
+        rib.newline();
+    }
+}
+
+static int vertmap(struct objstate& s, int v)
+{
+    size_t nP = s.sharedP ? s.sharedP->size() : s.P.size();
+    if (v < 0 || size_t(v) >= nP)
+    {
+        // Bad reference; give it a vertex of its own, which
+        // flushfaces will fill in, rather than growing the tables
+        // to the size of a corrupt index
+        s.Prevmap.push_back(v);
+        s.Nmap.push_back(-1);
+        return s.nverts++;
+    }
+    if (v < s.Pbase)
+    {
+        // Grow downwards, at least doubling
+        int grow = min(s.Pbase, max(s.Pbase - v, int(s.Pmap.size())));
+        s.Pmap.insert(s.Pmap.begin(), grow, 0);
+        s.Pepoch.insert(s.Pepoch.begin(), grow, 0);
+        s.Pbase -= grow;
+    }
+    int i = v - s.Pbase;
+    if (i >= (int)s.Pmap.size())
+    {
+        size_t size = max(size_t(v) + 1, s.P.size()) - s.Pbase;
+        s.Pmap.resize(size);
+        s.Pepoch.resize(size, 0);
+    }
+    if (s.Pepoch[i] != s.epoch)
+    {
+        s.Pepoch[i] = s.epoch;
+        s.Pmap[i] = s.nverts;
+        s.Prevmap.push_back(v);
+        s.Nmap.push_back(-1);
+        return s.nverts++;
+    }
+    return s.Pmap[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// OBJ tokenizer
+////////////////////////////////////////////////////////////////////////////////
+
+// Read-only memory mapping of an entire input file. The OBJ files in
+// the data set run to several gigabytes, so we'd rather let the
+// kernel page them in than copy every line into a std::string.
+class mappedfile
+{
+public:
+    explicit mappedfile(const string& filename) : m_data(0), m_size(0)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            cerr << "Unable to open " << filename << endl;
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                addStat(statBytesRead, st.st_size);
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(p);
+                m_size = st.st_size;
+            }
+            else
+            {
+                cerr << "Unable to map " << filename << endl;
+            }
+        }
+        close(fd);
+    }
+    ~mappedfile()
+    {
+        if (m_data) munmap(const_cast<char*>(m_data), m_size);
+    }
+    const char* begin() const { return m_data; }
+    const char* end() const { return m_data + m_size; }
+
+private:
+    mappedfile(const mappedfile&);
+    mappedfile& operator=(const mappedfile&);
+    const char* m_data;
+    size_t m_size;
+};
+
+static inline bool isspace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static inline void skipspace(const char*& p, const char* end)
+{
+    while (p != end && isspace(*p)) ++p;
+}
+
+// Equivalent of sscanf's %d
+static bool parseint(const char*& p, const char* end, int& value)
+{
+    skipspace(p, end);
+    const char* q = p;
+    bool negative = false;
+    if (q != end && (*q == '-' || *q == '+'))
+    {
+        negative = (*q == '-');
+        ++q;
+    }
+    if (q == end || *q < '0' || *q > '9') return false;
+    int v = 0;
+    while (q != end && *q >= '0' && *q <= '9')
+    {
+        v = v * 10 + (*q - '0');
+        ++q;
+    }
+    value = negative ? -v : v;
+    p = q;
+    return true;
+}
+
+// Equivalent of sscanf's %f. The common case of a decimal number with
+// at most 19 significant digits and a small exponent is handled with
+// a single correctly rounded double precision operation (Clinger's
+// fast path); anything else (including the rare double rounding
+// ambiguity when narrowing to float) is punted to strtof so that the
+// results are always identical to what sscanf would have produced.
+static bool parsefloat(const char*& p, const char* end, float& value)
+{
+    static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                   1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                   1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    skipspace(p, end);
+    const char* q = p;
+    bool negative = false;
+    if (q != end && (*q == '-' || *q == '+'))
+    {
+        negative = (*q == '-');
+        ++q;
+    }
+    uint64_t mantissa = 0;
+    int ndigits = 0, exponent = 0;
+    bool anydigits = false;
+    while (q != end && *q >= '0' && *q <= '9')
+    {
+        anydigits = true;
+        if (mantissa || *q != '0')
+        {
+            if (ndigits < 19)
+                mantissa = mantissa * 10 + (*q - '0');
+            else
+                ++exponent;
+            ++ndigits;
+        }
+        ++q;
+    }
+    if (q != end && *q == '.')
+    {
+        ++q;
+        while (q != end && *q >= '0' && *q <= '9')
+        {
+            anydigits = true;
+            if (mantissa || *q != '0')
+            {
+                if (ndigits < 19)
+                {
+                    mantissa = mantissa * 10 + (*q - '0');
+                    --exponent;
+                }
+                ++ndigits;
+            }
+            else
+            {
+                --exponent;
+            }
+            ++q;
+        }
+    }
+    bool fast = anydigits && ndigits <= 19;
+    if (fast && q != end && (*q == 'e' || *q == 'E'))
+    {
+        const char* e = q + 1;
+        int exp = 0;
+        if (parseint(e, end, exp) && !isspace(q[1]))
+        {
+            exponent += exp;
+            q = e;
+        }
+        else
+        {
+            fast = false;
+        }
+    }
+    if (fast && (q == end || isspace(*q)) && mantissa <= (uint64_t(1) << 53) &&
+        exponent >= -22 && exponent <= 22)
+    {
+        double d = double(mantissa);
+        d = exponent < 0 ? d / pow10[-exponent] : d * pow10[exponent];
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        // Results which land exactly halfway between two floats, or
+        // outside the normal float range, need the slow path
+        if (d == 0.0 || ((bits & 0x1fffffff) != 0x10000000 && d >= FLT_MIN && d <= FLT_MAX))
+        {
+            value = negative ? -float(d) : float(d);
+            p = q;
+            return true;
+        }
+    }
+
+    // Slow path: strtof needs a terminated copy of the token
+    q = p;
+    while (q != end && !isspace(*q)) ++q;
+    char buf[128];
+    size_t len = min(size_t(q - p), sizeof(buf) - 1);
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char* stop;
+    value = strtof(buf, &stop);
+    if (stop == buf) return false;
+    p += stop - buf;
+    return true;
+}
+
+// Parse one "v//vn" face vertex reference
+static bool parsefacevertex(const char*& p, const char* end, int& v, int& vn)
+{
+    const char* q = p;
+    if (!parseint(q, end, v)) return false;
+    if (end - q < 2 || q[0] != '/' || q[1] != '/') return false;
+    q += 2;
+    if (!parseint(q, end, vn)) return false;
+    p = q;
+    return true;
+}
+
+// The directives of an OBJ file recorded for its geometry cache (see
+// writeObjCache). Faces are kept as the point and normal indices of
+// the file, less one, and are replayed through vertmap just as
+// parseobjlines would have done
+struct objrecord
+{
+    enum
+    {
+        comment,
+        name,
+        material,
+        faces
+    };
+    struct op
+    {
+        uint32_t type;
+        // Number of faces, or the length of a string
+        uint32_t count;
+        // First face and face vertex of a run of faces, or the offset
+        // of a string in the string table
+        uint64_t first, index;
+        // Points and normals preceding the end of a run of faces
+        uint64_t nP, nN;
+    };
+    vector<op> ops;
+    vector<int32_t> facesize;
+    // Point and normal index pairs of every face vertex
+    vector<int32_t> faceidx;
+    string strings;
+    // Every point and normal of the file
+    vector<Float3> P, N;
+    // Start of the faces not yet in an op
+    size_t runFace = 0, runIndex = 0;
+
+    void str(uint32_t type, const char* begin, const char* end)
+    {
+        op o = {type, uint32_t(end - begin), strings.size(), 0, 0, 0};
+        ops.push_back(o);
+        strings.append(begin, end);
+    }
+
+    void face(const vector<int>& v, const vector<int>& vn)
+    {
+        facesize.push_back(int32_t(v.size()));
+        for (size_t i = 0; i < v.size(); ++i)
+        {
+            faceidx.push_back(v[i] - 1);
+            faceidx.push_back(vn[i] - 1);
+        }
+    }
+
+    void flush(size_t nP, size_t nN)
+    {
+        if (runFace == facesize.size()) return;
+        op o = {faces, uint32_t(facesize.size() - runFace), runFace, runIndex, nP, nN};
+        ops.push_back(o);
+        runFace = facesize.size();
+        runIndex = faceidx.size() / 2;
+    }
+
+    // Append the record of the next part of the same file
+    void append(const objrecord& r)
+    {
+        for (op o : r.ops)
+        {
+            if (o.type == faces)
+            {
+                o.first += facesize.size();
+                o.index += faceidx.size() / 2;
+            }
+            else
+            {
+                o.first += strings.size();
+            }
+            ops.push_back(o);
+        }
+        facesize.insert(facesize.end(), r.facesize.begin(), r.facesize.end());
+        faceidx.insert(faceidx.end(), r.faceidx.begin(), r.faceidx.end());
+        strings += r.strings;
+        runFace = facesize.size();
+        runIndex = faceidx.size() / 2;
+    }
+};
+
+// Convert the lines between begin and end, which must start at the
+// beginning of a line. Faces are queued in s until the next directive
+// which isn't a face, or the end of the lines
+static void parseobjlines(
+    struct objstate& s,
+    const unordered_map<string, materialdef>& materials,
+    const char* begin,
+    const char* end,
+    RibWriter& rib)
+{
+    vector<int> v, vn;
+    // When recording, faces are only queued in the record
+    auto flush = [&]() {
+        if (s.record)
+            s.record->flush(s.sharedP ? s.nP : s.P.size(), s.sharedN ? s.nN : s.N.size());
+        else
+            flushfaces(rib, s, materials);
+    };
+    const char* next = begin;
+    while (next != end)
+    {
+        const char* buf = next;
+        const char* eol = static_cast<const char*>(memchr(buf, '\n', end - buf));
+        if (eol)
+        {
+            next = eol + 1;
+        }
+        else
+        {
+            eol = next = end;
+        }
+        if (eol == buf) continue;
+        size_t len = eol - buf;
+
+        if (buf[0] != 'f')
+        {
+            // Flush faces in the queue if we encounter a new
+            // directive
+            flush();
+        }
+
+        if (buf[0] == '#')
+        {
+            // Comment
+            if (s.record)
+                s.record->str(objrecord::comment, buf + 1, eol);
+            else
+                rib.comment(string(buf + 1, len - 1));
+        }
+        else if (buf[0] == 'g')
+        {
+            // Name of geometry, sometimes used for Ptx binding
+            // purposes
+            s.currentName.assign(len > 2 ? buf + 2 : eol, eol);
+            if (s.record) s.record->str(objrecord::name, len > 2 ? buf + 2 : eol, eol);
+        }
+        else if (len >= 7 && strncmp(buf, "usemtl ", 7) == 0)
+        {
+            // Material binding
+            s.currentMaterial.assign(buf + 7, eol);
+            if (s.record) s.record->str(objrecord::material, buf + 7, eol);
+        }
+        else if (buf[0] == 'v' && len > 1 && buf[1] == 'n')
+        {
+            // Normal
+            if (s.sharedN)
+            {
+                s.nN++;
+                continue;
+            }
+            const char* p = buf + 2;
+            float x, y, z;
+            if (parsefloat(p, eol, x) && parsefloat(p, eol, y) && parsefloat(p, eol, z))
+            {
+                s.N.push_back(Float3(x, y, z));
+            }
+            else
+            {
+                cerr << "Bad normal directive:" << string(buf, eol) << endl;
+            }
+        }
+        else if (buf[0] == 'v')
+        {
+            // Point
+            if (s.sharedP)
+            {
+                s.nP++;
+                continue;
+            }
+            const char* p = buf + 1;
+            float x, y, z;
+            if (parsefloat(p, eol, x) && parsefloat(p, eol, y) && parsefloat(p, eol, z))
+            {
+                s.P.push_back(Float3(x, y, z));
+            }
+            else
+            {
+                cerr << "Bad point directive:" << string(buf, eol) << endl;
+            }
+        }
+        else if (buf[0] == 'f')
+        {
+            // Face of any arity; parsing stops at the first token
+            // which isn't a v//vn pair
+            const char* p = buf + 1;
+            v.clear();
+            vn.clear();
+            int a, b;
+            while (parsefacevertex(p, eol, a, b))
+            {
+                v.push_back(a);
+                vn.push_back(b);
+            }
+            if (v.size() >= 3 && s.record)
+            {
+                s.record->face(v, vn);
+            }
+            else if (v.size() >= 3)
+            {
+                if (s.facesize.empty()) s.runStart = buf;
+                s.facesize.push_back(int(v.size()));
+                for (size_t i = 0; i < v.size(); ++i)
+                {
+                    int local = vertmap(s, v[i] - 1);
+                    s.faceidx.push_back(local);
+                    s.Nmap[local] = vn[i] - 1;
+                }
+                s.nfaces++;
+            }
+            else
+            {
+                cerr << "Bad face directive:" << string(buf, eol) << endl;
+            }
+        }
+    }
+    flush();
+}
+
+// Find the start of a line after p where a part of an OBJ file may
+// begin, which is any directive other than a face since that flushes
+// the faces before it. Group names are preferred, but only searched
+// for until limit
+static const char* objsplitpoint(const char* p, const char* limit, const char* end)
+{
+    const char* fallback = nullptr;
+    p = static_cast<const char*>(memchr(p - 1, '\n', end - p + 1));
+    if (!p) return end;
+    ++p;
+    while (p < end)
+    {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        if (p[0] != '\n' && p[0] != 'f')
+        {
+            if (p[0] == 'g') return p;
+            if (!fallback) fallback = p;
+            if (p >= limit) return fallback;
+        }
+        p = eol + 1;
+    }
+    return fallback ? fallback : end;
+}
+
+// Convert an OBJ file, returning the bound of its geometry. With
+// --pipeline, the file is converted a block at a time as it is read,
+// each ending where a directive would flush the faces anyway
+static Bound parseobj(
+    const string& elementName,
+    const unordered_map<string, materialdef>& materials,
+    const char* begin,
+    const char* end,
+    RibWriter& rib,
+    geometrydedup* dedup = nullptr,
+    const cullplaces* cull = nullptr,
+    decimation* decimate = nullptr)
+{
+    struct objstate s;
+    s.elementName = elementName;
+    s.dedup = dedup;
+    s.cull = cull;
+    s.decimate = decimate;
+    if (!options.pipeline)
+    {
+        parseobjlines(s, materials, begin, end, rib);
+        return s.bound;
+    }
+    const size_t block = size_t(max(options.pipelineBlock, 1)) << 20;
+    prefetcher reader(begin, end);
+    for (const char* p = begin; p != end;)
+    {
+        const char* q = end;
+        if (size_t(end - p) > block)
+        {
+            reader.wait(p + block);
+            q = objsplitpoint(p + block, p + block, end);
+        }
+        reader.wait(q);
+        parseobjlines(s, materials, p, q, rib);
+        p = q;
+    }
+    return s.bound;
+}
+
+// A part of an OBJ file which is converted separately
+struct objpart
+{
+    const char* begin;
+    const char* end;
+    // Counts of vertex directives, and the last group and material
+    // set in this part
+    size_t nP = 0, nN = 0;
+    const char* name = nullptr;
+    const char* nameEnd = nullptr;
+    const char* material = nullptr;
+    const char* materialEnd = nullptr;
+    // Number of vertex directives which could not be parsed
+    size_t bad = 0;
+    string rib;
+};
+
+// Convert a large OBJ file in parts on the thread pool. The file is
+// first split at group boundaries and scanned to count the vertices
+// in each part, then the vertices are all parsed in parallel, and
+// finally the faces of every part are converted in parallel, with the
+// RIB written in file order and the bound of the geometry extending
+// bound. Returns false without writing anything if the file has
+// malformed vertices, since the vertex numbering is then only known
+// by reading the file in order. If record is given, the file is
+// recorded into it instead of being converted.
+static bool parseobjSplit(
+    const string& elementName,
+    const unordered_map<string, materialdef>& materials,
+    const char* begin,
+    const char* end,
+    RibWriter& rib,
+    Bound& bound,
+    geometrydedup* dedup = nullptr,
+    const cullplaces* cull = nullptr,
+    decimation* decimate = nullptr,
+    objrecord* record = nullptr)
+{
+    size_t partSize = size_t(options.splitObj) << 20;
+    vector<objpart> parts;
+    for (const char* p = begin; p < end;)
+    {
+        objpart part;
+        part.begin = p;
+        if (size_t(end - p) <= partSize)
+        {
+            p = end;
+        }
+        else
+        {
+            p = objsplitpoint(p + partSize, p + 2 * partSize, end);
+        }
+        part.end = p;
+        parts.push_back(part);
+    }
+    if (parts.size() < 2) return false;
+
+    ThreadPool& pool = threadPool();
+    {
+        TaskGroup tasks(pool);
+        for (auto& part : parts)
+        {
+            tasks.run([&part]() {
+                for (const char* p = part.begin; p < part.end;)
+                {
+                    const char* eol =
+                        static_cast<const char*>(memchr(p, '\n', part.end - p));
+                    if (!eol) eol = part.end;
+                    size_t len = eol - p;
+                    if (p[0] == 'v')
+                    {
+                        if (len > 1 && p[1] == 'n')
+                            part.nN++;
+                        else
+                            part.nP++;
+                    }
+                    else if (p[0] == 'g')
+                    {
+                        part.name = len > 2 ? p + 2 : eol;
+                        part.nameEnd = eol;
+                    }
+                    else if (len >= 7 && strncmp(p, "usemtl ", 7) == 0)
+                    {
+                        part.material = p + 7;
+                        part.materialEnd = eol;
+                    }
+                    p = eol + 1;
+                }
+            });
+        }
+        tasks.wait();
+    }
+
+    // The state at the start of each part
+    vector<objstate> states(parts.size());
+    size_t nP = 0, nN = 0;
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        states[i].elementName = elementName;
+        states[i].nP = nP;
+        states[i].nN = nN;
+        states[i].Pbase = int(nP);
+        nP += parts[i].nP;
+        nN += parts[i].nN;
+        if (i + 1 < parts.size())
+        {
+            states[i + 1].currentName = parts[i].name
+                ? string(parts[i].name, parts[i].nameEnd) : states[i].currentName;
+            states[i + 1].currentMaterial = parts[i].material
+                ? string(parts[i].material, parts[i].materialEnd) : states[i].currentMaterial;
+        }
+    }
+
+    vector<Float3> P(nP), N(nN);
+    {
+        TaskGroup tasks(pool);
+        for (size_t i = 0; i < parts.size(); ++i)
+        {
+            tasks.run([&, i]() {
+                objpart& part = parts[i];
+                Float3* pp = P.data() + states[i].nP;
+                Float3* np = N.data() + states[i].nN;
+                for (const char* p = part.begin; p < part.end;)
+                {
+                    const char* eol =
+                        static_cast<const char*>(memchr(p, '\n', part.end - p));
+                    if (!eol) eol = part.end;
+                    if (p[0] == 'v')
+                    {
+                        bool normal = eol - p > 1 && p[1] == 'n';
+                        const char* q = p + (normal ? 2 : 1);
+                        Float3& f = normal ? *np++ : *pp++;
+                        if (!(parsefloat(q, eol, f.x) && parsefloat(q, eol, f.y) &&
+                              parsefloat(q, eol, f.z)))
+                        {
+                            part.bad++;
+                        }
+                    }
+                    p = eol + 1;
+                }
+            });
+        }
+        tasks.wait();
+    }
+    for (auto& part : parts)
+    {
+        if (part.bad) return false;
+    }
+
+    // Convert the faces a few parts per thread at a time, so that
+    // only those parts' RIB is held in memory
+    vector<objrecord> records(record ? parts.size() : 0);
+    size_t batch = 2 * pool.size();
+    for (size_t first = 0; first < parts.size(); first += batch)
+    {
+        size_t last = min(parts.size(), first + batch);
+        TaskGroup tasks(pool);
+        for (size_t i = first; i < last; ++i)
+        {
+            states[i].sharedP = &P;
+            states[i].sharedN = &N;
+            states[i].dedup = dedup;
+            states[i].cull = cull;
+            states[i].decimate = decimate;
+            states[i].record = record ? &records[i] : nullptr;
+            runBuffered(tasks, rib.binary(), &parts[i].rib, [&, i](RibWriter& rib) {
+                parseobjlines(states[i], materials, parts[i].begin, parts[i].end, rib);
+            });
+        }
+        tasks.wait();
+        for (size_t i = first; i < last; ++i)
+        {
+            rib.append(parts[i].rib);
+            string().swap(parts[i].rib);
+            bound.extend(states[i].bound);
+            states[i] = objstate();
+            if (record)
+            {
+                record->append(records[i]);
+                records[i] = objrecord();
+            }
+        }
+    }
+    if (record)
+    {
+        record->P.swap(P);
+        record->N.swap(N);
+    }
+    return true;
+}
+
+// With --obj-cache, each OBJ file is parsed once and recorded to a
+// binary .objc file under rib/, next to its archives, and every later
+// conversion replays the record instead of parsing the text. Like an
+// instance cache, everything is in native byte order and aligned, so
+// the file is mapped and used in place:
+//
+//   header
+//   points: Float3 each, or with --obj-cache-quantize, a base and
+//     scale for every block of objCacheBlock points followed by three
+//     uint16_t each
+//   Float3 normals
+//   objrecord::op of every directive
+//   int32_t size of every face
+//   int32_t point and normal index pair of every face vertex
+//   string table
+//
+// The cache records the size, modification time and hash of the OBJ
+// file it was written from. A cache whose source has the same size but
+// a different modification time is still used if the hash matches.
+static const char objCacheMagic[8] = {'M', 'I', 'S', '2', 'O', 'B', 'J', 'C'};
+static const uint32_t objCacheVersion = 1;
+static const size_t objCacheBlock = 1024;
+
+struct objcacheheader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t quantized;
+    int64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+    uint64_t pointCount, normalCount, opCount, faceCount, indexCount, stringSize;
+    uint64_t pointOffset, normalOffset, opOffset, faceOffset, indexOffset, stringOffset;
+};
+
+// Quantized points p of a block are base + p * scale
+struct objcacheblock
+{
+    float base[3];
+    float scale[3];
+};
+
+static_assert(sizeof(Float3) == 3 * sizeof(float), "Float3 must be packed");
+
+static size_t objCachePointBytes(uint64_t n, bool quantized)
+{
+    if (!quantized) return n * sizeof(Float3);
+    return (n + objCacheBlock - 1) / objCacheBlock * sizeof(objcacheblock) +
+           n * 3 * sizeof(uint16_t);
+}
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~uint64_t(7);
+}
+
+// Totals over every OBJ cache used by this process
+static struct
+{
+    atomic<int> written, read;
+    atomic<uint64_t> bytesIn, bytesOut;
+} objCacheStats;
+
+// The cache of an OBJ file, at the same path under rib/ as its
+// archives
+static string objCacheFile(const string& filename)
+{
+    string cachename = filename;
+    if (cachename.compare(0, 4, "obj/") == 0) cachename.replace(0, 4, "rib/");
+    size_t ext = cachename.rfind(".obj");
+    if (ext != string::npos && ext + 4 == cachename.size())
+        cachename += "c";
+    else
+        cachename += ".objc";
+    return cachename;
+}
+
+// Parse an OBJ file and write its cache, returning false if it
+// couldn't be written
+static bool writeObjCache(const string& filename, const string& cachename, const filestate& source)
+{
+    objrecord record;
+    {
+        mappedfile objfile(filename);
+        nullstream null;
+        RibWriter rib(null, false);
+        Bound bound;
+        unordered_map<string, materialdef> materials;
+        if (options.splitObj <= 0 ||
+            !parseobjSplit(
+                string(), materials, objfile.begin(), objfile.end(), rib, bound, nullptr,
+                nullptr, nullptr, &record))
+        {
+            record = objrecord();
+            objstate s;
+            s.record = &record;
+            parseobjlines(s, materials, objfile.begin(), objfile.end(), rib);
+            record.P.swap(s.P);
+            record.N.swap(s.N);
+        }
+    }
+
+    objcacheheader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, objCacheMagic, sizeof(objCacheMagic));
+    h.version = objCacheVersion;
+    h.quantized = options.objCacheQuantize;
+    h.sourceSize = source.size;
+    h.sourceMtime = source.mtime;
+    h.sourceHash = hashFile(filename);
+    h.pointCount = record.P.size();
+    h.normalCount = record.N.size();
+    h.opCount = record.ops.size();
+    h.faceCount = record.facesize.size();
+    h.indexCount = record.faceidx.size() / 2;
+    h.stringSize = record.strings.size();
+    h.pointOffset = sizeof(h);
+    h.normalOffset = align8(h.pointOffset + objCachePointBytes(h.pointCount, h.quantized));
+    h.opOffset = align8(h.normalOffset + h.normalCount * sizeof(Float3));
+    h.faceOffset = h.opOffset + h.opCount * sizeof(objrecord::op);
+    h.indexOffset = align8(h.faceOffset + h.faceCount * sizeof(int32_t));
+    h.stringOffset = h.indexOffset + h.indexCount * 2 * sizeof(int32_t);
+
+    boost::filesystem::path dir(cachename);
+    dir.remove_filename();
+    if (!dir.empty() && !boost::filesystem::exists(dir))
+    {
+        boost::filesystem::create_directories(dir);
+    }
+    static atomic<int> count(0);
+    string temp = cachename + ".tmp" + to_string(getpid()) + "." + to_string(count++);
+    ofstream file(temp.c_str(), ios::out | ios::binary | ios::trunc);
+    auto write = [&file](const void* data, size_t n) {
+        file.write(static_cast<const char*>(data), n);
+    };
+    auto pad = [&file]() {
+        static const char zeros[8] = {};
+        file.write(zeros, align8(file.tellp()) - uint64_t(file.tellp()));
+    };
+    write(&h, sizeof(h));
+    if (h.quantized)
+    {
+        // Each block is quantized within its own bound, so the error
+        // is relative to the size of the neighbourhood of the points
+        // rather than of the whole file
+        vector<uint16_t> q;
+        for (size_t first = 0; first < record.P.size(); first += objCacheBlock)
+        {
+            size_t last = min(record.P.size(), first + objCacheBlock);
+            Bound bound;
+            for (size_t i = first; i < last; ++i)
+            {
+                bound.extend(record.P[i].x, record.P[i].y, record.P[i].z);
+            }
+            objcacheblock block;
+            for (int k = 0; k < 3; ++k)
+            {
+                block.base[k] = bound.b[2 * k];
+                block.scale[k] = (bound.b[2 * k + 1] - bound.b[2 * k]) / 65535;
+            }
+            write(&block, sizeof(block));
+            for (size_t i = first; i < last; ++i)
+            {
+                const float* p = &record.P[i].x;
+                for (int k = 0; k < 3; ++k)
+                {
+                    float x = block.scale[k] > 0 ? (p[k] - block.base[k]) / block.scale[k] : 0;
+                    q.push_back(uint16_t(min(max(x + 0.5f, 0.0f), 65535.0f)));
+                }
+            }
+        }
+        write(q.data(), q.size() * sizeof(uint16_t));
+    }
+    else
+    {
+        write(record.P.data(), record.P.size() * sizeof(Float3));
+    }
+    pad();
+    write(record.N.data(), record.N.size() * sizeof(Float3));
+    pad();
+    write(record.ops.data(), record.ops.size() * sizeof(objrecord::op));
+    write(record.facesize.data(), record.facesize.size() * sizeof(int32_t));
+    pad();
+    write(record.faceidx.data(), record.faceidx.size() * sizeof(int32_t));
+    write(record.strings.data(), record.strings.size());
+    file.close();
+    if (!file || rename(temp.c_str(), cachename.c_str()) != 0)
+    {
+        cerr << "Unable to write " << cachename << endl;
+        unlink(temp.c_str());
+        return false;
+    }
+    addStat(statBytesWritten, h.stringOffset + h.stringSize);
+    objCacheStats.written++;
+    objCacheStats.bytesIn += source.size;
+    objCacheStats.bytesOut += h.stringOffset + h.stringSize;
+    return true;
+}
+
+// An OBJ cache mapped into memory. The points and normals are copied
+// out, since the conversion works on vectors of them; everything else
+// is used in place, and checked to lie within the file when it is
+// opened
+class objcache
+{
+public:
+    objcache() : m_data(0), m_size(0) {}
+    ~objcache()
+    {
+        if (m_data) munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    // Open the cache of filename, returning false if it is missing,
+    // out of date or corrupt
+    bool open(const string& cachename, const string& filename, const filestate& source)
+    {
+        int fd = ::open(cachename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(objcacheheader))
+        {
+            void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                m_data = static_cast<const char*>(p);
+                m_size = st.st_size;
+            }
+        }
+        ::close(fd);
+        if (!m_data) return false;
+
+        const objcacheheader& h = header();
+        if (memcmp(h.magic, objCacheMagic, sizeof(objCacheMagic)) != 0 ||
+            h.version != objCacheVersion || h.quantized != uint32_t(options.objCacheQuantize) ||
+            h.sourceSize != source.size)
+        {
+            return false;
+        }
+        if (!valid())
+        {
+            cerr << cachename << ": truncated or corrupt, writing it again" << endl;
+            return false;
+        }
+        if (h.sourceMtime != source.mtime)
+        {
+            // The file may only have been touched, or copied
+            if (hashFile(filename) != h.sourceHash) return false;
+            int wfd = ::open(cachename.c_str(), O_WRONLY);
+            if (wfd >= 0)
+            {
+                int64_t mtime = source.mtime;
+                if (pwrite(wfd, &mtime, sizeof(mtime), offsetof(objcacheheader, sourceMtime)) < 0)
+                {
+                    cerr << "Unable to update " << cachename << endl;
+                }
+                ::close(wfd);
+            }
+        }
+
+        P.resize(h.pointCount);
+        if (h.quantized)
+        {
+            const objcacheblock* blocks =
+                reinterpret_cast<const objcacheblock*>(m_data + h.pointOffset);
+            const uint16_t* q = reinterpret_cast<const uint16_t*>(
+                blocks + (h.pointCount + objCacheBlock - 1) / objCacheBlock);
+            for (size_t i = 0; i < P.size(); ++i)
+            {
+                const objcacheblock& b = blocks[i / objCacheBlock];
+                P[i] = Float3(
+                    b.base[0] + q[3 * i] * b.scale[0], b.base[1] + q[3 * i + 1] * b.scale[1],
+                    b.base[2] + q[3 * i + 2] * b.scale[2]);
+            }
+        }
+        else
+        {
+            memcpy(P.data(), m_data + h.pointOffset, P.size() * sizeof(Float3));
+        }
+        N.resize(h.normalCount);
+        memcpy(N.data(), m_data + h.normalOffset, N.size() * sizeof(Float3));
+        return true;
+    }
+
+    const objcacheheader& header() const
+    {
+        return *reinterpret_cast<const objcacheheader*>(m_data);
+    }
+    const objrecord::op* ops() const
+    {
+        return reinterpret_cast<const objrecord::op*>(m_data + header().opOffset);
+    }
+    const int32_t* facesize() const
+    {
+        return reinterpret_cast<const int32_t*>(m_data + header().faceOffset);
+    }
+    const int32_t* faceidx() const
+    {
+        return reinterpret_cast<const int32_t*>(m_data + header().indexOffset);
+    }
+    const char* chars(const objrecord::op& o) const
+    {
+        return m_data + header().stringOffset + o.first;
+    }
+    string str(const objrecord::op& o) const { return string(chars(o), o.count); }
+
+    vector<Float3> P, N;
+
+private:
+    objcache(const objcache&);
+    objcache& operator=(const objcache&);
+
+    bool valid() const
+    {
+        const objcacheheader& h = header();
+        uint64_t limit = m_size;
+        if (h.pointOffset != sizeof(objcacheheader) || h.pointCount > limit ||
+            h.normalCount > limit || h.opCount > limit || h.faceCount > limit ||
+            h.indexCount > limit ||
+            h.normalOffset !=
+                align8(h.pointOffset + objCachePointBytes(h.pointCount, h.quantized)) ||
+            h.opOffset != align8(h.normalOffset + h.normalCount * sizeof(Float3)) ||
+            h.faceOffset != h.opOffset + h.opCount * sizeof(objrecord::op) ||
+            h.indexOffset != align8(h.faceOffset + h.faceCount * sizeof(int32_t)) ||
+            h.stringOffset != h.indexOffset + h.indexCount * 2 * sizeof(int32_t) ||
+            h.stringOffset > limit || h.stringSize != limit - h.stringOffset)
+        {
+            return false;
+        }
+        uint64_t face = 0, index = 0;
+        for (uint64_t i = 0; i < h.opCount; ++i)
+        {
+            const objrecord::op& o = ops()[i];
+            if (o.type == objrecord::faces)
+            {
+                if (o.first != face || o.index != index || o.count > h.faceCount - face ||
+                    o.nP > h.pointCount || o.nN > h.normalCount)
+                {
+                    return false;
+                }
+                for (uint32_t j = 0; j < o.count; ++j)
+                {
+                    int32_t n = facesize()[face++];
+                    if (n < 3 || uint64_t(n) > h.indexCount - index) return false;
+                    index += n;
+                }
+            }
+            else if (o.type > objrecord::faces || o.first > h.stringSize ||
+                     o.count > h.stringSize - o.first)
+            {
+                return false;
+            }
+        }
+        return face == h.faceCount && index == h.indexCount;
+    }
+
+    const char* m_data;
+    size_t m_size;
+};
+
+// The cache of an OBJ file, written first if it is out of date, or
+// null if it can't be written
+static unique_ptr<objcache> openObjCache(const string& filename)
+{
+    filestate source;
+    if (!statFile(filename, source)) return nullptr;
+    string cachename = objCacheFile(filename);
+    unique_ptr<objcache> cache(new objcache);
+    if (cache->open(cachename, filename, source))
+    {
+        objCacheStats.read++;
+        return cache;
+    }
+    if (!writeObjCache(filename, cachename, source)) return nullptr;
+    cache.reset(new objcache);
+    if (!cache->open(cachename, filename, source)) return nullptr;
+    return cache;
+}
+
+// Convert the ops first .. last - 1 of a cache, as parseobjlines would
+// have converted the lines they were recorded from
+static void replayobjlines(
+    struct objstate& s,
+    const objcache& cache,
+    const unordered_map<string, materialdef>& materials,
+    size_t first,
+    size_t last,
+    RibWriter& rib)
+{
+    s.sharedP = &cache.P;
+    s.sharedN = &cache.N;
+    const int32_t* facesize = cache.facesize();
+    const int32_t* faceidx = cache.faceidx();
+    for (size_t i = first; i < last; ++i)
+    {
+        const objrecord::op& o = cache.ops()[i];
+        if (o.type == objrecord::comment)
+        {
+            rib.comment(cache.str(o));
+        }
+        else if (o.type == objrecord::name)
+        {
+            s.currentName.assign(cache.chars(o), o.count);
+        }
+        else if (o.type == objrecord::material)
+        {
+            s.currentMaterial.assign(cache.chars(o), o.count);
+        }
+        else
+        {
+            // The op stands in for the first line of the faces, for
+            // ordering the groups found by --dedup-geometry
+            s.runStart = reinterpret_cast<const char*>(&o);
+            s.nP = o.nP;
+            s.nN = o.nN;
+            const int32_t* idx = faceidx + 2 * o.index;
+            for (uint64_t f = o.first; f < o.first + o.count; ++f)
+            {
+                s.facesize.push_back(facesize[f]);
+                for (int32_t j = 0; j < facesize[f]; ++j, idx += 2)
+                {
+                    int local = vertmap(s, idx[0]);
+                    s.faceidx.push_back(local);
+                    s.Nmap[local] = idx[1];
+                }
+                s.nfaces++;
+            }
+            flushfaces(rib, s, materials);
+        }
+    }
+}
+
+// Convert an OBJ file from its cache, returning the bound of its
+// geometry. With --split-obj the ops are converted in parts on the
+// thread pool, in the same way as parseobjSplit
+static Bound replayobj(
+    const string& elementName,
+    const unordered_map<string, materialdef>& materials,
+    const objcache& cache,
+    RibWriter& rib,
+    geometrydedup* dedup = nullptr,
+    const cullplaces* cull = nullptr,
+    decimation* decimate = nullptr)
+{
+    const objcacheheader& h = cache.header();
+    size_t partSize = size_t(max(options.splitObj, 0)) << 20;
+    size_t nparts = partSize > 0 ? (size_t(h.sourceSize) + partSize - 1) / partSize : 1;
+
+    // Split after runs of faces, once a part has its share of the
+    // face vertices, and find the group and material each part
+    // starts with
+    vector<size_t> bounds(1, 0);
+    vector<objstate> states(1);
+    uint64_t share = h.indexCount / max(nparts, size_t(1)) + 1;
+    uint64_t index = 0;
+    string name, material;
+    for (size_t i = 0; i < h.opCount && nparts > 1; ++i)
+    {
+        const objrecord::op& o = cache.ops()[i];
+        if (o.type == objrecord::name) name = cache.str(o);
+        if (o.type == objrecord::material) material = cache.str(o);
+        if (o.type != objrecord::faces) continue;
+        for (uint64_t f = o.first; f < o.first + o.count; ++f) index += cache.facesize()[f];
+        if (index >= share * bounds.size() && i + 1 < h.opCount)
+        {
+            bounds.push_back(i + 1);
+            states.emplace_back();
+            states.back().currentName = name;
+            states.back().currentMaterial = material;
+        }
+    }
+    bounds.push_back(h.opCount);
+
+    Bound bound;
+    for (auto& s : states)
+    {
+        s.elementName = elementName;
+        s.dedup = dedup;
+        s.cull = cull;
+        s.decimate = decimate;
+    }
+    if (states.size() == 1)
+    {
+        replayobjlines(states[0], cache, materials, 0, h.opCount, rib);
+        return states[0].bound;
+    }
+
+    ThreadPool& pool = threadPool();
+    vector<string> ribs(states.size());
+    size_t batch = 2 * pool.size();
+    for (size_t first = 0; first < states.size(); first += batch)
+    {
+        size_t last = min(states.size(), first + batch);
+        TaskGroup tasks(pool);
+        for (size_t i = first; i < last; ++i)
+        {
+            runBuffered(tasks, rib.binary(), &ribs[i], [&, i](RibWriter& rib) {
+                replayobjlines(states[i], cache, materials, bounds[i], bounds[i + 1], rib);
+            });
+        }
+        tasks.wait();
+        for (size_t i = first; i < last; ++i)
+        {
+            rib.append(ribs[i]);
+            string().swap(ribs[i]);
+            bound.extend(states[i].bound);
+            states[i] = objstate();
+        }
+    }
+    return bound;
+}
+
+static void reportObjCache()
+{
+    if (objCacheStats.read == 0 && objCacheStats.written == 0) return;
+    cerr << "OBJ caches: " << objCacheStats.read << " read, " << objCacheStats.written
+         << " written";
+    if (objCacheStats.written > 0)
+    {
+        cerr << " (" << objCacheStats.bytesOut * 1e-6 << " MB from "
+             << objCacheStats.bytesIn * 1e-6 << " MB of OBJ)";
+    }
+    cerr << endl;
+}
+
+// The same OBJ file can be referenced by several instanced primitives,
+// by the instanced copies of an element, and by other elements, and
+// several mis2rib processes may be converting the island at once.
+// Each OBJ file is converted once for each set of materials it is
+// used with; everything else simply reads the converted archive.
+//
+// OBJ files are converted to the same path under rib/ in place of
+// obj/. Each element's own files live under obj/<element name>/; any
+// other element using one of those files with its own materials gets
+// an archive named after the hash of its materials, so that the
+// archive names don't depend on which element gets there first.
+//
+// Within a process, the first caller claims the archive in a registry
+// and converts it. Between processes, the conversion happens under an
+// exclusive lock on a stamp file next to the archive, which records
+// what the archive was converted from; a process which finds a
+// matching stamp once it has the lock uses the archive as it is.
+
+static uint64_t materialsHash(const unordered_map<string, materialdef>& materials)
+{
+    // Independent of the order of the map
+    uint64_t h = materials.size();
+    for (auto& m : materials)
+    {
+        h += hashBytes(
+            m.second.text.data(), m.second.text.size(), hashBytes(m.first.data(), m.first.size()));
+    }
+    return h;
+}
+
+static atomic<int> archivesConverted(0), archivesShared(0);
+
+// Every archive and side file this process has claimed, with the
+// bound of its contents once it has been written
+struct archiveentry
+{
+    bool written = false;
+    Bound bound;
+};
+static mutex archiveLock;
+static map<string, archiveentry> archiveRegistry;
+
+// Returns true if the caller is the first to claim ofilename, and so
+// should write it
+static bool claim(const string& ofilename)
+{
+    lock_guard<mutex> lock(archiveLock);
+    return archiveRegistry.emplace(ofilename, archiveentry()).second;
+}
+
+static void publishBound(const string& ofilename, const Bound& bound)
+{
+    lock_guard<mutex> lock(archiveLock);
+    archiveentry& entry = archiveRegistry[ofilename];
+    entry.written = true;
+    entry.bound = bound;
+}
+
+// The bound of a claimed file, if it has been written yet
+static bool publishedBound(const string& ofilename, Bound& bound)
+{
+    lock_guard<mutex> lock(archiveLock);
+    auto i = archiveRegistry.find(ofilename);
+    if (i == archiveRegistry.end() || !i->second.written) return false;
+    bound = i->second.bound;
+    return true;
+}
+
+// Returns the name of the archive for an OBJ file converted with the
+// materials of an element, and culled if cull is given, and whether
+// the caller has claimed it and should convert it
+static string claimArchive(
+    const string& elementName,
+    const string& filename,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull,
+    uint64_t& hash,
+    bool& claimed)
+{
+    string ofilename = filename;
+    size_t pos = ofilename.find(".obj", 0);
+    if (pos != string::npos)
+    {
+        ofilename.replace(pos, 4, ".rib");
+    }
+    pos = ofilename.find("obj/", 0);
+    if (pos != string::npos)
+    {
+        ofilename.replace(pos, 4, "rib/");
+    }
+
+    hash = materialsHash(materials);
+    if (cull) hash = hashBytes(&cull->hash, sizeof(cull->hash), hash);
+    size_t slash = filename.find('/', 4);
+    if (cull || (filename.compare(0, 4, "obj/") == 0 && slash != string::npos &&
+                 filename.compare(4, slash - 4, elementName) != 0))
+    {
+        string suffix = "." + hex(hash) + ".rib";
+        size_t ext = ofilename.rfind(".rib");
+        if (ext != string::npos && ext + 4 == ofilename.size())
+            ofilename.replace(ext, 4, suffix);
+        else
+            ofilename += suffix;
+    }
+
+    claimed = claim(ofilename);
+    return ofilename;
+}
+
+// The file under rib/ written from a JSON file of an element, such as
+// an instance cache. Like the archives it refers to, the file written
+// for another element's JSON file is named after the hash of the
+// materials, and a file written with culling after what it was
+// culled against
+static string sideFile(
+    const string& elementName,
+    const string& jsonFilename,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull,
+    const string& extension)
+{
+    string ofilename = jsonFilename;
+    size_t pos = ofilename.rfind(".json");
+    if (pos != string::npos) ofilename.erase(pos);
+    size_t slash = jsonFilename.find('/', 5);
+    if (jsonFilename.compare(0, 5, "json/") == 0)
+    {
+        ofilename.replace(0, 5, "rib/");
+        if (slash != string::npos && jsonFilename.compare(5, slash - 5, elementName) != 0)
+        {
+            ofilename += "." + hex(materialsHash(materials));
+        }
+    }
+    if (cull) ofilename += "." + hex(cull->hash);
+    return ofilename + extension;
+}
+
+// Geometry deduplicated by --dedup-geometry in each element
+struct dedupstats
+{
+    int masters = 0;
+    int instances = 0;
+    uint64_t saved = 0;
+};
+static mutex dedupLock;
+static map<string, dedupstats> dedupStats;
+
+static void addDedup(const string& elementName, const json& info)
+{
+    lock_guard<mutex> lock(dedupLock);
+    dedupstats& d = dedupStats[elementName];
+    d.masters += info.value("masters", 0);
+    d.instances += info.value("instances", 0);
+    d.saved += info.value("saved", uint64_t(0));
+}
+
+static void reportDedup()
+{
+    if (!options.dedupGeometry) return;
+    dedupstats total;
+    for (auto& d : dedupStats)
+    {
+        cerr << d.first << ": " << d.second.instances << " groups instanced from "
+             << d.second.masters << " masters, " << d.second.saved * 1e-6 << " MB saved" << endl;
+        total.masters += d.second.masters;
+        total.instances += d.second.instances;
+        total.saved += d.second.saved;
+    }
+    if (dedupStats.size() > 1)
+    {
+        cerr << "total: " << total.instances << " groups instanced from " << total.masters
+             << " masters, " << total.saved * 1e-6 << " MB saved" << endl;
+    }
+}
+
+static void reportCull()
+{
+    if (options.cullCamera.empty()) return;
+    auto report = [](const char* what, uint64_t total, uint64_t culled) {
+        if (total == 0) return;
+        cerr << "culled " << culled << " of " << total << " " << what << " ("
+             << 100.0 * culled / total << "%)" << endl;
+    };
+    report("groups", cullStats.groups, cullStats.groupsCulled);
+    report("instances", cullStats.instances, cullStats.instancesCulled);
+    report("curves", cullStats.curves, cullStats.curvesCulled);
+    report("copies", cullStats.copies, cullStats.copiesCulled);
+}
+
+// Identifies a converted archive in its stamp file
+static json archiveStamp(const string& filename, const string& ofilename, uint64_t hash)
+{
+    json stamp;
+    filestate source, output;
+    statFile(filename, source);
+    statFile(ofilename, output);
+    stamp["source"] = filename;
+    stamp["sourceState"] = {source.size, source.mtime};
+    stamp["materials"] = hex(hash);
+    stamp["options"] = optionsSignature();
+    stamp["converter"] = converterVersion();
+    stamp["outputState"] = {output.size, output.mtime};
+    return stamp;
+}
+
+// The stamp of an archive, opened and locked for as long as it's
+// held, however the conversion ends
+struct stamplock
+{
+    explicit stamplock(const string& filename)
+        : fd(open(filename.c_str(), O_RDWR | O_CREAT, 0666))
+    {
+        if (fd < 0) return;
+        flock(fd, LOCK_EX);
+        t_locksHeld++;
+    }
+    ~stamplock()
+    {
+        if (fd < 0) return;
+        close(fd);
+        t_locksHeld--;
+    }
+    int fd;
+};
+
+// Convert an OBJ file to the archive ofilename, unless another
+// process already has, and return the bound of its geometry
+static Bound convertArchive(
+    const string& elementName,
+    const string& filename,
+    const string& ofilename,
+    uint64_t hash,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull,
+    decimation* decimate,
+    bool binary)
+{
+    boost::filesystem::path p(ofilename);
+    p.remove_filename();
+    if (!boost::filesystem::exists(p))
+    {
+        boost::filesystem::create_directories(p);
+    }
+
+    string stampname = ofilename + ".stamp";
+    stamplock lock(stampname);
+    int fd = lock.fd;
+
+    // Skip the conversion if the stamp matches
+    if (fd >= 0)
+    {
+        string contents;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) contents.append(buffer, n);
+        json stamp = json::parse(contents, nullptr, false);
+        json expected = archiveStamp(filename, ofilename, hash);
+        bool matches = stamp.is_object() && stamp.value("bound", json()).size() == 6;
+        for (auto& i : expected.items())
+        {
+            matches = matches && stamp.value(i.key(), json()) == i.value();
+        }
+        if (matches)
+        {
+            addOutput(ofilename);
+            if (!decimate) archivesShared++;
+            if (stamp.find("dedup") != stamp.end())
+            {
+                addDedup(elementName, stamp["dedup"]);
+            }
+            if (decimate && stamp.value("triangles", json()).size() == 2)
+            {
+                decimate->trianglesIn += stamp["triangles"][0].get<uint64_t>();
+                decimate->trianglesOut += stamp["triangles"][1].get<uint64_t>();
+            }
+            Bound bound;
+            for (int i = 0; i < 6; ++i) bound.b[i] = stamp["bound"][i];
+            publishBound(ofilename, bound);
+            return bound;
+        }
+    }
+
+    statsscope stats(statsUnit(archiveStats, ofilename), true);
+    json dedupInfo;
+    Bound bound;
+    {
+        unique_ptr<objcache> cache;
+        if (options.objCache) cache = openObjCache(filename);
+        unique_ptr<mappedfile> objfile;
+        if (!cache) objfile.reset(new mappedfile(filename));
+        unique_ptr<geometrydedup> dedup;
+        auto parse = [&](RibWriter& rib) {
+            phasescope phase(phaseObjParse);
+            bound = Bound();
+            if (cache)
+            {
+                bound = replayobj(elementName, materials, *cache, rib, dedup.get(), cull, decimate);
+            }
+            else if (options.splitObj <= 0 ||
+                !parseobjSplit(
+                    elementName, materials, objfile->begin(), objfile->end(), rib, bound,
+                    dedup.get(), cull, decimate))
+            {
+                bound = parseobj(
+                    elementName, materials, objfile->begin(), objfile->end(), rib, dedup.get(),
+                    cull, decimate);
+            }
+        };
+        if (options.dedupGeometry && !decimate)
+        {
+            // A first pass to find the duplicate geometry
+            dedup.reset(new geometrydedup);
+            dedup->prefix = ofilename;
+            nullstream null;
+            RibWriter counter(null, binary);
+            parse(counter);
+            dedup->counting = false;
+        }
+        {
+            ribstream ribostr(ofilename, true);
+            RibWriter archive(ribostr.stream(), binary);
+            parse(archive);
+            archive.flush();
+            if (!ribostr.commit()) throw runtime_error("Unable to write " + ofilename);
+        }
+        if (dedup)
+        {
+            int masters = 0, instances = 0;
+            for (auto& same : dedup->groups)
+            {
+                for (auto& g : same.second)
+                {
+                    if (g.count < 2) continue;
+                    masters++;
+                    instances += g.count;
+                }
+            }
+            dedupInfo = {{"masters", masters}, {"instances", instances}, {"saved", dedup->saved()}};
+            addDedup(elementName, dedupInfo);
+        }
+    }
+    if (!decimate) archivesConverted++;
+
+    if (fd >= 0)
+    {
+        json stamp = archiveStamp(filename, ofilename, hash);
+        if (!dedupInfo.is_null()) stamp["dedup"] = dedupInfo;
+        if (decimate)
+        {
+            stamp["triangles"] = {
+                decimate->trianglesIn.load(), decimate->trianglesOut.load()};
+        }
+        stamp["bound"] = vector<float>(bound.b, bound.b + 6);
+        string contents = stamp.dump() + "\n";
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, contents.data(), contents.size(), 0) < 0)
+        {
+            cerr << "Unable to write " << stampname << endl;
+        }
+    }
+    publishBound(ofilename, bound);
+    return bound;
+}
+
+// The bound of an archive claimed by someone else. If it hasn't been
+// written yet, rather than wait for it, the OBJ file is read again
+// without writing anything
+static Bound archiveBound(
+    const string& elementName,
+    const string& filename,
+    const string& ofilename,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull)
+{
+    Bound bound;
+    if (!publishedBound(ofilename, bound))
+    {
+        phasescope phase(phaseObjParse);
+        nullstream null;
+        RibWriter rib(null, false);
+        unique_ptr<objcache> cache;
+        if (options.objCache) cache = openObjCache(filename);
+        if (cache)
+        {
+            bound = replayobj(elementName, materials, *cache, rib, nullptr, cull);
+        }
+        else
+        {
+            mappedfile objfile(filename);
+            bound = parseobj(
+                elementName, materials, objfile.begin(), objfile.end(), rib, nullptr, cull);
+        }
+    }
+    return bound;
+}
+
+// The archive for an OBJ file, which the caller must convert if it has
+// claimed it
+static string archiveFile(
+    const string& elementName,
+    const string& filename,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull,
+    uint64_t& hash,
+    bool& claimed)
+{
+    addInput(filename);
+    string ofilename = claimArchive(elementName, filename, materials, cull, hash, claimed);
+    if (!claimed)
+    {
+        addOutput(ofilename);
+        archivesShared++;
+    }
+    return ofilename;
+}
+
+// The error allowed at a level of detail, 1 and up, as a fraction of
+// the size of the bound of an archive; each level allows four times
+// the error of the one before
+static float levelError(int level)
+{
+    return options.decimateError * powf(4, float(level - 1));
+}
+
+// Convert the simplified levels of detail of an archive, returning
+// their file names
+static vector<string> decimatedArchives(
+    const string& elementName,
+    const string& filename,
+    const string& ofilename,
+    uint64_t hash,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull,
+    const Bound& bound,
+    bool binary)
+{
+    vector<string> levels;
+    if (bound.empty()) return levels;
+    float size = sqrtf(
+        (bound.b[1] - bound.b[0]) * (bound.b[1] - bound.b[0]) +
+        (bound.b[3] - bound.b[2]) * (bound.b[3] - bound.b[2]) +
+        (bound.b[5] - bound.b[4]) * (bound.b[5] - bound.b[4]));
+    for (int level = 1; level <= options.decimateLevels; ++level)
+    {
+        string lodname = ofilename;
+        size_t ext = lodname.rfind(".rib");
+        if (ext != string::npos) lodname.erase(ext);
+        lodname += ".lod" + to_string(level) + ".rib";
+        levels.push_back(lodname);
+
+        decimation d;
+        d.error = levelError(level) * size;
+        if (!claim(lodname))
+        {
+            addOutput(lodname);
+            continue;
+        }
+        uint64_t h = hashBytes(&d.error, sizeof(d.error), hash + level);
+        convertArchive(elementName, filename, lodname, h, materials, cull, &d, binary);
+        if (level == 1) levelTriangles[0] += d.trianglesIn;
+        levelTriangles[level] += d.trianglesOut;
+        if (level == 1) archivesDecimated++;
+    }
+    return levels;
+}
+
+static void reportDecimation()
+{
+    if (archivesDecimated == 0) return;
+    cerr << "decimated " << archivesDecimated << " archives: " << levelTriangles[0]
+         << " triangles";
+    for (int level = 1; level <= options.decimateLevels; ++level)
+    {
+        cerr << ", level " << level << " " << levelTriangles[level] << " ("
+             << 100.0 * levelTriangles[level] / max(uint64_t(levelTriangles[0]), uint64_t(1))
+             << "%)";
+    }
+    cerr << endl;
+}
+
+// Reference the archive for an OBJ file, and return its bound, which
+// is only known if it was converted here, or with --delayed,
+// --cull-camera or --decimate. The groups of the archive are culled if
+// cull is given. With --decimate, a master also gets simplified levels
+// of detail, which the renderer chooses between by the area of its
+// bound on screen
+static Bound objFile(
+    RibWriter& rib,
+    const string& elementName,
+    const string& filename,
+    const unordered_map<string, materialdef>& materials,
+    bool isMaster,
+    const cullplaces* cull = nullptr)
+{
+    uint64_t hash;
+    bool claimed;
+    string ofilename = archiveFile(elementName, filename, materials, cull, hash, claimed);
+    Bound bound;
+    if (claimed)
+    {
+        bound = convertArchive(
+            elementName, filename, ofilename, hash, materials, cull, nullptr, rib.binary());
+    }
+    else if (
+        options.delayed || !options.cullCamera.empty() || (isMaster && options.decimateLevels > 0))
+    {
+        bound = archiveBound(elementName, filename, ofilename, materials, cull);
+    }
+    vector<string> levels;
+    if (isMaster && options.decimateLevels > 0)
+    {
+        levels = decimatedArchives(
+            elementName, filename, ofilename, hash, materials, cull, bound, rib.binary());
+    }
+
+    if (!isMaster)
+    {
+        rib.newline();
+        rib.indent();
+        rib.comment("begin objFile " + filename);
+    }
+    // The caller has already indented the first line of a master
+    bool first = true;
+    auto indent = [&]() {
+        rib.indent(isMaster && !first ? 2 : 1);
+        first = false;
+    };
+    auto archive = [&](const string& name) {
+        indent();
+        if (options.delayed)
+        {
+            // Only read once a ray reaches the bound
+            const char* args[] = {name.c_str()};
+            rib.request("Procedural");
+            rib.token("DelayedReadArchive");
+            rib.tokens(args, 1);
+            outputBound(rib, bound);
+        }
+        else
+        {
+            rib.request("ReadArchive");
+            rib.str(name);
+        }
+        rib.newline();
+    };
+    if (levels.empty())
+    {
+        archive(ofilename);
+    }
+    else
+    {
+        // A level with an error of a fraction f of the size of the
+        // bound is within about a pixel while the bound covers less
+        // than 1/f^2 pixels
+        indent();
+        rib.request("Detail");
+        outputBound(rib, bound);
+        rib.newline();
+        for (int level = 0; level <= (int)levels.size(); ++level)
+        {
+            float finer = level > 0 ? levelError(level) : 0;
+            float coarser = levelError(level + 1);
+            float low = level < (int)levels.size() ? 1 / (coarser * coarser) : 0;
+            float high = level > 0 ? 1 / (finer * finer) : 1e38f;
+            indent();
+            rib.request("DetailRange");
+            rib.real(low);
+            rib.real(low);
+            rib.real(high);
+            rib.real(high);
+            rib.newline();
+            archive(level == 0 ? ofilename : levels[level - 1]);
+        }
+    }
+    if (!isMaster)
+    {
+        rib.indent();
+        rib.comment("end objFile " + filename);
+    }
+    return bound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
 // Material JSON file
 ////////////////////////////////////////////////////////////////////////////////
 
-static void floatParam(ostream& ostr, const string& name, float f)
+static void floatParam(ostream& ostr, const string& name, float f)
+{
+    ostr << " \"float " << name << "\" [" << f << "]";
+}
+
+static void floatParam(RibWriter& rib, const string& name, float f)
+{
+    rib.token("float " + name);
+    rib.floats(&f, 1);
+}
+
+static void outputTransform(RibWriter& rib, const vector<float>& matrix)
+{
+    rib.request("ConcatTransform");
+    rib.floats(&matrix[0], 16);
+    rib.newline();
+}
+
+static string material(
+    const string& elementName,
+    const string& name,
+    const json& j,
+    unordered_map<string, string>& assignments)
+{
+    ostringstream ostr;
+
+    // Check for displacement and color map
+    if (j.find("displacementMap") != j.end() && j["displacementMap"] != "")
+    {
+        string displacementMap = j.at("displacementMap");
+        ostr << "    Pattern \"PxrPtexture\" \"" << name
+             << "DisplacementMap\" \"string filename\" \"" << displacementMap << "%\"" << endl;
+        ostr << "    Displace \"PxrDisplace\" \"" << name << "\"";
+        ostr << " \"reference float dispScalar\" [\"" << name << "DisplacementMap:resultR\"]"
+             << endl;
+    }
+
+    bool ptxColor = false;
+    if (j.find("colorMap") != j.end() && j["colorMap"] != "")
+    {
+        string colorMap = j.at("colorMap");
+        if (!colorMap.empty() && colorMap[colorMap.length() - 1] != '/')
+        {
+            colorMap += "/";
+        }
+        // Encode a special token % which will be substituted by the
+        // object name when we parse the obj file
+        ostr << "    Pattern \"PxrPtexture\" \"" << name << "ColorMap\" \"string filename\" \""
+             << colorMap << "%\"";
+        // Convert to linear color space
+        ostr << " \"int linearize\" [1]";
+        ostr << endl;
+        ptxColor = true;
+    }
+
+    ostr << "    Bxdf \"PxrSurface\" \"" << name << "\"";
+
+    for (auto i = j.begin(); i != j.end(); ++i)
+    {
+        if (i.key() == "colorMap" || i.key() == "displacementMap")
+        {
+            // Handled above
+        }
+        else if (i.key() == "assignment")
+        {
+            // Unlike what the README implies, we do still need keep
+            // track of assignments in order to correctly assign
+            // materials to curves. We don't need to do this for the
+            // OBJ files, but at this point we don't know whether the
+            // material will be used on those.
+            const vector<string>& s = i.value();
+            for (auto k = s.begin(); k != s.end(); ++k)
+            {
+                assignments[*k] = name;
+            }
+        }
+        else if (i.key() == "type")
+        {
+            // Need to do something here!
+        }
+        else if (i.key() == "baseColor")
+        {
+            if (ptxColor)
+            {
+                ostr << " \"reference color diffuseColor\" [\"" << name << "ColorMap:resultRGB\"]";
+            }
+            else
+            {
+                ostr << " \"color diffuseColor\" [" << i.value()[0] << ' ' << i.value()[1] << ' '
+                     << i.value()[2] << "]";
+            }
+        }
+        else if (i.key() == "diffTrans")
+        {
+            // An attempt to map diffuse trans to PxrSurface's diffuse
+            // transmit behavior
+            float diffTrans = i.value();
+            if (diffTrans > 0)
+            {
+                ostr << " \"int diffuseDoubleSided\" [1]";
+                floatParam(ostr, "diffuseGain", 0.5f * (2 - diffTrans));
+                floatParam(ostr, "diffuseTransmitGain", 0.5f * diffTrans);
+                if (ptxColor)
+                {
+                    ostr << " \"reference color diffuseTransmitColor\" [\"" << name
+                         << "ColorMap:resultRGB\"]";
+                }
+                else if (j.find("baseColor") != j.end())
+                {
+                    ostr << " \"color diffuseTransmitColor\" [" << j["baseColor"][0] << ' '
+                         << j["baseColor"][1] << ' ' << j["baseColor"][2] << "]";
+                }
+            }
+        }
+        else if (i.key() == "flatness")
+        {
+            // An attempt to turn flatness into some real subsurface
+            float subsurfaceGain = i.value();
+            if (subsurfaceGain != 0.0f)
+            {
+                floatParam(ostr, "subsurfaceGain", subsurfaceGain);
+                if (ptxColor)
+                {
+                    ostr << " \"reference color subsurfaceColor\" [\"" << name
+                         << "ColorMap:resultRGB\"]";
+                }
+                else if (j.find("baseColor") != j.end())
+                {
+                    ostr << " \"color subsurfaceColor\" [" << j["baseColor"][0] << ' '
+                         << j["baseColor"][1] << ' ' << j["baseColor"][2] << "]";
+                }
+            }
+        }
+        else if (i.key() == "roughness")
+        {
+            // Disney BXDF roughness affects specular and diffuse
+            // roughness lobes
+            floatParam(ostr, "specularRoughness", i.value());
+            floatParam(ostr, "diffuseRoughness", i.value());
+        }
+        else if (i.key() == "ior")
+        {
+            ostr << " \"color specularIor\" [" << i.value() << ' ' << i.value() << ' ' << i.value()
+                 << "]";
+        }
+        else if (i.key() == "sheen")
+        {
+            // Map Disney BXDF sheen to PxrSurface fuzz
+            floatParam(ostr, "fuzzGain", i.value());
+        }
+        else if (i.key() == "sheenTint")
+        {
+            float sheenTint = i.value();
+            if (sheenTint != 0.0f && j.find("baseColor") != j.end())
+            {
+                if (sheenTint == 1.0f)
+                {
+                    if (ptxColor)
+                    {
+                        ostr << " \"reference color fuzzColor\" [\"" << name
+                             << "ColorMap:resultRGB\"]";
+                    }
+                    else if (j.find("baseColor") != j.end())
+                    {
+                        ostr << " \"color fuzzColor\" [" << j["baseColor"][0] << ' '
+                             << j["baseColor"][1] << ' ' << j["baseColor"][2] << "]";
+                    }
+                }
+                else
+                {
+                    if (ptxColor)
+                    {
+                        // This is a situation we can't currently handle,
+                        // so just punt and use the ptx color fully
+                        ostr << " \"reference color fuzzColor\" [\"" << name
+                             << "ColorMap:resultRGB\"]";
+                    }
+                    else
+                    {
+                        std::vector<float> fuzzColor = j["baseColor"];
+                        fuzzColor[0] = (1.0f - sheenTint) + sheenTint * fuzzColor[0];
+                        fuzzColor[1] = (1.0f - sheenTint) + sheenTint * fuzzColor[1];
+                        fuzzColor[2] = (1.0f - sheenTint) + sheenTint * fuzzColor[2];
+                        ostr << " \"color fuzzColor\" [" << fuzzColor[0] << ' ' << fuzzColor[1]
+                             << ' ' << fuzzColor[2] << "]";
+                    }
+                }
+            }
+        }
+        else if (i.key() == "alpha")
+        {
+            // No material sets this to value other than 1, so let's
+            // just ignore it
+        }
+        else if (i.key() == "specTrans" || i.key() == "scatterDistance")
+        {
+            // Not handled yet!
+        }
+        else if (i.key() == "refractive")
+        {
+            // Attempt to turn on PxrSurface glass settings
+            floatParam(ostr, "refractionGain", i.value());
+            floatParam(ostr, "reflectionGain", i.value());
+            floatParam(ostr, "diffuseGain", 0.0f);
+            if (j.find("ior") != j.end())
+            {
+                floatParam(ostr, "glassIor", j["ior"]);
+            }
+            if (j.find("roughness") != j.end())
+            {
+                floatParam(ostr, "glassRoughness", j["roughness"]);
+            }
+        }
+        else if (i.key() == "specularTint")
+        {
+            // The Disney BXDF is somewhere in between the artistic
+            // and physical controls of PxrSurface. In particular, the
+            // specularTint would be somewhat equivalent to setting
+            // the artistic controls specularFaceColor and
+            // specularEdgeColor to be a mix between white and the
+            // baseColor, whereas the ior is a physical control.  For
+            // now I'm just going to rely on the physical controls.
+            // So while I'm outputting the artistic control values, I
+            // haven't actually toggled on specularFresnelMode.
+            float specularTint = i.value();
+            if (specularTint != 0.0f && j.find("baseColor") != j.end())
+            {
+                std::vector<float> specularColor = j["baseColor"];
+                specularColor[0] = (1.0f - specularTint) + specularTint * specularColor[0];
+                specularColor[1] = (1.0f - specularTint) + specularTint * specularColor[1];
+                specularColor[2] = (1.0f - specularTint) + specularTint * specularColor[2];
+                ostr << " \"color specularFaceColor\" [" << specularColor[0] << ' '
+                     << specularColor[1] << ' ' << specularColor[2] << "]";
+                ostr << " \"color specularEdgeColor\" [" << specularColor[0] << ' '
+                     << specularColor[1] << ' ' << specularColor[2] << "]";
+            }
+        }
+        else if (i.key() == "metallic")
+        {
+            // Not even sure how to handle this
+        }
+        else if (i.key() == "clearcoat" || i.key() == "clearcoatGloss")
+        {
+            // Should try to map this to the secondary rough specular
+            // lobe, maybe?
+        }
+        else if (i.key() == "anisotropic")
+        {
+            float anisotropic = i.value();
+            if (anisotropic != 0.0f)
+            {
+                floatParam(ostr, i.key(), i.value());
+            }
+        }
+        else
+        {
+            cerr << "Warning: unknown material key " << i.key() << endl;
+        }
+    }
+    return ostr.str();
+}
+
+// Split the text of a material at each %, and with --shared-materials,
+// into the lines which name a Ptex file and the rest
+static materialdef compileMaterial(const string& text)
+{
+    materialdef m;
+    m.text = text;
+    string local = text;
+    if (options.sharedMaterials)
+    {
+        local.clear();
+        for (size_t begin = 0; begin < text.size();)
+        {
+            size_t end = text.find('\n', begin);
+            end = end == string::npos ? text.size() : end + 1;
+            string& part = text.find('%', begin) < end ? local : m.shared;
+            part.append(text, begin, end - begin);
+            begin = end;
+        }
+        if (!local.empty() && local.back() == '\n') local.pop_back();
+        if (!m.shared.empty() && m.shared.back() == '\n') m.shared.pop_back();
+        if (!m.shared.empty())
+            m.handle = "mis2rib:material:" + hex(hashBytes(m.shared.data(), m.shared.size()));
+        if (local.empty()) return m;
+    }
+    for (size_t begin = 0;;)
+    {
+        size_t end = local.find('%', begin);
+        m.segments.push_back(local.substr(begin, end - begin));
+        if (end == string::npos) break;
+        begin = end + 1;
+    }
+    return m;
+}
+
+static void materialFile(
+    const string& elementName,
+    const string& filename,
+    const json& j,
+    unordered_map<string, materialdef>& materials,
+    unordered_map<string, string>& assignments)
+{
+    for (auto i = j.begin(); i != j.end(); ++i)
+    {
+        materials[i.key()] =
+            compileMaterial(material(elementName, i.key(), i.value(), assignments));
+    }
+}
+
+// With --shared-materials, define the shared part of each material as
+// an inline archive, once for each handle
+static void defineMaterials(RibWriter& rib, const unordered_map<string, materialdef>& materials)
+{
+    map<string, const materialdef*> handles;
+    for (auto& m : materials)
+    {
+        if (!m.second.handle.empty()) handles[m.second.handle] = &m.second;
+    }
+    for (auto& h : handles)
+    {
+        rib.request("ArchiveBegin");
+        rib.str(h.first);
+        rib.newline();
+        rib.verbatim(h.second->shared);
+        rib.newline();
+        rib.request("ArchiveEnd");
+        rib.newline();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Camera facing curve normals
+////////////////////////////////////////////////////////////////////////////////
+
+// RenderMan 22 no longer has flat curves which face the camera, but a
+// curve with normals is a ribbon perpendicular to them, so normals
+// pointing back at the eye give the same look from one camera. The
+// island has hundreds of millions of curve CVs, so the normals are
+// found a block at a time by a SIMD kernel chosen when first used.
+
+// A block of CVs in structure of arrays form: the position of each CV,
+// the direction of its curve there, and the normal found for it.
+// Kernels may read and write past n up to a multiple of 8
+struct cvblock
+{
+    static const size_t capacity = 4096;
+    alignas(32) float px[capacity], py[capacity], pz[capacity];
+    alignas(32) float tx[capacity], ty[capacity], tz[capacity];
+    alignas(32) float nx[capacity], ny[capacity], nz[capacity];
+    size_t n = 0;
+};
+
+// The normal at a CV is the direction to the eye less its component
+// along the curve, normalized, or y if that vanishes because the eye
+// lies on the curve. The SIMD kernels do the same operations in the
+// same order
+static void facingNormalsScalar(cvblock& b, const Float3& eye)
+{
+    for (size_t i = 0; i < b.n; ++i)
+    {
+        float vx = eye.x - b.px[i], vy = eye.y - b.py[i], vz = eye.z - b.pz[i];
+        float tx = b.tx[i], ty = b.ty[i], tz = b.tz[i];
+        float tt = tx * tx + ty * ty + tz * tz;
+        float vt = vx * tx + vy * ty + vz * tz;
+        float s = tt > 0 ? vt / tt : 0;
+        float nx = vx - s * tx, ny = vy - s * ty, nz = vz - s * tz;
+        float nn = nx * nx + ny * ny + nz * nz;
+        if (nn > 0)
+        {
+            float len = sqrtf(nn);
+            b.nx[i] = nx / len;
+            b.ny[i] = ny / len;
+            b.nz[i] = nz / len;
+        }
+        else
+        {
+            b.nx[i] = 0;
+            b.ny[i] = 1;
+            b.nz[i] = 0;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void facingNormalsSSE(cvblock& b, const Float3& eye)
+{
+    const __m128 ex = _mm_set1_ps(eye.x), ey = _mm_set1_ps(eye.y), ez = _mm_set1_ps(eye.z);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    for (size_t i = 0; i < b.n; i += 4)
+    {
+        __m128 vx = _mm_sub_ps(ex, _mm_load_ps(b.px + i));
+        __m128 vy = _mm_sub_ps(ey, _mm_load_ps(b.py + i));
+        __m128 vz = _mm_sub_ps(ez, _mm_load_ps(b.pz + i));
+        __m128 tx = _mm_load_ps(b.tx + i), ty = _mm_load_ps(b.ty + i), tz = _mm_load_ps(b.tz + i);
+        __m128 tt =
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz));
+        __m128 vt =
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, tx), _mm_mul_ps(vy, ty)), _mm_mul_ps(vz, tz));
+        __m128 s = _mm_and_ps(_mm_div_ps(vt, tt), _mm_cmpgt_ps(tt, zero));
+        __m128 nx = _mm_sub_ps(vx, _mm_mul_ps(s, tx));
+        __m128 ny = _mm_sub_ps(vy, _mm_mul_ps(s, ty));
+        __m128 nz = _mm_sub_ps(vz, _mm_mul_ps(s, tz));
+        __m128 nn =
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+        __m128 ok = _mm_cmpgt_ps(nn, zero);
+        __m128 len = _mm_sqrt_ps(nn);
+        _mm_store_ps(b.nx + i, _mm_and_ps(ok, _mm_div_ps(nx, len)));
+        _mm_store_ps(
+            b.ny + i, _mm_or_ps(_mm_and_ps(ok, _mm_div_ps(ny, len)), _mm_andnot_ps(ok, one)));
+        _mm_store_ps(b.nz + i, _mm_and_ps(ok, _mm_div_ps(nz, len)));
+    }
+}
+
+__attribute__((target("avx2"))) static void facingNormalsAVX2(cvblock& b, const Float3& eye)
+{
+    const __m256 ex = _mm256_set1_ps(eye.x), ey = _mm256_set1_ps(eye.y),
+                 ez = _mm256_set1_ps(eye.z);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+    for (size_t i = 0; i < b.n; i += 8)
+    {
+        __m256 vx = _mm256_sub_ps(ex, _mm256_load_ps(b.px + i));
+        __m256 vy = _mm256_sub_ps(ey, _mm256_load_ps(b.py + i));
+        __m256 vz = _mm256_sub_ps(ez, _mm256_load_ps(b.pz + i));
+        __m256 tx = _mm256_load_ps(b.tx + i), ty = _mm256_load_ps(b.ty + i),
+               tz = _mm256_load_ps(b.tz + i);
+        __m256 tt = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(tx, tx), _mm256_mul_ps(ty, ty)), _mm256_mul_ps(tz, tz));
+        __m256 vt = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(vx, tx), _mm256_mul_ps(vy, ty)), _mm256_mul_ps(vz, tz));
+        __m256 s = _mm256_and_ps(_mm256_div_ps(vt, tt), _mm256_cmp_ps(tt, zero, _CMP_GT_OQ));
+        __m256 nx = _mm256_sub_ps(vx, _mm256_mul_ps(s, tx));
+        __m256 ny = _mm256_sub_ps(vy, _mm256_mul_ps(s, ty));
+        __m256 nz = _mm256_sub_ps(vz, _mm256_mul_ps(s, tz));
+        __m256 nn = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz));
+        __m256 ok = _mm256_cmp_ps(nn, zero, _CMP_GT_OQ);
+        __m256 len = _mm256_sqrt_ps(nn);
+        _mm256_store_ps(b.nx + i, _mm256_and_ps(ok, _mm256_div_ps(nx, len)));
+        _mm256_store_ps(
+            b.ny + i,
+            _mm256_or_ps(_mm256_and_ps(ok, _mm256_div_ps(ny, len)), _mm256_andnot_ps(ok, one)));
+        _mm256_store_ps(b.nz + i, _mm256_and_ps(ok, _mm256_div_ps(nz, len)));
+    }
+}
+#endif
+
+typedef void (*normalskernel)(cvblock&, const Float3&);
+
+// The kernels this machine can run, fastest last
+static vector<pair<string, normalskernel>> normalsKernels()
+{
+    vector<pair<string, normalskernel>> kernels = {{"scalar", facingNormalsScalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernels.push_back({"sse", facingNormalsSSE});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", facingNormalsAVX2});
+#endif
+    return kernels;
+}
+
+static void facingNormals(cvblock& b, const Float3& eye)
+{
+    static const normalskernel kernel = normalsKernels().back().second;
+    kernel(b, eye);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Streaming JSON
+////////////////////////////////////////////////////////////////////////////////
+
+// The curve and archive instance files can be hundreds of MB, and a
+// json document takes several times that in memory. They are instead
+// read a window of options.jsonWindow KB at a time through a SAX
+// parser, and the RIB is written as the values are parsed.
+
+class jsonfile
+{
+public:
+    jsonfile(const string& filename)
+        : m_filename(filename), m_buffer(size_t(max(options.jsonWindow, 4)) << 10)
+    {
+        addInput(filename);
+        addRead(filename);
+        m_file.rdbuf()->pubsetbuf(m_buffer.data(), m_buffer.size());
+        m_file.open(filename.c_str(), ios::binary);
+        if (!m_file)
+        {
+            throw runtime_error("Unable to open " + filename);
+        }
+    }
+
+    template <typename SAX>
+    void parse(SAX& sax)
+    {
+        json::sax_parse(m_file, &sax);
+    }
+
+    // Call f for each chunk of the raw file
+    template <typename F>
+    void chunks(F f)
+    {
+        while (m_file.read(m_buffer.data(), m_buffer.size()) || m_file.gcount() > 0)
+        {
+            f(m_buffer.data(), size_t(m_file.gcount()));
+        }
+    }
+
+    const string& filename() const { return m_filename; }
+
+private:
+    string m_filename;
+    vector<char> m_buffer;
+    ifstream m_file;
+};
+
+// Base SAX handler which ignores everything but keeps track of the
+// nesting depth. Handlers override the events they need, calling the
+// base versions of start_* and end_*
+struct jsonhandler
+{
+    jsonhandler(const std::string& filename) : filename(filename) {}
+
+    bool null() { return true; }
+    bool boolean(bool) { return true; }
+    bool number_integer(json::number_integer_t) { return true; }
+    bool number_unsigned(json::number_unsigned_t) { return true; }
+    bool number_float(json::number_float_t, const string&) { return true; }
+    bool string(std::string&) { return true; }
+    bool binary(json::binary_t&) { return true; }
+    bool key(std::string&) { return true; }
+    bool start_object(size_t)
+    {
+        depth++;
+        return true;
+    }
+    bool end_object()
+    {
+        depth--;
+        return true;
+    }
+    bool start_array(size_t)
+    {
+        depth++;
+        return true;
+    }
+    bool end_array()
+    {
+        depth--;
+        return true;
+    }
+    bool parse_error(size_t, const std::string&, const json::exception& e)
+    {
+        throw runtime_error(filename + ": " + e.what());
+    }
+
+    std::string filename;
+    int depth = 0;
+};
+
+// Handler which collects numbers at a given depth as floats, the same
+// as json::get<float> would
+struct jsonfloats : jsonhandler
+{
+    jsonfloats(const std::string& filename, int depth)
+        : jsonhandler(filename), valueDepth(depth)
+    {
+    }
+
+    bool number_integer(json::number_integer_t v) { return number(float(v)); }
+    bool number_unsigned(json::number_unsigned_t v) { return number(float(v)); }
+    bool number_float(json::number_float_t v, const std::string&) { return number(float(v)); }
+    bool number(float f)
+    {
+        if (depth == valueDepth) values.push_back(f);
+        return true;
+    }
+
+    int valueDepth;
+    vector<float> values;
+};
+
+// Number of points in each curve of a curve file, which is an array of
+// curves, each an array of points. This only needs the structure of
+// the file, so it is found by counting brackets rather than parsing
+static vector<int> curveSizes(const string& filename)
+{
+    vector<int> sizes;
+    jsonfile file(filename);
+    int depth = 0;
+    bool quoted = false, escaped = false;
+    file.chunks([&](const char* p, size_t n) {
+        for (const char* end = p + n; p != end; ++p)
+        {
+            char c = *p;
+            if (quoted)
+            {
+                if (escaped)
+                    escaped = false;
+                else if (c == '\\')
+                    escaped = true;
+                else if (c == '"')
+                    quoted = false;
+            }
+            else if (c == '[' || c == '{')
+            {
+                if (++depth == 2)
+                    sizes.push_back(0);
+                else if (depth == 3)
+                    sizes.back()++;
+            }
+            else if (c == ']' || c == '}')
+            {
+                depth--;
+            }
+            else if (c == '"')
+            {
+                quoted = true;
+            }
+        }
+    });
+    return sizes;
+}
+
+// Base handler for curve files, which are arrays of curves, each an
+// array of points. The points of each curve are collected, packed as
+// xyz in values, for derived handlers to act on at the end of the
+// curve, after which they call next()
+struct curvehandler : jsonfloats
+{
+    curvehandler(const std::string& filename) : jsonfloats(filename, 3) {}
+
+    bool end_array()
+    {
+        if (depth == 3)
+        {
+            // End of a point
+            values.resize(3 * ++points);
+        }
+        return jsonfloats::end_array();
+    }
+
+    void next()
+    {
+        values.clear();
+        points = 0;
+        curve++;
+    }
+
+    size_t curve = 0;
+    int points = 0;
+};
+
+// Write the points of every curve in a curve file which is kept, after
+// level of detail if lod is given, with the first and last points of
+// each curve repeated twice more
+struct curvepoints : curvehandler
+{
+    curvepoints(
+        const std::string& filename,
+        RibWriter& rib,
+        const vector<bool>& keep,
+        const curvelod* lod)
+        : curvehandler(filename), rib(rib), keep(keep), lod(lod)
+    {
+    }
+
+    bool end_array()
+    {
+        if (depth == 2)
+        {
+            // End of a curve
+            if (keep[curve])
+            {
+                if (lod) lod->simplify(values);
+                int n = int(values.size() / 3);
+                for (int k = -2; k < n + 2; ++k)
+                {
+                    const float* p = &values[3 * min(max(k, 0), n - 1)];
+                    if (k >= 0 && k < n) bound.extend(p[0], p[1], p[2]);
+                    rib.element(p[0]);
+                    rib.element(p[1]);
+                    rib.element(p[2]);
+                }
+            }
+            next();
+        }
+        return curvehandler::end_array();
+    }
+
+    RibWriter& rib;
+    const vector<bool>& keep;
+    const curvelod* lod;
+    // Bound of the control points
+    Bound bound;
+};
+
+// What level of detail removed from a curve set
+struct lodstats
+{
+    uint64_t strands = 0, strandsRemoved = 0;
+    uint64_t cvs = 0, cvsRemoved = 0;
+};
+static mutex lodLock;
+static map<string, lodstats> lodStats;
+
+// Decide which curves of a curve file to keep, leaving out those
+// culled by cull and, with level of detail, those thinned out because
+// they are too thin to see. Finds the number of points of each curve
+// after level of detail, and how much each thinned curve is widened
+// to make up for those removed around it
+struct curveplan : curvehandler
+{
+    curveplan(
+        const std::string& filename,
+        float pad,
+        const cullplaces* cull,
+        const curvelod* lod,
+        vector<int>& sizes,
+        vector<bool>& keep,
+        vector<float>& widthScale)
+        : curvehandler(filename),
+          pad(pad),
+          cull(cull),
+          lod(lod),
+          sizes(sizes),
+          keep(keep),
+          widthScale(widthScale)
+    {
+    }
+
+    bool end_array()
+    {
+        if (depth == 2)
+        {
+            // End of a curve
+            if (keep[curve]) plan();
+            next();
+        }
+        return curvehandler::end_array();
+    }
+
+    void plan()
+    {
+        Bound box;
+        for (int i = 0; i < points; ++i)
+        {
+            box.extend(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+        }
+        if (cull)
+        {
+            Bound padded = box;
+            padded.pad(pad);
+            if (!cull->visible(padded))
+            {
+                keep[curve] = false;
+                cullStats.curvesCulled++;
+                return;
+            }
+        }
+        if (!lod) return;
+
+        stats.strands++;
+        stats.cvs += points;
+        if (lod->thin)
+        {
+            // A curve covering a fraction p of the pixel error is kept
+            // with probability p, and widened by 1/p
+            float p = 2 * pad * lod->pixels(box) / lod->error;
+            if (p < 1)
+            {
+                uint64_t h = hashBytes(&curve, sizeof(curve), lod->hash);
+                if ((h >> 40) * (1.0f / (1 << 24)) >= p)
+                {
+                    keep[curve] = false;
+                    stats.strandsRemoved++;
+                    stats.cvsRemoved += points;
+                    return;
+                }
+                widthScale[curve] = 1 / p;
+                widest = max(widest, 1 / p);
+            }
+        }
+        lod->simplify(values);
+        sizes[curve] = int(values.size() / 3);
+        stats.cvsRemoved += points - sizes[curve];
+    }
+
+    float pad;
+    const cullplaces* cull;
+    const curvelod* lod;
+    vector<int>& sizes;
+    vector<bool>& keep;
+    vector<float>& widthScale;
+    // The largest width scale
+    float widest = 1;
+    lodstats stats;
+};
+
+// Write a normal facing the eye for every CV written by curvepoints,
+// taking the direction of a curve at each CV across its neighbours
+struct curvenormals : curvehandler
+{
+    curvenormals(
+        const std::string& filename,
+        RibWriter& rib,
+        const vector<bool>& keep,
+        const curvelod* lod,
+        const Float3& eye)
+        : curvehandler(filename), rib(rib), keep(keep), lod(lod), eye(eye), block(new cvblock())
+    {
+    }
+
+    bool end_array()
+    {
+        if (depth == 2)
+        {
+            // End of a curve
+            if (keep[curve])
+            {
+                if (lod) lod->simplify(values);
+                add();
+            }
+            next();
+        }
+        return curvehandler::end_array();
+    }
+
+    // Add the CVs of a curve, including the repeated end points
+    void add()
+    {
+        int n = int(values.size() / 3);
+        for (int k = -2; k < n + 2; ++k)
+        {
+            int i = min(max(k, 0), n - 1);
+            const float* p = &values[3 * i];
+            const float* a = &values[3 * max(i - 1, 0)];
+            const float* b = &values[3 * min(i + 1, n - 1)];
+            if (block->n == cvblock::capacity) flush();
+            size_t j = block->n++;
+            block->px[j] = p[0];
+            block->py[j] = p[1];
+            block->pz[j] = p[2];
+            block->tx[j] = b[0] - a[0];
+            block->ty[j] = b[1] - a[1];
+            block->tz[j] = b[2] - a[2];
+        }
+    }
+
+    // Write the normals of the CVs in the block
+    void flush()
+    {
+        facingNormals(*block, eye);
+        for (size_t i = 0; i < block->n; ++i)
+        {
+            rib.element(block->nx[i]);
+            rib.element(block->ny[i]);
+            rib.element(block->nz[i]);
+        }
+        block->n = 0;
+    }
+
+    RibWriter& rib;
+    const vector<bool>& keep;
+    const curvelod* lod;
+    Float3 eye;
+    unique_ptr<cvblock> block;
+};
+
+// Write the Curves request for a curve file, leaving out the curves
+// culled by cull, if given, with level of detail from lod, if given,
+// and with normals facing eye, if given, and return its bound. A
+// b-spline lies within the hull of its control points, so the curves
+// lie within half their widest width of the points
+static Bound curves(
+    RibWriter& rib,
+    const string& curveFilename,
+    float widthRoot,
+    float widthTip,
+    const cullplaces* cull = nullptr,
+    const Float3* eye = nullptr,
+    const curvelod* lod = nullptr)
+{
+    phasescope phase(phaseCurves);
+    vector<int> sizes = curveSizes(curveFilename);
+    float pad = 0.5f * max(widthRoot, widthTip);
+    vector<bool> keep(sizes.size());
+    for (size_t i = 0; i < sizes.size(); ++i) keep[i] = sizes[i] > 0;
+    vector<float> widthScale;
+    if (lod && lod->thin) widthScale.assign(sizes.size(), 1);
+    if (cull || lod)
+    {
+        // An extra pass to decide which curves are kept, and their
+        // size after level of detail
+        jsonfile file(curveFilename);
+        curveplan plan(curveFilename, pad, cull, lod, sizes, keep, widthScale);
+        file.parse(plan);
+        pad *= plan.widest;
+        if (cull) cullStats.curves += sizes.size();
+        if (lod)
+        {
+            lock_guard<mutex> lock(lodLock);
+            lodstats& l = lodStats[curveFilename];
+            l.strands += plan.stats.strands;
+            l.strandsRemoved += plan.stats.strandsRemoved;
+            l.cvs += plan.stats.cvs;
+            l.cvsRemoved += plan.stats.cvsRemoved;
+        }
+        if (find(keep.begin(), keep.end(), true) == keep.end()) return Bound();
+    }
+
+    rib.request("Curves");
+    rib.token("cubic");
+    rib.beginIntArray();
+    size_t nvertices = 0, nvarying = 0;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        if (!keep[i]) continue;
+        size_t size = sizes[i];
+        rib.element(int(size + 4));
+        nvertices += size + 4;
+        nvarying += size + 2;
+        addStat(statCurveCVs, size);
+    }
+    rib.endArray();
+    rib.token("nonperiodic");
+    rib.token("P");
+    rib.beginFloatArray(3 * nvertices);
+    Bound bound;
+    {
+        jsonfile file(curveFilename);
+        curvepoints points(curveFilename, rib, keep, lod);
+        file.parse(points);
+        bound = points.bound;
+    }
+    bound.pad(pad);
+    rib.endArray();
+    rib.token("varying float width");
+    rib.beginFloatArray(nvarying);
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        if (!keep[i]) continue;
+        size_t size = sizes[i];
+        float root = widthRoot, tip = widthTip;
+        if (!widthScale.empty())
+        {
+            root *= widthScale[i];
+            tip *= widthScale[i];
+        }
+        rib.element(root);
+        for (int k = 0; k < (int)size - 1; ++k)
+        {
+            float a = (float)k / (size - 1);
+            rib.element(root + a * (tip - root));
+        }
+        rib.element(tip);
+        rib.element(tip);
+    }
+    rib.endArray();
+    if (eye)
+    {
+        rib.token("vertex normal N");
+        rib.beginFloatArray(3 * nvertices);
+        jsonfile file(curveFilename);
+        curvenormals normals(curveFilename, rib, keep, lod, *eye);
+        file.parse(normals);
+        normals.flush();
+        rib.endArray();
+    }
+    return bound;
+}
+
+static void reportLod()
+{
+    if (options.lodCamera.empty()) return;
+    for (auto& l : lodStats)
+    {
+        cerr << l.first << ": removed " << l.second.cvsRemoved << " of " << l.second.cvs
+             << " CVs and " << l.second.strandsRemoved << " of " << l.second.strands
+             << " strands" << endl;
+    }
+}
+
+// Base handler for archive instance files, which map master names to
+// objects mapping instance names to matrices. Given the bound of each
+// master, keep() finds the bound of each instance, culls it if cull
+// is given, and accumulates the bound of the instances kept
+struct instancefilter : jsonfloats
+{
+    instancefilter(
+        const std::string& filename,
+        const unordered_map<std::string, Bound>* masters = nullptr,
+        const cullplaces* cull = nullptr)
+        : jsonfloats(filename, 3), masters(masters), cull(cull)
+    {
+    }
+
+    bool key(std::string& k)
+    {
+        if (depth == 1)
+        {
+            master = k;
+            known = false;
+            if (masters)
+            {
+                auto m = masters->find(k);
+                if (m != masters->end())
+                {
+                    known = true;
+                    masterBound = m->second;
+                }
+            }
+        }
+        else if (depth == 2)
+        {
+            instance = k;
+        }
+        return true;
+    }
+
+    // Whether to keep the instance whose matrix has just been read.
+    // Instances of unknown masters are always kept
+    bool keep()
+    {
+        values.resize(16);
+        if (!known) return true;
+        Bound b = masterBound.transformed(values.data());
+        if (cull && !cull->visible(b)) return false;
+        bound.extend(b);
+        return true;
+    }
+
+    // Count an instance, and whether it was culled
+    void count(bool kept)
+    {
+        if (kept) this->kept++;
+        if (!cull) return;
+        cullStats.instances++;
+        if (!kept) cullStats.instancesCulled++;
+    }
+
+    const unordered_map<std::string, Bound>* masters;
+    const cullplaces* cull;
+    std::string master, instance;
+    Bound masterBound;
+    bool known = false;
+    Bound bound;
+    // Number of instances kept
+    uint64_t kept = 0;
+};
+
+// Write an instance of a master for every matrix in an archive
+// instance file which is kept
+struct archiveinstances : instancefilter
+{
+    archiveinstances(
+        const std::string& filename,
+        RibWriter& rib,
+        const unordered_map<std::string, Bound>* masters,
+        const cullplaces* cull)
+        : instancefilter(filename, masters, cull), rib(rib)
+    {
+    }
+
+    bool end_array()
+    {
+        if (depth == 3)
+        {
+            bool kept = keep();
+            count(kept);
+            if (kept)
+            {
+                rib.indent();
+                rib.request("AttributeBegin");
+                rib.newline();
+                rib.indent(2);
+                rib.request("Attribute");
+                rib.token("identifier");
+                rib.token("string name");
+                rib.str(instance);
+                rib.newline();
+                rib.indent(2);
+                outputTransform(rib, values);
+                rib.indent(2);
+                rib.request("ObjectInstance");
+                rib.str(master);
+                rib.newline();
+                rib.indent();
+                rib.request("AttributeEnd");
+                rib.newline();
+            }
+            values.clear();
+        }
+        return instancefilter::end_array();
+    }
+
+    RibWriter& rib;
+};
+
+// Write the instances of an archive instance file which are kept to
+// an instance cache, with the archive defining each master
+struct cacheinstances : instancefilter
+{
+    cacheinstances(
+        const std::string& filename,
+        instancecache::writer& cache,
+        const unordered_map<std::string, std::string>& archives,
+        const unordered_map<std::string, Bound>* masters,
+        const cullplaces* cull)
+        : instancefilter(filename, masters, cull), cache(cache), archives(archives)
+    {
+    }
+
+    bool key(std::string& k)
+    {
+        if (depth == 1)
+        {
+            auto a = archives.find(k);
+            if (a == archives.end())
+            {
+                cerr << filename << ": no archive for " << k << endl;
+            }
+            cache.beginMaster(k, a == archives.end() ? std::string() : a->second);
+        }
+        return instancefilter::key(k);
+    }
+
+    bool end_array()
+    {
+        if (depth == 3)
+        {
+            bool kept = keep();
+            count(kept);
+            if (kept) cache.instance(instance, values.data());
+            values.clear();
+        }
+        return instancefilter::end_array();
+    }
+
+    instancecache::writer& cache;
+    const unordered_map<std::string, std::string>& archives;
+};
+
+// Bound of the instances in an archive instance file which are kept
+struct instancebounds : instancefilter
+{
+    using instancefilter::instancefilter;
+
+    bool end_array()
+    {
+        if (depth == 3)
+        {
+            keep();
+            values.clear();
+        }
+        return instancefilter::end_array();
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Create the instances listed in an archive instance JSON file, and
+// return their bound if the bounds of the masters are given
+static Bound archiveInstances(
+    RibWriter& rib,
+    const string& archiveFilename,
+    const unordered_map<string, Bound>* masters,
+    const cullplaces* cull)
+{
+    phasescope phase(phaseInstances);
+    rib.indent();
+    rib.comment("begin instances ");
+
+    jsonfile file(archiveFilename);
+    archiveinstances instances(archiveFilename, rib, masters, cull);
+    file.parse(instances);
+    addStat(statInstances, instances.kept);
+
+    rib.indent();
+    rib.comment("end instances ");
+    return instances.bound;
+}
+
+// Write the instances of an archive instance JSON file to an instance
+// cache under rib/, unless this process has written it already
+static string instanceCache(
+    const string& elementName,
+    const string& jsonFilename,
+    const unordered_map<string, materialdef>& materials,
+    const unordered_map<string, string>& archives,
+    const unordered_map<string, Bound>* masters,
+    const cullplaces* cull,
+    bool& written)
+{
+    string ofilename = sideFile(elementName, jsonFilename, materials, cull, ".inst");
+    addOutput(ofilename);
+    written = claim(ofilename);
+    if (!written) return ofilename;
+
+    boost::filesystem::create_directories(boost::filesystem::path(ofilename).parent_path());
+    string temp = ofilename + ".tmp" + to_string(getpid());
+    instancecache::writer cache;
+    bool ok = cache.open(temp);
+    if (ok)
+    {
+        phasescope phase(phaseInstances);
+        jsonfile file(jsonFilename);
+        cacheinstances instances(jsonFilename, cache, archives, masters, cull);
+        file.parse(instances);
+        addStat(statInstances, instances.kept);
+        ok = cache.close();
+        filestate written;
+        if (ok && statFile(temp, written)) addStat(statBytesWritten, written.size);
+    }
+    if (ok && options.incremental)
+        ok = replaceIfChanged(temp, ofilename);
+    else if (ok)
+        ok = rename(temp.c_str(), ofilename.c_str()) == 0;
+    if (!ok)
+    {
+        cerr << "Unable to write " << ofilename << endl;
+        unlink(temp.c_str());
+        written = false;
+    }
+    return ofilename;
+}
+
+// Convert the archives of an instanced primitive, and reference its
+// instance cache through the mis2rib_instancer procedural, which
+// defines the masters itself. Returns the bound of the instances
+static Bound cachedArchive(
+    RibWriter& rib,
+    const string& elementName,
+    const string& primName,
+    const json& j,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull)
+{
+    rib.indent();
+    rib.comment("begin instance archive " + primName);
+    const json& names = j["archives"];
+    unordered_map<string, string> archives;
+    vector<Bound> bounds(names.size());
+    TaskGroup tasks(threadPool());
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        string s = names[i];
+        uint64_t hash;
+        bool claimed;
+        string ofilename = archiveFile(elementName, s, materials, nullptr, hash, claimed);
+        archives[s] = ofilename;
+        tasks.run([&, i, s, ofilename, hash, claimed] {
+            bounds[i] = claimed
+                ? convertArchive(
+                      elementName, s, ofilename, hash, materials, nullptr, nullptr, rib.binary())
+                : archiveBound(elementName, s, ofilename, materials, nullptr);
+        });
+    }
+    // Culling the instances needs the bounds of the masters, so it
+    // has to wait for them to be converted
+    bool written;
+    string jsonFilename = j.at("jsonFile");
+    string cache;
+    unordered_map<string, Bound> masters;
+    if (!cull)
+    {
+        cache = instanceCache(
+            elementName, jsonFilename, materials, archives, nullptr, nullptr, written);
+    }
+    tasks.wait();
+    for (size_t i = 0; i < names.size(); ++i) masters[names[i]] = bounds[i];
+    if (cull)
+    {
+        cache = instanceCache(
+            elementName, jsonFilename, materials, archives, &masters, cull, written);
+    }
+
+    // The bound of the instances, from the cache if this process wrote
+    // it and otherwise from the JSON file
+    Bound bound;
+    instancecache::reader reader;
+    if (written && reader.open(cache))
+    {
+        for (uint32_t i = 0; i < reader.masterCount(); ++i)
+        {
+            const instancecache::master& m = reader.masters()[i];
+            auto master = masters.find(reader.string(m.name));
+            if (master == masters.end()) continue;
+            for (uint64_t k = m.first; k < m.first + m.count; ++k)
+            {
+                bound.extend(master->second.transformed(reader.matrix(k)));
+            }
+        }
+        publishBound(cache, bound);
+    }
+    else if (!publishedBound(cache, bound))
+    {
+        jsonfile file(jsonFilename);
+        instancebounds instances(jsonFilename, &masters, cull);
+        file.parse(instances);
+        bound = instances.bound;
+    }
+
+    const char* args[] = {"mis2rib_instancer", cache.c_str()};
+    rib.indent();
+    rib.request("Procedural");
+    rib.token("DynamicLoad");
+    rib.tokens(args, 2);
+    outputBound(rib, bound);
+    rib.newline();
+
+    rib.indent();
+    rib.comment("end instance archive " + j["jsonFile"].dump());
+    return bound;
+}
+
+// Define the masters of an instanced primitive and create its
+// instances, culling them if cull is given. Returns the bound of the
+// instances, which is only known when culling
+static Bound instancedArchive(
+    RibWriter& rib,
+    const string& elementName,
+    const string& primName,
+    const json& j,
+    const unordered_map<string, materialdef>& materials,
+    const cullplaces* cull)
+{
+    if (options.instanceCache)
+    {
+        return cachedArchive(rib, elementName, primName, j, materials, cull);
+    }
+
+    // Define the masters first. Each archive is converted to its own
+    // side file, so they can all be converted at once, along with the
+    // instances unless they are culled, which needs the bounds of the
+    // masters
+    rib.indent();
+    rib.comment("begin instance archive " + primName);
+    const json& archives = j["archives"];
+    vector<string> masters(archives.size());
+    vector<Bound> bounds(archives.size());
+    string instances;
+    TaskGroup tasks(threadPool());
+    for (size_t i = 0; i < archives.size(); ++i)
+    {
+        string s = archives[i];
+        runBuffered(tasks, rib.binary(), &masters[i], [&, i, s](RibWriter& rib) {
+            rib.indent();
+            rib.request("ObjectBegin");
+            rib.str(s);
+            rib.newline();
+            rib.indent();
+            bounds[i] = objFile(rib, elementName, s, materials, true);
+            rib.indent();
+            rib.request("ObjectEnd");
+            rib.newline();
+        });
+    }
+    if (!cull)
+    {
+        runBuffered(tasks, rib.binary(), &instances, [&](RibWriter& rib) {
+            archiveInstances(rib, j.at("jsonFile"), nullptr, nullptr);
+        });
+    }
+    tasks.wait();
+    for (auto& m : masters) rib.append(m);
+    Bound bound;
+    if (cull)
+    {
+        unordered_map<string, Bound> masterBounds;
+        for (size_t i = 0; i < archives.size(); ++i) masterBounds[archives[i]] = bounds[i];
+        bound = archiveInstances(rib, j.at("jsonFile"), &masterBounds, cull);
+    }
+    else
+    {
+        rib.append(instances);
+    }
+
+    rib.indent();
+    rib.comment("end instance archive " + j["jsonFile"].dump());
+    return bound;
+}
+static Bound instancedCurves(
+    RibWriter& rib,
+    const string& elementName,
+    const string& primName,
+    const json& j,
+    const unordered_map<string, materialdef>& materials,
+    const unordered_map<string, string>& assignments,
+    const cullplaces* cull,
+    const Float3* eye,
+    const curvelod* lod)
+{
+    float widthTip = j.at("widthTip");
+    float widthRoot = j.at("widthRoot");
+
+    // Create the curves
+    string curveFilename = j.at("jsonFile");
+
+    rib.newline();
+    rib.comment("begin curves " + primName);
+
+    rib.request("AttributeBegin");
+    rib.newline();
+
+    // We must look up the material assignment that was stored in the
+    // material JSON
+    auto assignment = assignments.find(primName);
+    if (assignment != assignments.end())
+    {
+        auto mat = materials.find(assignment->second);
+        if (mat != materials.end())
+        {
+            if (mat->second.text.find('%') != string::npos)
+            {
+                // There shouldn't be any ptx bindings found on curves
+                // prims
+                std::cerr << "Warning: illegal ptx binding found for curves material "
+                          << assignment->second << endl;
+            }
+            writeMaterial(rib, mat->second, mat->first + ".ptx");
+        }
+    }
+
+    // The curves data is actually b-spline cubic. In order to
+    // interpolate the end points we must replicate them each three
+    // times
+    rib.indent();
+    rib.request("Basis");
+    rib.token("b-spline");
+    rib.integer(1);
+    rib.token("b-spline");
+    rib.integer(1);
+    rib.newline();
+    rib.indent();
+    Bound bound;
+    if (options.delayed)
+    {
+        // The curves go in an archive of their own, which is only
+        // read once a ray reaches their bound, and which depends on
+        // the eye the normals face and the level of detail
+        string extension = ".rib";
+        if (lod) extension = "." + hex(lod->hash) + extension;
+        if (eye) extension = "." + hex(hashBytes(eye, sizeof(Float3))) + extension;
+        string ofilename = sideFile(elementName, curveFilename, materials, cull, extension);
+        if (claim(ofilename))
+        {
+            boost::filesystem::create_directories(
+                boost::filesystem::path(ofilename).parent_path());
+            {
+                ribstream ribostr(ofilename);
+                RibWriter archive(ribostr.stream(), rib.binary());
+                bound = curves(archive, curveFilename, widthRoot, widthTip, cull, eye, lod);
+                archive.newline();
+                archive.flush();
+                if (!ribostr.commit()) throw runtime_error("Unable to write " + ofilename);
+            }
+            publishBound(ofilename, bound);
+        }
+        else
+        {
+            addOutput(ofilename);
+            if (!publishedBound(ofilename, bound))
+            {
+                nullstream null;
+                RibWriter counter(null, rib.binary());
+                bound = curves(counter, curveFilename, widthRoot, widthTip, cull, eye, lod);
+            }
+        }
+        const char* args[] = {ofilename.c_str()};
+        rib.request("Procedural");
+        rib.token("DelayedReadArchive");
+        rib.tokens(args, 1);
+        outputBound(rib, bound);
+    }
+    else
+    {
+        bound = curves(rib, curveFilename, widthRoot, widthTip, cull, eye, lod);
+    }
+    rib.newline();
+    rib.request("AttributeEnd");
+    rib.newline();
+    rib.comment("end curves " + curveFilename);
+    return bound;
+}
+
+// Returns the bound of the primitives, which is only known when
+// culling. Curves get normals facing eye and level of detail lod, if
+// given
+static Bound instancedPrimitives(
+    RibWriter& rib,
+    const string& elementName,
+    const json& j,
+    const unordered_map<string, materialdef>& materials,
+    const unordered_map<string, string>& assignments,
+    const cullplaces* cull,
+    const Float3* eye,
+    const curvelod* lod)
+{
+    rib.newline();
+    rib.indent();
+    rib.comment("begin instancedPrimitiveJsonFiles ");
+
+    // Every curve set and archive is independent, so convert them in
+    // parallel and output the results in their original order
+    vector<string> parts(j.size());
+    vector<Bound> bounds(j.size());
+    TaskGroup tasks(threadPool());
+    size_t n = 0;
+    for (auto i = j.begin(); i != j.end(); ++i, ++n)
+    {
+        string primName = i.key();
+        const json& k = i.value();
+        if (k.find("type") != k.end())
+        {
+            if (k["type"] == "curve")
+            {
+                runBuffered(tasks, rib.binary(), &parts[n], [&, n, primName](RibWriter& rib) {
+                    bounds[n] = instancedCurves(
+                        rib, elementName, primName, k, materials, assignments, cull, eye, lod);
+                });
+            }
+            else if (k["type"] == "archive")
+            {
+                runBuffered(tasks, rib.binary(), &parts[n], [&, n, primName](RibWriter& rib) {
+                    bounds[n] = instancedArchive(rib, elementName, primName, k, materials, cull);
+                });
+            }
+            else if (k["type"] == "element")
+            {
+                cerr << "HAS ELEMENT" << endl;
+            }
+        }
+    }
+    tasks.wait();
+    for (auto& p : parts) rib.append(p);
+    rib.indent();
+    rib.comment("end instancedPrimitiveJsonFiles ");
+    Bound bound;
+    for (auto& b : bounds) bound.extend(b);
+    return bound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Standard lookat calculation: the camera at eye looks down z, with y
+// up
+static void lookat(const json& j, Float3& x, Float3& y, Float3& z, Float3& eye)
+{
+    Float3 up(j["up"][0], j["up"][1], j["up"][2]);
+    Float3 look(j["look"][0], j["look"][1], j["look"][2]);
+    eye = Float3(j["eye"][0], j["eye"][1], j["eye"][2]);
+    z = Float3(look.x - eye.x, look.y - eye.y, look.z - eye.z);
+    x = cross(up, z);
+    y = cross(z, x);
+    normalize(x);
+    normalize(y);
+    normalize(z);
+}
+
+static void camera(RibWriter& rib, const json& j)
+{
+    float fov = j["fov"].get<float>();
+    rib.request("Projection");
+    rib.token("perspective");
+    rib.token("fov");
+    rib.floats(&fov, 1);
+    rib.newline();
+    std::vector<float> sw = j["screenwindow"];
+    rib.request("ScreenWindow");
+    rib.real(sw[0]);
+    rib.real(sw[1]);
+    rib.real(sw[2]);
+    rib.real(sw[3]);
+    rib.newline();
+
+    // RenderMan and Hyperion apparently disagree on the direction of
+    // the X axis
+    rib.request("Scale");
+    rib.real(-1);
+    rib.real(1);
+    rib.real(1);
+    rib.newline();
+
+    Float3 x, y, z, eye;
+    lookat(j, x, y, z, eye);
+    float m[16] = {x.x, y.x, z.x, 0, x.y, y.y, z.y, 0, x.z, y.z, z.z, 0,
+                   -dot(x, eye), -dot(y, eye), -dot(z, eye), 1};
+    rib.request("ConcatTransform");
+    rib.floats(m, 16);
+    rib.newline();
+}
+
+// The frustum of the --cull-camera camera, or null if there isn't one,
+// using the same view as camera()
+static const frustum* cullFrustum()
 {
-    ostr << " \"float " << name << "\" [" << f << "]";
+    static const unique_ptr<frustum> view = []() {
+        unique_ptr<frustum> f;
+        if (options.cullCamera.empty()) return f;
+        ifstream i(options.cullCamera.c_str());
+        json j;
+        i >> j;
+        Float3 x, y, z, eye;
+        lookat(j, x, y, z, eye);
+        // Camera space has x flipped; a point is visible if its screen
+        // coordinates x/(z tan(fov/2)), y/(z tan(fov/2)) lie within
+        // the screen window
+        float t = tanf(0.5f * j["fov"].get<float>() * float(M_PI) / 180);
+        vector<float> sw = j["screenwindow"];
+        const float camera[5][3] = {
+            {1, 0, -sw[0] * t}, {-1, 0, sw[1] * t}, {0, 1, -sw[2] * t}, {0, -1, sw[3] * t},
+            {0, 0, 1}};
+        f.reset(new frustum);
+        for (int k = 0; k < 5; ++k)
+        {
+            const float* c = camera[k];
+            Float3 n(
+                -c[0] * x.x + c[1] * y.x + c[2] * z.x,
+                -c[0] * x.y + c[1] * y.y + c[2] * z.y,
+                -c[0] * x.z + c[1] * y.z + c[2] * z.z);
+            normalize(n);
+            f->planes[k][0] = n.x;
+            f->planes[k][1] = n.y;
+            f->planes[k][2] = n.z;
+            f->planes[k][3] = -dot(n, eye);
+        }
+        f->margin = options.cullMargin;
+        return f;
+    }();
+    return view.get();
 }
 
-static void outputTransform(ostream& ostr, const vector<float>& matrix)
+// The matrix placing an element or a copy, which is the identity for
+// the buggy transforms in the data set
+static vector<float> placement(const json& j)
 {
-    ostr << "ConcatTransform [" << matrix[0] << ' ' << matrix[1] << ' ' << matrix[2] << ' '
-         << matrix[3] << ' ' << matrix[4] << ' ' << matrix[5] << ' ' << matrix[6] << ' '
-         << matrix[7] << ' ' << matrix[8] << ' ' << matrix[9] << ' ' << matrix[10] << ' '
-         << matrix[11] << ' ' << matrix[12] << ' ' << matrix[13] << ' ' << matrix[14] << ' '
-         << matrix[15] << "]" << endl;
+    auto m = j.find("transformMatrix");
+    if (m == j.end() || m->is_null())
+    {
+        return {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    }
+    return *m;
 }
 
-static string material(
-    const string& elementName,
-    const string& name,
-    const json& j,
-    unordered_map<string, string>& assignments)
+// The places the contents of an element appear: the element itself,
+// and those of its copies which are true instances
+static vector<vector<float>> elementPlaces(const json& j)
 {
-    ostringstream ostr;
+    vector<vector<float>> matrices = {placement(j)};
+    if (j.find("instancedCopies") != j.end())
+    {
+        for (auto& copy : j["instancedCopies"])
+        {
+            if (copy.find("geomObjFile") == copy.end()) matrices.push_back(placement(copy));
+        }
+    }
+    return matrices;
+}
 
-    // Check for displacement and color map
-    if (j.find("displacementMap") != j.end() && j["displacementMap"] != "")
+static uint64_t cullHash(const cullplaces& places)
+{
+    uint64_t h = hashBytes(&places.view->margin, sizeof(float));
+    h = hashBytes(places.view->planes, sizeof(places.view->planes), h);
+    for (auto& m : places.matrices) h = hashBytes(m.data(), m.size() * sizeof(float), h);
+    return h;
+}
+
+// Find the point p which the matrix m places at q, by solving
+// (p 1) m = w (q 1) by Gaussian elimination. Returns false if m is
+// singular or p lies at infinity
+static bool unplace(const vector<float>& m, const Float3& q, Float3& p)
+{
+    double a[4][5];
+    const double rhs[4] = {q.x, q.y, q.z, 1};
+    for (int r = 0; r < 4; ++r)
     {
-        string displacementMap = j.at("displacementMap");
-        ostr << "    Pattern \"PxrPtexture\" \"" << name
-             << "DisplacementMap\" \"string filename\" \"" << displacementMap << "%\"" << endl;
-        ostr << "    Displace \"PxrDisplace\" \"" << name << "\"";
-        ostr << " \"reference float dispScalar\" [\"" << name << "DisplacementMap:resultR\"]"
-             << endl;
+        for (int c = 0; c < 4; ++c) a[r][c] = m[c * 4 + r];
+        a[r][4] = rhs[r];
+    }
+    for (int c = 0; c < 4; ++c)
+    {
+        int pivot = c;
+        for (int r = c + 1; r < 4; ++r)
+        {
+            if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+        }
+        if (fabs(a[pivot][c]) < 1e-12) return false;
+        swap(a[c], a[pivot]);
+        for (int r = 0; r < 4; ++r)
+        {
+            if (r == c) continue;
+            double f = a[r][c] / a[c][c];
+            for (int k = c; k < 5; ++k) a[r][k] -= f * a[c][k];
+        }
     }
+    double x[4];
+    for (int r = 0; r < 4; ++r) x[r] = a[r][4] / a[r][r];
+    if (fabs(x[3]) < 1e-12) return false;
+    p = Float3(float(x[0] / x[3]), float(x[1] / x[3]), float(x[2] / x[3]));
+    return true;
+}
 
-    bool ptxColor = false;
-    if (j.find("colorMap") != j.end() && j["colorMap"] != "")
+// The eye of the --facing-camera camera in the space of an element
+// placed by the matrix m, for the normals of its curves. Returns
+// false if there is no such camera or the matrix can't be inverted
+static bool facingEye(const vector<float>& m, Float3& eye)
+{
+    static const unique_ptr<Float3> world = []() {
+        unique_ptr<Float3> eye;
+        if (options.facingCamera.empty()) return eye;
+        ifstream i(options.facingCamera.c_str());
+        json j;
+        i >> j;
+        eye.reset(new Float3(j["eye"][0], j["eye"][1], j["eye"][2]));
+        return eye;
+    }();
+    if (!world) return false;
+    addInput(options.facingCamera);
+    if (!unplace(m, *world, eye))
     {
-        string colorMap = j.at("colorMap");
-        if (!colorMap.empty() && colorMap[colorMap.length() - 1] != '/')
+        cerr << "Warning: no camera facing normals for a singular transform" << endl;
+        return false;
+    }
+    return true;
+}
+
+// The level of detail of curves seen from the --lod-camera camera at
+// the places given, or false if there is no such camera
+static bool curveLod(const vector<vector<float>>& matrices, curvelod& lod)
+{
+    static const unique_ptr<curvelod> view = []() {
+        unique_ptr<curvelod> lod;
+        if (options.lodCamera.empty()) return lod;
+        ifstream i(options.lodCamera.c_str());
+        json j;
+        i >> j;
+        // The screen window spans the width of the image, and a unit
+        // length at distance d spans 1/(d tan(fov/2)) of the window
+        float t = tanf(0.5f * j["fov"].get<float>() * float(M_PI) / 180);
+        vector<float> sw = j["screenwindow"];
+        lod.reset(new curvelod);
+        lod->eye = Float3(j["eye"][0], j["eye"][1], j["eye"][2]);
+        lod->pixelsPerUnit = options.lodResolution / ((sw[1] - sw[0]) * t);
+        lod->error = options.lodError;
+        lod->thin = options.lodThin;
+        return lod;
+    }();
+    if (!view) return false;
+    addInput(options.lodCamera);
+    lod = *view;
+    lod.matrices = matrices;
+    lod.hash = hashBytes(&lod.eye, sizeof(Float3));
+    lod.hash = hashBytes(&lod.pixelsPerUnit, sizeof(float), lod.hash);
+    lod.hash = hashBytes(&lod.error, sizeof(float), lod.hash);
+    lod.hash = hashBytes(&lod.thin, sizeof(bool), lod.hash);
+    for (auto& m : matrices) lod.hash = hashBytes(m.data(), m.size() * sizeof(float), lod.hash);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void light(RibWriter& rib, const std::string& name, const json& j)
+{
+    std::string type = j["type"];
+    if (type == "dome")
+    {
+        rib.request("AttributeBegin");
+        rib.newline();
+        rib.indent();
+        outputTransform(rib, j["translationMatrix"]);
+
+        // Due to a difference in latlong coordinate systems
+        // the following rotations appear to be required
+        rib.indent();
+        rib.request("Rotate");
+        rib.real(90);
+        rib.real(0);
+        rib.real(1);
+        rib.real(0);
+        rib.newline();
+        rib.indent();
+        rib.request("Rotate");
+        rib.real(-90);
+        rib.real(1);
+        rib.real(0);
+        rib.real(0);
+        rib.newline();
+        rib.indent();
+        rib.request("Light");
+        rib.token("PxrDomeLight");
+        rib.str(name);
+        floatParam(rib, "exposure", j["exposure"]);
+        if (j.find("map") != j.end())
         {
-            colorMap += "/";
+            std::string mapfile = j["map"].get<string>();
+            size_t pos = mapfile.find("exr", 0);
+            if (pos != string::npos) mapfile.replace(pos, 3, "tx");
+            pos = mapfile.find("island/", 0);
+            if (pos != string::npos) mapfile.replace(pos, 7, "");
+            const char* mapfiles[] = {mapfile.c_str()};
+            rib.token("string lightColorMap");
+            rib.tokens(mapfiles, 1);
+
+            // I'm not sure if the colorMap is already gamma corrected
+            // ostr << " \"color colorMapGamma\" [2.2 2.2 2.2]";
         }
-        // Encode a special token % which will be substituted by the
-        // object name when we parse the obj file
-        ostr << "    Pattern \"PxrPtexture\" \"" << name << "ColorMap\" \"string filename\" \""
-             << colorMap << "%\"";
-        // Convert to linear color space
-        ostr << " \"int linearize\" [1]";
-        ostr << endl;
-        ptxColor = true;
+        rib.newline();
+        rib.request("AttributeEnd");
+        rib.newline();
     }
+    else if (type == "quad")
+    {
+        static const int off[] = {0};
+        rib.request("AttributeBegin");
+        rib.newline();
+        rib.indent();
+        rib.request("Attribute");
+        rib.token("visibility");
+        rib.token("int camera");
+        rib.ints(off, 1);
+        rib.token("int indirect");
+        rib.ints(off, 1);
+        rib.newline();
+        rib.indent();
+        outputTransform(rib, j["translationMatrix"]);
+        // Hyperion light sources apparently are aimed in the +Z direction
+        rib.indent();
+        rib.request("Scale");
+        rib.real(j["width"].get<float>());
+        rib.real(j["height"].get<float>());
+        rib.real(-1);
+        rib.newline();
+        rib.indent();
+        rib.request("Light");
+        rib.token("PxrRectLight");
+        rib.str(name);
+        floatParam(rib, "exposure", j["exposure"]);
+        vector<float> lightColor = j["color"];
 
-    ostr << "    Bxdf \"PxrSurface\" \"" << name << "\"";
+        // There's no gamma for non-texture mapped color, so we need
+        // to correct here
+        float color[3] = {float(pow(lightColor[0], 2.2)), float(pow(lightColor[1], 2.2)),
+                          float(pow(lightColor[2], 2.2))};
+        rib.token("color lightColor");
+        rib.floats(color, 3);
+        rib.newline();
+        rib.request("AttributeEnd");
+        rib.newline();
+    }
+}
 
+static void lights(RibWriter& rib, const json& j)
+{
     for (auto i = j.begin(); i != j.end(); ++i)
     {
-        if (i.key() == "colorMap" || i.key() == "displacementMap")
+        light(rib, i.key(), i.value());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void element(RibWriter& rib, const json& j)
+{
+    try
+    {
+        string elementName = j.at("name");
+
+        // Define the materials. With --shared-materials, the shared
+        // part of each is written here, outside of the object
+        unordered_map<string, materialdef> materials;
+        unordered_map<string, string> assignments;
+        string matFilename = j.at("matFile");
+        addInput(matFilename);
+        json matFileJSON;
         {
-            // Handled above
+            phasescope phase(phaseJson);
+            addRead(matFilename);
+            ifstream matFile(matFilename.c_str());
+            matFile >> matFileJSON;
         }
-        else if (i.key() == "assignment")
         {
-            // Unlike what the README implies, we do still need keep
-            // track of assignments in order to correctly assign
-            // materials to curves. We don't need to do this for the
-            // OBJ files, but at this point we don't know whether the
-            // material will be used on those.
-            const vector<string>& s = i.value();
-            for (auto k = s.begin(); k != s.end(); ++k)
-            {
-                assignments[*k] = name;
-            }
+            phasescope phase(phaseMaterials);
+            materialFile(elementName, matFilename, matFileJSON, materials, assignments);
+            defineMaterials(rib, materials);
         }
-        else if (i.key() == "type")
+
+        rib.request("ObjectBegin");
+        rib.str(elementName);
+        rib.newline();
+        rib.indent();
+        rib.request("Attribute");
+        rib.token("identifier");
+        rib.token("string object");
+        rib.str(elementName);
+        rib.newline();
+
+        // With --cull-camera, everything in the element is culled
+        // against each place it appears: the element itself, and
+        // those of its copies which are true instances
+        const frustum* view = cullFrustum();
+        cullplaces places;
+        const cullplaces* cull = nullptr;
+        if (view)
         {
-            // Need to do something here!
+            addInput(options.cullCamera);
+            places.view = view;
+            places.matrices = elementPlaces(j);
+            places.hash = cullHash(places);
+            cull = &places;
         }
-        else if (i.key() == "baseColor")
+
+        // With --facing-camera, curve normals face the camera where
+        // the element itself is placed
+        Float3 eye;
+        const Float3* facing = facingEye(placement(j), eye) ? &eye : nullptr;
+
+        // With --lod-camera, curves are simplified for the places the
+        // element appears closest to the camera
+        curvelod lod;
+        const curvelod* detail = curveLod(elementPlaces(j), lod) ? &lod : nullptr;
+
+        // Load the element excluding instances
+        string filename = j.at("geomObjFile");
+        Bound bound = objFile(rib, elementName, filename, materials, false, cull);
+
+        // Load instances
+        if (j.find("instancedPrimitiveJsonFiles") != j.end())
         {
-            if (ptxColor)
-            {
-                ostr << " \"reference color diffuseColor\" [\"" << name << "ColorMap:resultRGB\"]";
-            }
-            else
+            bound.extend(instancedPrimitives(
+                rib,
+                elementName,
+                j["instancedPrimitiveJsonFiles"],
+                materials,
+                assignments,
+                cull,
+                facing,
+                detail));
+        }
+
+        rib.request("ObjectEnd");
+        rib.newline();
+        rib.request("AttributeBegin");
+        rib.newline();
+        if (j.find("transformMatrix") != j.end())
+        {
+            rib.indent();
+            rib.request("Attribute");
+            rib.token("identifier");
+            rib.token("string name");
+            rib.str(elementName);
+            rib.newline();
+            // There's some buggy transforms in the data set..
+            if (!j["transformMatrix"].is_null())
             {
-                ostr << " \"color diffuseColor\" [" << i.value()[0] << ' ' << i.value()[1] << ' '
-                     << i.value()[2] << "]";
+                rib.indent();
+                outputTransform(rib, j["transformMatrix"]);
             }
         }
-        else if (i.key() == "diffTrans")
+        rib.indent();
+        rib.request("ObjectInstance");
+        rib.str(elementName);
+        rib.newline();
+        rib.request("AttributeEnd");
+        rib.newline();
+
+        if (j.find("instancedCopies") != j.end())
         {
-            // An attempt to map diffuse trans to PxrSurface's diffuse
-            // transmit behavior
-            float diffTrans = i.value();
-            if (diffTrans > 0)
+            const json& instances = j["instancedCopies"];
+            for (auto k = instances.begin(); k != instances.end(); ++k)
             {
-                ostr << " \"int diffuseDoubleSided\" [1]";
-                floatParam(ostr, "diffuseGain", 0.5f * (2 - diffTrans));
-                floatParam(ostr, "diffuseTransmitGain", 0.5f * diffTrans);
-                if (ptxColor)
+                const std::string& instanceName = k.key();
+                const json& instance = k.value();
+
+                // A copy which is a true instance is left out entirely
+                // if none of the element is visible there
+                cullplaces copyPlaces;
+                if (view)
                 {
-                    ostr << " \"reference color diffuseTransmitColor\" [\"" << name
-                         << "ColorMap:resultRGB\"]";
+                    copyPlaces.view = view;
+                    copyPlaces.matrices.push_back(placement(instance));
+                    copyPlaces.hash = cullHash(copyPlaces);
+                    if (instance.find("geomObjFile") == instance.end())
+                    {
+                        cullStats.copies++;
+                        if (!copyPlaces.visible(bound))
+                        {
+                            cullStats.copiesCulled++;
+                            continue;
+                        }
+                    }
                 }
-                else if (j.find("baseColor") != j.end())
+                const cullplaces* copyCull = view ? &copyPlaces : nullptr;
+
+                rib.request("AttributeBegin");
+                rib.newline();
+
+                // There's some buggy transforms in the data set..
+                auto transform = instance.find("transformMatrix");
+                if (transform != instance.end() && !transform->is_null())
                 {
-                    ostr << " \"color diffuseTransmitColor\" [" << j["baseColor"][0] << ' '
-                         << j["baseColor"][1] << ' ' << j["baseColor"][2] << "]";
+                    rib.indent();
+                    outputTransform(rib, *transform);
                 }
-            }
-        }
-        else if (i.key() == "flatness")
-        {
-            // An attempt to turn flatness into some real subsurface
-            float subsurfaceGain = i.value();
-            if (subsurfaceGain != 0.0f)
-            {
-                floatParam(ostr, "subsurfaceGain", subsurfaceGain);
-                if (ptxColor)
+
+                // Some "instancedCopies" aren't actually instances;
+                // they are actually full geometry representations in
+                // their own right. The coral appears to work this way.
+                if (instance.find("geomObjFile") != instance.end())
                 {
-                    ostr << " \"reference color subsurfaceColor\" [\"" << name
-                         << "ColorMap:resultRGB\"]";
+                    string filename = instance.at("geomObjFile");
+                    objFile(rib, elementName, filename, materials, false, copyCull);
+
+                    // Load instances
+                    if (instance.find("instancedPrimitiveJsonFiles") != instance.end())
+                    {
+                        Float3 copyEye;
+                        bool copyFacing = facingEye(placement(instance), copyEye);
+                        curvelod copyLod;
+                        bool copyCurves = curveLod({placement(instance)}, copyLod);
+                        instancedPrimitives(
+                            rib,
+                            elementName,
+                            instance.at("instancedPrimitiveJsonFiles"),
+                            materials,
+                            assignments,
+                            copyCull,
+                            copyFacing ? &copyEye : nullptr,
+                            copyCurves ? &copyLod : nullptr);
+                    }
                 }
-                else if (j.find("baseColor") != j.end())
+                // Here we have a more reasonable "true" object
+                // instance
+                else
                 {
-                    ostr << " \"color subsurfaceColor\" [" << j["baseColor"][0] << ' '
-                         << j["baseColor"][1] << ' ' << j["baseColor"][2] << "]";
+                    rib.indent();
+                    rib.request("Attribute");
+                    rib.token("identifier");
+                    rib.token("string name");
+                    rib.str(instanceName);
+                    rib.newline();
+                    rib.indent();
+                    rib.request("ObjectInstance");
+                    rib.str(elementName);
+                    rib.newline();
                 }
+                rib.request("AttributeEnd");
+                rib.newline();
             }
         }
-        else if (i.key() == "roughness")
-        {
-            // Disney BXDF roughness affects specular and diffuse
-            // roughness lobes
-            floatParam(ostr, "specularRoughness", i.value());
-            floatParam(ostr, "diffuseRoughness", i.value());
-        }
-        else if (i.key() == "ior")
+    }
+    catch (json::out_of_range& e)
+    {
+        cerr << e.what() << endl;
+    }
+}
+
+// Convert one camera, lights or element JSON file
+static void convert(RibWriter& rib, const string& type, const string& filename)
+{
+    addInput(filename);
+    json j;
+    {
+        phasescope phase(phaseJson);
+        addRead(filename);
+        ifstream i(filename.c_str());
+        i >> j;
+    }
+    if (type == "camera")
+    {
+        camera(rib, j);
+    }
+    else if (type == "lights")
+    {
+        lights(rib, j);
+    }
+    else
+    {
+        element(rib, j);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scene
+////////////////////////////////////////////////////////////////////////////////
+
+static uintmax_t fileSize(const string& filename)
+{
+    boost::system::error_code ec;
+    uintmax_t size = boost::filesystem::file_size(filename, ec);
+    return ec ? 0 : size;
+}
+
+// Rough estimate of the amount of work needed to convert an element:
+// the total size of every file it refers to
+static uintmax_t elementSize(const json& j)
+{
+    uintmax_t size = 0;
+    if (j.find("geomObjFile") != j.end() && j["geomObjFile"].is_string())
+    {
+        size += fileSize(j["geomObjFile"]);
+    }
+    if (j.find("instancedPrimitiveJsonFiles") != j.end())
+    {
+        const json& prims = j["instancedPrimitiveJsonFiles"];
+        for (auto i = prims.begin(); i != prims.end(); ++i)
         {
-            ostr << " \"color specularIor\" [" << i.value() << ' ' << i.value() << ' ' << i.value()
-                 << "]";
+            const json& k = i.value();
+            if (k.find("jsonFile") != k.end()) size += fileSize(k["jsonFile"]);
+            if (k.find("archives") != k.end())
+            {
+                for (auto& a : k["archives"]) size += fileSize(a);
+            }
         }
-        else if (i.key() == "sheen")
+    }
+    if (j.find("instancedCopies") != j.end())
+    {
+        const json& copies = j["instancedCopies"];
+        for (auto i = copies.begin(); i != copies.end(); ++i)
         {
-            // Map Disney BXDF sheen to PxrSurface fuzz
-            floatParam(ostr, "fuzzGain", i.value());
+            if (i.value().find("geomObjFile") != i.value().end()) size += elementSize(i.value());
         }
-        else if (i.key() == "sheenTint")
+    }
+    return size;
+}
+
+struct sceneunit
+{
+    string type;
+    string input;
+    string output;
+    uintmax_t size;
+};
+
+// The record of earlier conversions kept by --incremental, which for
+// each unit lists the content hash of every file read and the size
+// and modification time of every file written. A unit is up to date
+// if it was converted by the same converter with the same options,
+// its inputs still have the same contents, and its outputs haven't
+// been touched since. Inputs are only hashed again if their size or
+// modification time has changed.
+class manifest
+{
+public:
+    explicit manifest(const string& filename) : m_filename(filename)
+    {
+        ifstream file(filename.c_str());
+        if (!file) return;
+        try
         {
-            float sheenTint = i.value();
-            if (sheenTint != 0.0f && j.find("baseColor") != j.end())
+            json j;
+            file >> j;
+            for (auto& i : j.at("files").items())
             {
-                if (sheenTint == 1.0f)
+                filestate& f = m_files[i.key()];
+                f.size = i.value().at(0);
+                f.mtime = i.value().at(1);
+                f.hash = strtoull(i.value().at(2).get<string>().c_str(), 0, 16);
+            }
+            for (auto& i : j.at("units").items())
+            {
+                const json& k = i.value();
+                unitrecord& u = m_units[i.key()];
+                u.converter = k.at("converter");
+                u.options = k.at("options");
+                u.seconds = k.at("seconds");
+                for (auto& f : k.at("inputs").items())
                 {
-                    if (ptxColor)
-                    {
-                        ostr << " \"reference color fuzzColor\" [\"" << name
-                             << "ColorMap:resultRGB\"]";
-                    }
-                    else if (j.find("baseColor") != j.end())
-                    {
-                        ostr << " \"color fuzzColor\" [" << j["baseColor"][0] << ' '
-                             << j["baseColor"][1] << ' ' << j["baseColor"][2] << "]";
-                    }
+                    u.inputs[f.key()] = strtoull(f.value().get<string>().c_str(), 0, 16);
                 }
-                else
+                for (auto& f : k.at("outputs").items())
                 {
-                    if (ptxColor)
-                    {
-                        // This is a situation we can't currently handle,
-                        // so just punt and use the ptx color fully
-                        ostr << " \"reference color fuzzColor\" [\"" << name
-                             << "ColorMap:resultRGB\"]";
-                    }
-                    else
-                    {
-                        std::vector<float> fuzzColor = j["baseColor"];
-                        fuzzColor[0] = (1.0f - sheenTint) + sheenTint * fuzzColor[0];
-                        fuzzColor[1] = (1.0f - sheenTint) + sheenTint * fuzzColor[1];
-                        fuzzColor[2] = (1.0f - sheenTint) + sheenTint * fuzzColor[2];
-                        ostr << " \"color fuzzColor\" [" << fuzzColor[0] << ' ' << fuzzColor[1]
-                             << ' ' << fuzzColor[2] << "]";
-                    }
+                    filestate& s = u.outputs[f.key()];
+                    s.size = f.value().at(0);
+                    s.mtime = f.value().at(1);
                 }
             }
         }
-        else if (i.key() == "alpha")
+        catch (json::exception& e)
         {
-            // No material sets this to value other than 1, so let's
-            // just ignore it
+            cerr << "Ignoring unreadable " << filename << ": " << e.what() << endl;
+            m_files.clear();
+            m_units.clear();
         }
-        else if (i.key() == "specTrans" || i.key() == "scatterDistance")
+    }
+
+    // Returns whether the unit writing output is up to date, and the
+    // time it took to convert if so
+    bool upToDate(const string& output, double& seconds)
+    {
+        auto u = m_units.find(output);
+        if (u == m_units.end()) return false;
+        const unitrecord& r = u->second;
+        if (r.converter != converterVersion() || r.options != optionsSignature()) return false;
+        for (auto& i : r.inputs)
         {
-            // Not handled yet!
+            filestate s = input(i.first);
+            if (s.size < 0 || s.hash != i.second) return false;
         }
-        else if (i.key() == "refractive")
+        for (auto& o : r.outputs)
         {
-            // Attempt to turn on PxrSurface glass settings
-            floatParam(ostr, "refractionGain", i.value());
-            floatParam(ostr, "reflectionGain", i.value());
-            floatParam(ostr, "diffuseGain", 0.0f);
-            if (j.find("ior") != j.end())
-            {
-                floatParam(ostr, "glassIor", j["ior"]);
-            }
-            if (j.find("roughness") != j.end())
+            filestate s;
+            if (!statFile(o.first, s) || s.size != o.second.size || s.mtime != o.second.mtime)
             {
-                floatParam(ostr, "glassRoughness", j["roughness"]);
+                return false;
             }
         }
-        else if (i.key() == "specularTint")
+        seconds = r.seconds;
+        return true;
+    }
+
+    // Record a successful conversion
+    void record(const string& output, dependencies& d, double seconds)
+    {
+        unitrecord r;
+        r.converter = converterVersion();
+        r.options = optionsSignature();
+        r.seconds = seconds;
+        for (auto& i : d.inputs)
         {
-            // The Disney BXDF is somewhere in between the artistic
-            // and physical controls of PxrSurface. In particular, the
-            // specularTint would be somewhat equivalent to setting
-            // the artistic controls specularFaceColor and
-            // specularEdgeColor to be a mix between white and the
-            // baseColor, whereas the ior is a physical control.  For
-            // now I'm just going to rely on the physical controls.
-            // So while I'm outputting the artistic control values, I
-            // haven't actually toggled on specularFresnelMode.
-            float specularTint = i.value();
-            if (specularTint != 0.0f && j.find("baseColor") != j.end())
+            r.inputs[i] = input(i).hash;
+        }
+        for (auto& o : d.outputs)
+        {
+            statFile(o, r.outputs[o]);
+        }
+        lock_guard<mutex> lock(m_lock);
+        m_units[output] = r;
+    }
+
+    // Forget a unit whose conversion failed
+    void forget(const string& output)
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_units.erase(output);
+    }
+
+    void save()
+    {
+        json j;
+        j["files"] = json::object();
+        j["units"] = json::object();
+        for (auto& f : m_files)
+        {
+            j["files"][f.first] = {f.second.size, f.second.mtime, hex(f.second.hash)};
+        }
+        for (auto& u : m_units)
+        {
+            json& k = j["units"][u.first];
+            k["converter"] = u.second.converter;
+            k["options"] = u.second.options;
+            k["seconds"] = u.second.seconds;
+            k["inputs"] = json::object();
+            k["outputs"] = json::object();
+            for (auto& i : u.second.inputs) k["inputs"][i.first] = hex(i.second);
+            for (auto& o : u.second.outputs)
+                k["outputs"][o.first] = {o.second.size, o.second.mtime};
+        }
+        string temp = m_filename + ".tmp";
+        {
+            ofstream file(temp.c_str());
+            file << j.dump(1) << endl;
+        }
+        if (rename(temp.c_str(), m_filename.c_str()) != 0)
+        {
+            cerr << "Unable to write " << m_filename << endl;
+        }
+    }
+
+private:
+    struct unitrecord
+    {
+        string converter;
+        string options;
+        double seconds = 0;
+        map<string, uint64_t> inputs;
+        map<string, filestate> outputs;
+    };
+
+    // The current state of an input file, checked once per run
+    filestate input(const string& filename)
+    {
+        filestate known;
+        {
+            lock_guard<mutex> lock(m_lock);
+            auto f = m_files.find(filename);
+            if (f != m_files.end())
             {
-                std::vector<float> specularColor = j["baseColor"];
-                specularColor[0] = (1.0f - specularTint) + specularTint * specularColor[0];
-                specularColor[1] = (1.0f - specularTint) + specularTint * specularColor[1];
-                specularColor[2] = (1.0f - specularTint) + specularTint * specularColor[2];
-                ostr << " \"color specularFaceColor\" [" << specularColor[0] << ' '
-                     << specularColor[1] << ' ' << specularColor[2] << "]";
-                ostr << " \"color specularEdgeColor\" [" << specularColor[0] << ' '
-                     << specularColor[1] << ' ' << specularColor[2] << "]";
+                if (m_checked.count(filename)) return f->second;
+                known = f->second;
             }
         }
-        else if (i.key() == "metallic")
+        filestate s;
+        if (statFile(filename, s))
         {
-            // Not even sure how to handle this
+            if (s.size == known.size && s.mtime == known.mtime)
+                s.hash = known.hash;
+            else
+                s.hash = hashFile(filename);
         }
-        else if (i.key() == "clearcoat" || i.key() == "clearcoatGloss")
+        lock_guard<mutex> lock(m_lock);
+        m_files[filename] = s;
+        m_checked.insert(filename);
+        return s;
+    }
+
+    string m_filename;
+    mutex m_lock;
+    map<string, filestate> m_files;
+    map<string, unitrecord> m_units;
+    set<string> m_checked;
+};
+
+
+// Convert every camera, light and element of the island found under
+// root into the same rib/ layout that mis2rib.sh used to produce one
+// process at a time. Each file is converted by a task on a thread
+// pool, largest first so that the big elements don't end up running
+// alone at the end. OBJ files shared between elements are converted
+// only once (see claimArchive), and the output doesn't depend on the
+// number of threads.
+static int scene(const string& root)
+{
+    double start = seconds();
+    boost::filesystem::current_path(root);
+    boost::filesystem::create_directories("rib");
+
+    vector<sceneunit> units;
+    for (boost::filesystem::directory_iterator d("json"), end; d != end; ++d)
+    {
+        if (!boost::filesystem::is_directory(d->path())) continue;
+        string dir = d->path().filename().string();
+        if (dir == "cameras" || dir == "lights")
         {
-            // Should try to map this to the secondary rough specular
-            // lobe, maybe?
+            for (boost::filesystem::directory_iterator f(d->path()); f != end; ++f)
+            {
+                if (f->path().extension() != ".json") continue;
+                sceneunit u;
+                u.type = dir == "cameras" ? "camera" : "lights";
+                u.input = f->path().string();
+                u.output = "rib/" + f->path().stem().string() + ".rib";
+                u.size = fileSize(u.input);
+                units.push_back(u);
+            }
         }
-        else if (i.key() == "anisotropic")
+        else
         {
-            float anisotropic = i.value();
-            if (anisotropic != 0.0f)
+            sceneunit u;
+            u.type = "element";
+            u.input = "json/" + dir + "/" + dir + ".json";
+            u.output = "rib/" + dir + ".rib";
+            if (!boost::filesystem::exists(u.input))
             {
-                floatParam(ostr, i.key(), i.value());
+                cerr << "Warning: no element file " << u.input << endl;
+                continue;
             }
+            ifstream i(u.input.c_str());
+            json j;
+            i >> j;
+            u.size = fileSize(u.input) + elementSize(j);
+            units.push_back(u);
         }
-        else
+    }
+    stable_sort(units.begin(), units.end(), [](const sceneunit& a, const sceneunit& b) {
+        return a.size > b.size || (a.size == b.size && a.output < b.output);
+    });
+
+    // Skip the units which are up to date
+    unique_ptr<manifest> built;
+    int reused = 0;
+    double saved = 0;
+    if (options.incremental)
+    {
+        built.reset(new manifest("rib/mis2rib.manifest"));
+        vector<sceneunit> stale;
+        for (auto& u : units)
         {
-            cerr << "Warning: unknown material key " << i.key() << endl;
+            double t;
+            if (built->upToDate(u.output, t))
+            {
+                reused++;
+                saved += t;
+            }
+            else
+            {
+                stale.push_back(u);
+            }
         }
+        units.swap(stale);
     }
-    return ostr.str();
-}
 
-static void materialFile(
-    const string& elementName,
-    const string& filename,
-    const json& j,
-    unordered_map<string, string>& materials,
-    unordered_map<string, string>& assignments)
-{
-    for (auto i = j.begin(); i != j.end(); ++i)
+    ThreadPool& pool = threadPool();
+    cerr << "converting " << units.size() << " files on " << pool.size() << " threads" << endl;
+    atomic<int> failures(0);
+    mutex logLock;
+    {
+        TaskGroup tasks(pool);
+        for (auto& u : units)
+        {
+            const sceneunit* unit = &u;
+            manifest* m = built.get();
+            tasks.run([unit, m, &failures, &logLock]() {
+                double start = seconds();
+                dependencies d;
+                statsscope stats(
+                    unit->type == "element" ? statsUnit(elementStats, unit->input) : nullptr, true);
+                compresstotals compressed;
+                compressscope compress(&compressed);
+                try
+                {
+                    dependencyscope scope(m ? &d : nullptr);
+                    ribstream out(unit->output);
+                    RibWriter rib(out.stream(), options.binary);
+                    convert(rib, unit->type, unit->input);
+                    rib.flush();
+                    if (!out.commit()) throw runtime_error("Unable to write " + unit->output);
+                }
+                catch (exception& e)
+                {
+                    if (m) m->forget(unit->output);
+                    lock_guard<mutex> lock(logLock);
+                    cerr << unit->input << ": " << e.what() << endl;
+                    failures++;
+                    return;
+                }
+                double elapsed = seconds() - start;
+                if (m) m->record(unit->output, d, elapsed);
+                lock_guard<mutex> lock(logLock);
+                cerr << ".. " << unit->output << " (" << elapsed << " s)" << endl;
+                if (unit->type == "element") reportCompression(unit->input, compressed);
+            });
+        }
+        tasks.wait();
+    }
+    if (built)
     {
-        materials[i.key()] = material(elementName, i.key(), i.value(), assignments);
+        built->save();
+        cerr << "rebuilt " << units.size() - failures << " and reused " << reused
+             << " files, saving about " << saved << " s; " << outputsUnchanged
+             << " outputs were unchanged" << endl;
     }
+    cerr << "converted " << archivesConverted << " OBJ files, shared " << archivesShared
+         << " conversions" << endl;
+    reportDedup();
+    reportCull();
+    reportLod();
+    reportDecimation();
+    reportObjCache();
+    reportCompression(root);
+    cerr << "peak memory " << peakMemory() << " MB" << endl;
+    writeStats(seconds() - start);
+    return failures == 0 ? 0 : 1;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Synthetic data
 ////////////////////////////////////////////////////////////////////////////////
 
-static void instancedArchive(
-    ostream& ostr,
-    const string& elementName,
-    const string& primName,
-    const json& j,
-    const unordered_map<string, string>& materials)
+// "mis2rib generate dir" writes a small island of synthetic elements
+// with files shaped like those of the data set, so that the converter
+// can be timed without downloading it. Each element has an OBJ file of
+// quad grids, archives of triangle leaves instanced by an archive
+// instance file, a curve file of grass blades and a material file, and
+// the generated data is the same every time
+struct synthparams
+{
+    int elements = 2;
+    // Groups and faces per group of the OBJ file of each element; the
+    // archives have a tenth as many of each
+    int groups = 50;
+    int faces = 2000;
+    int archives = 4;
+    // Archive instances and curves per element
+    int instances = 50000;
+    int curves = 50000;
+};
+
+// Buffered text output of generated files
+class synthfile
 {
-    // Define the masters first
-    ostr << "    #begin instance archive " << primName << endl;
-    auto archives = j["archives"];
-    for (auto i = archives.begin(); i != archives.end(); ++i)
+public:
+    synthfile(const string& filename) : m_filename(filename)
+    {
+        boost::filesystem::create_directories(boost::filesystem::path(filename).parent_path());
+        m_file.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!m_file) cerr << "Unable to write " << filename << endl;
+    }
+    ~synthfile()
+    {
+        flush();
+        m_file.close();
+        if (!m_file) cerr << "Unable to write " << m_filename << endl;
+    }
+
+    synthfile& operator<<(const char* s) { return append(s, s + strlen(s)); }
+    synthfile& operator<<(const string& s) { return append(s.data(), s.data() + s.size()); }
+    synthfile& operator<<(long i)
+    {
+        char buf[32];
+        return append(buf, to_chars(buf, buf + sizeof(buf), i).ptr);
+    }
+    synthfile& operator<<(float f)
+    {
+        char buf[32];
+        return append(buf, to_chars(buf, buf + sizeof(buf), f).ptr);
+    }
+
+private:
+    synthfile& append(const char* begin, const char* end)
+    {
+        m_buffer.append(begin, end);
+        if (m_buffer.size() >= (1 << 20)) flush();
+        return *this;
+    }
+
+    void flush()
     {
-        string s = *i;
-        ostr << "    ObjectBegin \"" << s << "\"" << endl;
-        ostr << "    ";
-        objFile(ostr, elementName, *i, materials, true);
-        ostr << "    ObjectEnd" << endl;
+        m_file.write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
     }
 
-    // Create the instances
-    string archiveFilename = j.at("jsonFile");
-    ifstream archiveFile(archiveFilename.c_str());
-    json archiveFileJSON;
-    archiveFile >> archiveFileJSON;
+    string m_filename;
+    ofstream m_file;
+    string m_buffer;
+};
 
-    ostr << "    #begin instances " << endl;
+struct synthrandom
+{
+    uint32_t seed;
+    synthrandom(uint32_t seed) : seed(seed) {}
+    // Uniform in [0, 1)
+    float operator()()
+    {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) * (1.0f / (1 << 24));
+    }
+    float range(float a, float b) { return a + (b - a) * (*this)(); }
+};
 
-    for (auto i = archiveFileJSON.begin(); i != archiveFileJSON.end(); ++i)
+// Write an OBJ file of groups of faces, which are quads on a bumpy
+// grid, or pairs of triangles if triangles is set. As in the data set,
+// each group lists its vertices and then its faces, with a material
+static void synthObj(
+    const string& filename,
+    const string& prefix,
+    int groups,
+    int faces,
+    float size,
+    bool triangles,
+    const vector<string>& materials,
+    synthrandom& random)
+{
+    synthfile f(filename);
+    f << "# generated by mis2rib generate\n";
+    long base = 1;
+    int quads = triangles ? (faces + 1) / 2 : faces;
+    int cols = max(1, int(sqrtf(float(quads))));
+    int rows = (quads + cols - 1) / cols;
+    for (int g = 0; g < groups; ++g)
     {
-        string master = i.key();
-        json instances = i.value();
-        for (auto k = instances.begin(); k != instances.end(); ++k)
+        float x0 = random.range(-size, size), z0 = random.range(-size, size);
+        float y0 = random.range(0, size * 0.1f);
+        float step = size / (4 * cols);
+        for (int r = 0; r <= rows; ++r)
+        {
+            for (int c = 0; c <= cols; ++c)
+            {
+                f << "v " << x0 + c * step << " " << y0 + random.range(0, step) << " "
+                  << z0 + r * step << "\n";
+            }
+        }
+        for (int r = 0; r <= rows; ++r)
+        {
+            for (int c = 0; c <= cols; ++c)
+            {
+                Float3 n(random.range(-0.2f, 0.2f), 1, random.range(-0.2f, 0.2f));
+                normalize(n);
+                f << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+            }
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%04d_geo", prefix.c_str(), g);
+        f << "g " << name << "\n";
+        f << "usemtl " << materials[g % materials.size()] << "\n";
+        int written = 0;
+        for (int q = 0; q < quads && written < faces; ++q)
         {
-            string instance = k.key();
-            ostr << "    AttributeBegin" << endl;
-            ostr << "        Attribute \"identifier\" \"string name\" \"" << instance << "\""
-                 << endl;
-            ostr << "        ";
-            outputTransform(ostr, k.value());
-            ostr << "        ObjectInstance \"" << master << "\"" << endl;
-            ostr << "    AttributeEnd" << endl;
+            long v = base + (q / cols) * (cols + 1) + q % cols;
+            long a = v, b = v + 1, c = v + cols + 2, d = v + cols + 1;
+            if (triangles)
+            {
+                f << "f " << a << "//" << a << " " << b << "//" << b << " " << c << "//" << c
+                  << "\n";
+                if (++written < faces)
+                {
+                    f << "f " << a << "//" << a << " " << c << "//" << c << " " << d << "//" << d
+                      << "\n";
+                    written++;
+                }
+            }
+            else
+            {
+                f << "f " << a << "//" << a << " " << b << "//" << b << " " << c << "//" << c
+                  << " " << d << "//" << d << "\n";
+                written++;
+            }
         }
+        base += long(rows + 1) * (cols + 1);
     }
+}
 
-    ostr << "    #end instances " << endl;
-    ostr << "    #end instance archive " << j["jsonFile"] << endl;
+// A random placement in the element: a rotation about y, a scale and
+// a translation, in the row vector convention of the data set
+static vector<float> synthMatrix(float size, synthrandom& random)
+{
+    float angle = random.range(0, 6.2831853f), scale = random.range(0.5f, 1.5f);
+    float c = cosf(angle) * scale, s = sinf(angle) * scale;
+    return {c, 0, -s, 0, 0, scale, 0, 0, s, 0, c, 0,
+            random.range(-size, size), random.range(0, size * 0.1f), random.range(-size, size), 1};
 }
 
-static void instancedCurves(
-    ostream& ostr,
-    const string& elementName,
-    const string& primName,
-    const json& j,
-    const unordered_map<string, string>& materials,
-    const unordered_map<string, string>& assignments)
+static void synthElement(const string& name, const synthparams& params, synthrandom& random)
 {
-    float widthTip = j.at("widthTip");
-    float widthRoot = j.at("widthRoot");
+    const float size = 1000;
+    string jsonDir = "json/" + name + "/";
+    string objDir = "obj/" + name + "/";
 
-    // Create the curves
-    string curveFilename = j.at("jsonFile");
-    ifstream curveFile(curveFilename.c_str());
-    json curveFileJSON;
-    curveFile >> curveFileJSON;
+    // Materials; the grass material is assigned to the curves, and
+    // the leaf material has a color map and displacement bound
+    // through Ptex
+    json materials;
+    materials["ground"] = {
+        {"baseColor", {0.3, 0.25, 0.2}}, {"roughness", 0.8}, {"assignment", json::array()}};
+    materials["bark"] = {
+        {"baseColor", {0.2, 0.15, 0.1}}, {"roughness", 0.6}, {"ior", 1.5},
+        {"colorMap", "textures/" + name + "/Color"}, {"assignment", json::array()}};
+    materials["leaf"] = {
+        {"baseColor", {0.1, 0.4, 0.1}}, {"roughness", 0.3}, {"diffTrans", 0.4},
+        {"sheen", 0.1}, {"colorMap", "textures/" + name + "/Color"},
+        {"displacementMap", "textures/" + name + "/Displacement"},
+        {"assignment", json::array()}};
+    materials["grass"] = {
+        {"baseColor", {0.2, 0.5, 0.1}}, {"roughness", 0.4}, {"diffTrans", 0.6},
+        {"assignment", {"xgGrass"}}};
+    synthfile(jsonDir + "materials.json") << materials.dump(1) << "\n";
 
-    ostr << endl;
-    ostr << "#begin curves " << primName << endl;
+    synthObj(objDir + name + ".obj", name, params.groups, params.faces, size, false,
+             {"ground", "bark"}, random);
+    vector<string> archives;
+    for (int a = 0; a < params.archives; ++a)
+    {
+        string archive = objDir + "archives/xgLeaf_" + to_string(a) + ".obj";
+        synthObj(archive, "xgLeaf_" + to_string(a), max(1, params.groups / 10),
+                 max(2, params.faces / 10), 2, true, {"leaf", "bark"}, random);
+        archives.push_back(archive);
+    }
 
-    ostr << "AttributeBegin" << endl;
+    // Archive instances, grouped by archive
+    {
+        synthfile f(jsonDir + "xgLeaf_instances.json");
+        f << "{";
+        int first = 0;
+        for (size_t a = 0; a < archives.size(); ++a)
+        {
+            int last = int(params.instances * (a + 1) / archives.size());
+            f << (a ? ", " : "") << "\"" << archives[a] << "\": {";
+            for (int i = first; i < last; ++i)
+            {
+                f << (i > first ? ", " : "") << "\"xgLeaf_" << long(a) << "_" << long(i)
+                  << "\": [";
+                vector<float> m = synthMatrix(size, random);
+                for (int k = 0; k < 16; ++k) f << (k ? ", " : "") << m[k];
+                f << "]";
+            }
+            f << "}";
+            first = last;
+        }
+        f << "}\n";
+    }
 
-    // We must look up the material assignment that was stored in the
-    // material JSON
-    auto assignment = assignments.find(primName);
-    if (assignment != assignments.end())
+    // Blades of grass of 4 to 12 CVs, leaning a little
     {
-        auto mat = materials.find(assignment->second);
-        if (mat != materials.end())
+        synthfile f(jsonDir + "xgGrass_curves.json");
+        f << "[";
+        for (int i = 0; i < params.curves; ++i)
         {
-            string material = mat->second;
-            size_t pos = material.find("%", 0);
-            if (pos != string::npos)
+            float x = random.range(-size, size), z = random.range(-size, size);
+            float dx = random.range(-0.05f, 0.05f), dz = random.range(-0.05f, 0.05f);
+            int cvs = 4 + int(random() * 9);
+            f << (i ? ", " : "") << "[";
+            for (int k = 0; k < cvs; ++k)
             {
-                // There shouldn't be any ptx bindings found on curves
-                // prims
-                std::cerr << "Warning: illegal ptx binding found for curves material "
-                          << assignment->second << endl;
-                string ptxfile = mat->first + ".ptx";
-                material.replace(pos, 1, ptxfile);
+                f << (k ? ", " : "") << "[" << x + dx * k * k << ", " << 0.1f * k << ", "
+                  << z + dz * k * k << "]";
+            }
+            f << "]";
+        }
+        f << "]\n";
+    }
+
+    json element = {
+        {"name", name},
+        {"matFile", jsonDir + "materials.json"},
+        {"geomObjFile", objDir + name + ".obj"},
+        {"transformMatrix", {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}}};
+    element["instancedPrimitiveJsonFiles"] = {
+        {"xgLeaf",
+         {{"type", "archive"},
+          {"jsonFile", jsonDir + "xgLeaf_instances.json"},
+          {"archives", archives}}},
+        {"xgGrass",
+         {{"type", "curve"},
+          {"jsonFile", jsonDir + "xgGrass_curves.json"},
+          {"widthTip", 0.02},
+          {"widthRoot", 0.1}}}};
+    for (int i = 1; i <= 2; ++i)
+    {
+        string copy = name + "_" + to_string(i);
+        element["instancedCopies"][copy] = {
+            {"name", copy}, {"transformMatrix", synthMatrix(4 * size, random)}};
+    }
+    synthfile(jsonDir + name + ".json") << element.dump(1) << "\n";
+}
+
+static int generate(const string& root, const synthparams& params)
+{
+    boost::filesystem::create_directories(root);
+    boost::filesystem::current_path(root);
+    synthrandom random(1);
+    json camera = {
+        {"name", "shotCam"}, {"fov", 45.0}, {"screenwindow", {-2.4, 2.4, -1, 1}},
+        {"up", {0, 1, 0}}, {"eye", {0, 200, -3000}}, {"look", {0, 0, 0}}};
+    synthfile("json/cameras/shotCam.json") << camera.dump(1) << "\n";
+    json lights;
+    lights["sun"] = {
+        {"type", "quad"}, {"width", 100.0}, {"height", 100.0}, {"exposure", 4.0},
+        {"color", {1, 0.95, 0.9}},
+        {"translationMatrix", {1, 0, 0, 0, 0, 0, -1, 0, 0, 1, 0, 0, 0, 5000, 0, 1}}};
+    synthfile("json/lights/lights.json") << lights.dump(1) << "\n";
+    for (int e = 0; e < params.elements; ++e)
+    {
+        synthElement("isSynth" + to_string(e), params, random);
+    }
+    cerr << "generated " << params.elements << " elements in " << root << endl;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+////////////////////////////////////////////////////////////////////////////////
+
+// Time the per group vertex remapping done by parseobj and flushfaces
+// on a synthetic group of quads laid out on a grid, against the
+// std::map based remapping it replaced
+static void benchmarkRemap(int nfaces)
+{
+    const int width = 1000;
+    const int nverts = (nfaces / width + 2) * (width + 1);
+    vector<int> quads;
+    quads.reserve(nfaces * 4);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        int v = (i / width) * (width + 1) + i % width;
+        quads.push_back(v);
+        quads.push_back(v + 1);
+        quads.push_back(v + width + 2);
+        quads.push_back(v + width + 1);
+    }
+    long checksum = 0;
+
+    double start = seconds();
+    {
+        map<int, int> Pmap, Prevmap, Nmap;
+        int n = 0;
+        for (size_t i = 0; i < quads.size(); ++i)
+        {
+            auto j = Pmap.find(quads[i]);
+            int local;
+            if (j == Pmap.end())
+            {
+                Pmap[quads[i]] = n;
+                Prevmap[n] = quads[i];
+                local = n++;
+            }
+            else
+            {
+                local = j->second;
             }
-            ostr << material << endl;
+            Nmap[local] = quads[i];
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            checksum += Prevmap.find(i)->second + Nmap[i];
+        }
+    }
+    double mapTime = seconds() - start;
+
+    start = seconds();
+    {
+        struct objstate s;
+        s.P.resize(nverts);
+        for (size_t i = 0; i < quads.size(); ++i)
+        {
+            int local = vertmap(s, quads[i]);
+            s.Nmap[local] = quads[i];
         }
+        for (int i = 0; i < s.nverts; ++i)
+        {
+            checksum -= s.Prevmap[i] + s.Nmap[i];
+        }
+    }
+    double denseTime = seconds() - start;
+
+    if (checksum != 0)
+    {
+        cerr << "Remap benchmark checksum mismatch" << endl;
     }
+    cout << "remap " << nfaces << " faces" << endl;
+    cout << "    std::map: " << mapTime << " s (" << nfaces / mapTime * 1e-6 << " Mfaces/s)"
+         << endl;
+    cout << "    dense:    " << denseTime << " s (" << nfaces / denseTime * 1e-6 << " Mfaces/s)"
+         << endl;
+    cout << "    speedup:  " << mapTime / denseTime << "x" << endl;
+}
 
-    // The curves data is actually b-spline cubic. In order to
-    // interpolate the end points we must replicate them each three
-    // times
-    ostr << "    Basis \"b-spline\" 1 \"b-spline\" 1" << endl;
-    ostr << "    Curves \"cubic\" [";
-    for (auto i = curveFileJSON.begin(); i != curveFileJSON.end(); ++i)
+// Time converting a curve file by streaming it, and then loading it
+// as a json document as was done before, along with the peak memory
+// after each. Streaming goes first since the peak can only grow
+static void benchmarkCurves(const string& filename)
+{
+    nullstream out;
+    double baseline = peakMemory();
+
+    double start = seconds();
+    {
+        RibWriter rib(out, options.binary);
+        curves(rib, filename, 1, 0);
+    }
+    double streamTime = seconds() - start;
+    double streamMemory = peakMemory();
+
+    start = seconds();
+    size_t ncurves;
     {
-        json curve = i.value();
-        ostr << curve.size() + 4 << ' ';
+        ifstream file(filename.c_str());
+        json j;
+        file >> j;
+        ncurves = j.size();
     }
-    ostr << "] \"nonperiodic\" \"P\" [";
-    for (auto i = curveFileJSON.begin(); i != curveFileJSON.end(); ++i)
+    double documentTime = seconds() - start;
+    double documentMemory = peakMemory();
+
+    cout << "curves " << filename << " (" << ncurves << " curves, " << fileSize(filename) * 1e-6
+         << " MB)" << endl;
+    cout << "    initial:          " << baseline << " MB peak" << endl;
+    cout << "    streamed to RIB:  " << streamTime << " s, " << streamMemory << " MB peak" << endl;
+    cout << "    json document:    " << documentTime << " s, " << documentMemory << " MB peak"
+         << endl;
+}
+
+// Time each camera facing normals kernel this machine can run on one
+// thread, on a block of CVs along synthetic blades of grass, checking
+// that they all agree with the scalar kernel
+static void benchmarkNormals(size_t ncvs)
+{
+    unique_ptr<cvblock> block(new cvblock());
+    block->n = cvblock::capacity;
+    uint32_t seed = 1;
+    auto random = [&seed]() {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) * (1.0f / (1 << 24));
+    };
+    for (size_t i = 0; i < block->n; i += 8)
     {
-        json curve = i.value();
-        auto k = curve.begin();
-        // Repeat the first point twice
-        ostr << (*k)[0].get<float>() << ' ' << (*k)[1].get<float>() << ' ' << (*k)[2].get<float>()
-             << ' ';
-        ostr << (*k)[0].get<float>() << ' ' << (*k)[1].get<float>() << ' ' << (*k)[2].get<float>()
-             << ' ';
-        for (; k != curve.end(); ++k)
+        float x = 2000 * random() - 1000, z = 2000 * random() - 1000;
+        float dx = random() - 0.5f, dz = random() - 0.5f;
+        for (size_t k = i; k < i + 8; ++k)
         {
-            ostr << (*k)[0].get<float>() << ' ' << (*k)[1].get<float>() << ' '
-                 << (*k)[2].get<float>() << ' ';
+            block->px[k] = x + dx * (k - i);
+            block->py[k] = float(k - i);
+            block->pz[k] = z + dz * (k - i);
+            block->tx[k] = dx;
+            block->ty[k] = 1;
+            block->tz[k] = dz;
         }
-        // Repeat the last point twice
-        --k;
-        ostr << (*k)[0].get<float>() << ' ' << (*k)[1].get<float>() << ' ' << (*k)[2].get<float>()
-             << ' ';
-        ostr << (*k)[0].get<float>() << ' ' << (*k)[1].get<float>() << ' ' << (*k)[2].get<float>()
-             << ' ';
     }
-    ostr << "] \"varying float width\" [";
-    for (auto i = curveFileJSON.begin(); i != curveFileJSON.end(); ++i)
+    const Float3 eye(0, 50, -800);
+    size_t iterations = max(ncvs / cvblock::capacity, size_t(1));
+
+    cout << "normals " << iterations * cvblock::capacity << " CVs" << endl;
+    facingNormalsScalar(*block, eye);
+    vector<float> reference(block->nx, block->nx + block->n);
+    reference.insert(reference.end(), block->ny, block->ny + block->n);
+    reference.insert(reference.end(), block->nz, block->nz + block->n);
+    double scalarTime = 0;
+    for (auto& kernel : normalsKernels())
     {
-        json curve = i.value();
-        ostr << widthRoot << ' ';
-        for (int k = 0; k < curve.size() - 1; ++k)
+        double start = seconds();
+        for (size_t i = 0; i < iterations; ++i) kernel.second(*block, eye);
+        double time = seconds() - start;
+        if (kernel.first == "scalar") scalarTime = time;
+
+        float error = 0;
+        for (size_t i = 0; i < block->n; ++i)
         {
-            float a = (float)k / (curve.size() - 1);
-            ostr << widthRoot + a * (widthTip - widthRoot) << ' ';
+            error = max(error, fabsf(block->nx[i] - reference[i]));
+            error = max(error, fabsf(block->ny[i] - reference[block->n + i]));
+            error = max(error, fabsf(block->nz[i] - reference[2 * block->n + i]));
         }
-        ostr << widthTip << ' ';
-        ostr << widthTip << ' ';
+        string name = kernel.first + ":";
+        name.resize(8, ' ');
+        cout << "    " << name << time << " s ("
+             << iterations * cvblock::capacity / time * 1e-6 << " MCVs/s per core, "
+             << scalarTime / time << "x, max error " << error << ")" << endl;
     }
-    ostr << "]" << endl;
-    ostr << "AttributeEnd" << endl;
-    ostr << "#end curves " << curveFilename << endl;
 }
 
-static void instancedPrimitives(
-    ostream& ostr,
-    const string& elementName,
-    const json& j,
-    const unordered_map<string, string>& materials,
-    const unordered_map<string, string>& assignments)
+// Time writing a file of mb MB of RIB to dir through each output sink,
+// in the 1MB pieces RibWriter writes, and check what each wrote. The
+// time includes closing the file, but not the disk catching up with
+// the page cache afterwards
+static int benchmarkSinks(const string& dir, int mb)
 {
-    ostr << endl;
-    ostr << "    #begin instancedPrimitiveJsonFiles " << endl;
-
-    for (auto i = j.begin(); i != j.end(); ++i)
+    ostringstream buffer;
     {
-        string primName = i.key();
-        json k = i.value();
-        if (k.find("type") != k.end())
+        RibWriter rib(buffer, false);
+        uint32_t seed = 1;
+        rib.beginFloatArray(0);
+        while (rib.tell() < (1 << 20))
         {
-            if (k["type"] == "curve")
-            {
-                instancedCurves(ostr, elementName, primName, k, materials, assignments);
-            }
-            else if (k["type"] == "archive")
-            {
-                instancedArchive(ostr, elementName, primName, k, materials);
-            }
-            else if (k["type"] == "element")
-            {
-                cerr << "HAS ELEMENT" << endl;
-            }
+            seed = seed * 1664525 + 1013904223;
+            rib.element((seed >> 8) * (1000.0f / (1 << 24)));
         }
     }
-    ostr << "    #end instancedPrimitiveJsonFiles " << endl;
-}
-
-////////////////////////////////////////////////////////////////////////////////
+    const string piece = buffer.str().substr(0, 1 << 20);
+    const uint64_t size = uint64_t(max(mb, 1)) << 20;
+    const uint64_t expected = hashBytes(piece.data(), piece.size());
 
-static void camera(ostream& ostr, const json& j)
-{
-    ostr << "Projection \"perspective\" \"fov\" [" << j["fov"].get<float>() << "]" << endl;
-    std::vector<float> sw = j["screenwindow"];
-    ostr << "ScreenWindow " << sw[0] << ' ' << sw[1] << ' ' << sw[2] << ' ' << sw[3] << endl;
-
-    Float3 up(j["up"][0], j["up"][1], j["up"][2]);
-    Float3 eye(j["eye"][0], j["eye"][1], j["eye"][2]);
-    Float3 look(j["look"][0], j["look"][1], j["look"][2]);
+    vector<string> sinks = {"posix", "mmap"};
+#ifdef MIS2RIB_WITH_URING
+    sinks.insert(sinks.begin() + 1, "uring");
+#endif
+    cout << "sinks " << size * 1e-6 << " MB to " << dir << endl;
+    string saved = options.outputSink;
+    int status = 0;
+    for (auto& name : sinks)
+    {
+        options.outputSink = name;
+        string filename = dir + "/mis2rib-sink-benchmark." + name;
+        unique_ptr<outputsink> sink = outputSink();
+        double start = seconds();
+        bool ok = sink->open(filename);
+        for (uint64_t n = 0; ok && n < size; n += piece.size())
+        {
+            sink->sputn(piece.data(), piece.size());
+        }
+        ok = sink->close() && ok;
+        double time = seconds() - start;
 
-    // RenderMan and Hyperion apparently disagree on the direction of
-    // the X axis
-    ostr << "Scale -1 1 1" << endl;
+        // Every piece must have come out whole
+        mappedfile check(filename);
+        ok = ok && uint64_t(check.end() - check.begin()) == size;
+        for (const char* p = check.begin(); ok && p < check.end(); p += piece.size())
+        {
+            ok = hashBytes(p, piece.size()) == expected;
+        }
+        unlink(filename.c_str());
 
-    // Standard lookat calculation
-    Float3 z(look.x - eye.x, look.y - eye.y, look.z - eye.z);
-    Float3 x = cross(up, z);
-    Float3 y = cross(z, x);
-    normalize(x);
-    normalize(y);
-    normalize(z);
-    ostr << "ConcatTransform [" << x.x << ' ' << y.x << ' ' << z.x << " 0 " << x.y << ' ' << y.y
-         << ' ' << z.y << " 0 " << x.z << ' ' << y.z << ' ' << z.z << " 0 " << -dot(x, eye) << ' '
-         << -dot(y, eye) << ' ' << -dot(z, eye) << " 1]" << endl;
+        string label = name + ":";
+        label.resize(8, ' ');
+        cout << "    " << label << time << " s (" << size / time * 1e-6 << " MB/s)"
+             << (ok ? "" : " FAILED") << endl;
+        if (!ok) status = 1;
+    }
+    options.outputSink = saved;
+    return status;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-static void light(ostream& ostr, const std::string& name, const json& j)
+// Counts the instances of an archive instance file
+struct instancecounter : jsonhandler
 {
-    std::string type = j["type"];
-    if (type == "dome")
+    instancecounter(const std::string& filename) : jsonhandler(filename) {}
+    bool key(std::string&)
     {
-        ostr << "AttributeBegin" << endl;
-        ostr << "    ";
-        outputTransform(ostr, j["translationMatrix"]);
+        if (depth == 2) count++;
+        return true;
+    }
+    uint64_t count = 0;
+};
 
-        // Due to a difference in latlong coordinate systems
-        // the following rotations appear to be required
-        ostr << "    Rotate 90 0 1 0" << endl;
-        ostr << "    Rotate -90 1 0 0" << endl;
-        ostr << "    Light \"PxrDomeLight\" \"" << name << "\"";
-        floatParam(ostr, "exposure", j["exposure"]);
-        if (j.find("map") != j.end())
-        {
-            std::string mapfile = j["map"].get<string>();
-            size_t pos = mapfile.find("exr", 0);
-            if (pos != string::npos) mapfile.replace(pos, 3, "tx");
-            pos = mapfile.find("island/", 0);
-            if (pos != string::npos) mapfile.replace(pos, 7, "");
-            ostr << " \"string lightColorMap\" [\"" << mapfile << "\"]";
+// The time taken by one stage of conversion, in total and for each
+// file it was run on
+struct stagetime
+{
+    double seconds = 0;
+    uint64_t bytes = 0, primitives = 0;
+    json files = json::array();
 
-            // I'm not sure if the colorMap is already gamma corrected
-            // ostr << " \"color colorMapGamma\" [2.2 2.2 2.2]";
-        }
-        ostr << endl;
-        ostr << "AttributeEnd" << endl;
-    }
-    else if (type == "quad")
+    void add(const string& file, double t, uint64_t b, uint64_t p)
     {
-        ostr << "AttributeBegin" << endl;
-        ostr << "    Attribute \"visibility\" \"int camera\" [0] \"int indirect\" [0]" << endl;
-        ostr << "    ";
-        outputTransform(ostr, j["translationMatrix"]);
-        // Hyperion light sources apparently are aimed in the +Z direction
-        ostr << "    Scale " << j["width"].get<float>() << ' ' << j["height"].get<float>() << " -1"
-             << endl;
-        ostr << "    Light \"PxrRectLight\" \"" << name << "\"";
-        floatParam(ostr, "exposure", j["exposure"]);
-        vector<float> lightColor = j["color"];
+        seconds += t;
+        bytes += b;
+        primitives += p;
+        files.push_back({{"file", file}, {"seconds", t}, {"bytes", b}, {"primitives", p}});
+    }
 
-        // There's no gamma for non-texture mapped color, so we need
-        // to correct here
-        ostr << " \"color lightColor\" [" << pow(lightColor[0], 2.2) << ' '
-             << pow(lightColor[1], 2.2) << ' ' << pow(lightColor[2], 2.2) << "]";
-        ostr << endl;
-        ostr << "AttributeEnd" << endl;
+    json report(const char* unit) const
+    {
+        return {{"seconds", seconds},
+                {"bytes", bytes},
+                {"primitives", primitives},
+                {"unit", unit},
+                {"MB/s", seconds > 0 ? bytes / seconds * 1e-6 : 0.0},
+                {"primitives/s", seconds > 0 ? primitives / seconds : 0.0},
+                {"files", files}};
     }
-}
+};
 
-static void lights(ostream& ostr, const json& j)
+// Time each stage of converting every element of an island, such as
+// one written by "mis2rib generate", and write the results to
+// standard output as JSON. Everything is converted into a scratch
+// directory, so nothing already converted under root is reused or
+// replaced. Whole elements are converted first, on the thread pool,
+// which also converts the archive masters; the other stages then run
+// on one thread:
+//
+//   parseobj          parsing the text of each OBJ file
+//   flushfaces        writing the groups of each OBJ file, from a
+//                     parsed record of it (see replayobj)
+//   material          building the materials of each element
+//   instancedArchive  writing the instances of each archive instance
+//                     file, with the masters already converted
+//   instancedCurves   converting each curve file
+static int benchmarkStages(const string& root)
 {
-    for (auto i = j.begin(); i != j.end(); ++i)
+    string islandroot = boost::filesystem::absolute(root).string();
+    char scratch[] = "/tmp/mis2rib-benchmark-XXXXXX";
+    if (!mkdtemp(scratch))
     {
-        light(ostr, i.key(), i.value());
+        cerr << "Unable to create a scratch directory" << endl;
+        return 1;
     }
-}
+    boost::filesystem::create_directory_symlink(islandroot + "/json", string(scratch) + "/json");
+    boost::filesystem::create_directory_symlink(islandroot + "/obj", string(scratch) + "/obj");
+    boost::filesystem::current_path(scratch);
+    boost::filesystem::create_directories("rib");
 
-////////////////////////////////////////////////////////////////////////////////
+    vector<json> elements;
+    for (boost::filesystem::directory_iterator d("json"), end; d != end; ++d)
+    {
+        string dir = d->path().filename().string();
+        string filename = "json/" + dir + "/" + dir + ".json";
+        if (dir == "cameras" || dir == "lights" || !boost::filesystem::exists(filename)) continue;
+        ifstream i(filename.c_str());
+        json j;
+        i >> j;
+        elements.push_back(j);
+    }
+    sort(elements.begin(), elements.end(), [](const json& a, const json& b) {
+        return a.value("name", "") < b.value("name", "");
+    });
 
-static void element(ostream& ostr, const json& j)
-{
-    try
+    nullstream null;
+    map<string, uint64_t> elementPrimitives;
+    vector<double> elementTimes;
+    for (auto& j : elements)
     {
-        string elementName = j.at("name");
-        ostr << "ObjectBegin \"" << elementName << "\"" << endl;
-        ostr << "    Attribute \"identifier\" \"string object\" \"" << elementName << "\"" << endl;
+        double start = seconds();
+        {
+            RibWriter rib(null, options.binary);
+            element(rib, j);
+        }
+        elementTimes.push_back(seconds() - start);
+    }
 
-        // Define the materials
-        unordered_map<string, string> materials;
+    int splitObj = options.splitObj;
+    options.splitObj = 0;
+    stagetime parse, flush, materials, archives, curveSets;
+    set<string> objs;
+    for (auto& j : elements)
+    {
+        string elementName = j.at("name");
+        unordered_map<string, materialdef> mats;
         unordered_map<string, string> assignments;
         string matFilename = j.at("matFile");
-        ifstream matFile(matFilename.c_str());
         json matFileJSON;
-        matFile >> matFileJSON;
-        materialFile(elementName, matFilename, matFileJSON, materials, assignments);
-
-        // Load the element excluding instances
-        string filename = j.at("geomObjFile");
-        objFile(ostr, elementName, filename, materials, false);
-
-        // Load instances
-        if (j.find("instancedPrimitiveJsonFiles") != j.end())
         {
-            instancedPrimitives(
-                ostr, elementName, j["instancedPrimitiveJsonFiles"], materials, assignments);
+            ifstream matFile(matFilename.c_str());
+            matFile >> matFileJSON;
         }
+        // Materials are quick to build, so they are built repeatedly
+        // for long enough to time
+        int iterations = 0;
+        double start = seconds(), elapsed;
+        do
+        {
+            mats.clear();
+            assignments.clear();
+            materialFile(elementName, matFilename, matFileJSON, mats, assignments);
+            iterations++;
+        } while ((elapsed = seconds() - start) < 0.1);
+        materials.add(
+            matFilename, elapsed, fileSize(matFilename) * iterations, mats.size() * iterations);
 
-        ostr << "ObjectEnd" << endl;
-        ostr << "AttributeBegin" << endl;
-        if (j.find("transformMatrix") != j.end())
+        vector<string> files = {j.at("geomObjFile")};
+        const json& prims = j.value("instancedPrimitiveJsonFiles", json::object());
+        for (auto i = prims.begin(); i != prims.end(); ++i)
         {
-            ostr << "    Attribute \"identifier\" \"string name\" \"" << elementName << "\""
-                 << endl;
-            // There's some buggy transforms in the data set..
-            if (!j["transformMatrix"].is_null())
+            for (auto& a : i.value().value("archives", json::array())) files.push_back(a);
+        }
+        for (auto& file : files)
+        {
+            if (!objs.insert(file).second) continue;
+            objrecord record;
             {
-                ostr << "    ";
-                outputTransform(ostr, j["transformMatrix"]);
+                mappedfile objfile(file);
+                RibWriter rib(null, options.binary);
+                objstate s;
+                s.record = &record;
+                double start = seconds();
+                parseobjlines(s, mats, objfile.begin(), objfile.end(), rib);
+                parse.add(file, seconds() - start, fileSize(file), record.facesize.size());
             }
+            unique_ptr<objcache> cache = openObjCache(file);
+            if (!cache) continue;
+            RibWriter rib(null, options.binary);
+            double start = seconds();
+            replayobj(elementName, mats, *cache, rib);
+            flush.add(file, seconds() - start, fileSize(file), record.facesize.size());
+            elementPrimitives[elementName] += record.facesize.size();
         }
-        ostr << "    ObjectInstance \"" << elementName << "\"" << endl;
-        ostr << "AttributeEnd" << endl;
 
-        if (j.find("instancedCopies") != j.end())
+        for (auto i = prims.begin(); i != prims.end(); ++i)
         {
-            auto instances = j["instancedCopies"];
-            for (auto k = instances.begin(); k != instances.end(); ++k)
+            const json& k = i.value();
+            string file = k.value("jsonFile", "");
+            RibWriter rib(null, options.binary);
+            if (k.value("type", "") == "archive")
             {
-                ostr << "AttributeBegin" << endl;
-                std::string instanceName = k.key();
-                json instance = k.value();
-
-                // There's some buggy transforms in the data set..
-                if (!instance["transformMatrix"].is_null())
-                {
-                    ostr << "    ";
-                    outputTransform(ostr, instance["transformMatrix"]);
-                }
-
-                // Some "instancedCopies" aren't actually instances;
-                // they are actually full geometry representations in
-                // their own right. The coral appears to work this way.
-                if (instance.find("geomObjFile") != instance.end())
-                {
-                    string filename = instance.at("geomObjFile");
-                    objFile(ostr, instanceName, filename, materials, false);
-
-                    // Load instances
-                    if (instance.find("instancedPrimitiveJsonFiles") != instance.end())
-                    {
-                        instancedPrimitives(
-                            ostr,
-                            instanceName,
-                            instance["instancedPrimitiveJsonFiles"],
-                            materials,
-                            assignments);
-                    }
-                }
-                // Here we have a more reasonable "true" object
-                // instance
-                else
-                {
-                    ostr << "    Attribute \"identifier\" \"string name\" \"" << instanceName
-                         << "\"" << endl;
-                    ostr << "    ObjectInstance \"" << elementName << "\"" << endl;
-                }
-                ostr << "AttributeEnd" << endl;
+                instancecounter counter(file);
+                jsonfile(file).parse(counter);
+                double start = seconds();
+                instancedArchive(rib, elementName, i.key(), k, mats, nullptr);
+                archives.add(file, seconds() - start, fileSize(file), counter.count);
+                elementPrimitives[elementName] += counter.count;
+            }
+            else if (k.value("type", "") == "curve")
+            {
+                size_t ncurves = curveSizes(file).size();
+                double start = seconds();
+                instancedCurves(
+                    rib, elementName, i.key(), k, mats, assignments, nullptr, nullptr, nullptr);
+                curveSets.add(file, seconds() - start, fileSize(file), ncurves);
+                elementPrimitives[elementName] += ncurves;
             }
         }
     }
-    catch (json::out_of_range& e)
+    options.splitObj = splitObj;
+
+    // Whole elements count the faces, instances and curves the other
+    // stages found in them
+    stagetime whole;
+    for (size_t i = 0; i < elements.size(); ++i)
     {
-        cerr << e.what() << endl;
+        string name = elements[i].at("name");
+        whole.add(name, elementTimes[i], elementSize(elements[i]), elementPrimitives[name]);
+    }
+
+    json results;
+    results["converter"] = converterVersion();
+    results["options"] = optionsSignature();
+    results["threads"] = threadPool().size();
+    results["stages"] = {
+        {"element", whole.report("faces, instances and curves")},
+        {"parseobj", parse.report("faces")},
+        {"flushfaces", flush.report("faces")},
+        {"material", materials.report("materials")},
+        {"instancedArchive", archives.report("instances")},
+        {"instancedCurves", curveSets.report("curves")}};
+    results["peakMemoryMB"] = peakMemory();
+    cout << results.dump(1) << endl;
+
+    for (auto& stage : results["stages"].items())
+    {
+        const json& s = stage.value();
+        cerr << stage.key() << ": " << s["seconds"].get<double>() << " s, "
+             << s["MB/s"].get<double>() << " MB/s, " << s["primitives/s"].get<double>() << " "
+             << s["unit"].get<string>() << "/s" << endl;
     }
+
+    boost::filesystem::current_path(islandroot);
+    boost::filesystem::remove_all(scratch);
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    if (argc == 3 || argc == 4)
     {
-        cerr << "Usage: " << argv[0] << " (camera|element) filename.json" << endl;
-        exit(1);
+        if (string(argv[1]) == "benchmark" && string(argv[2]) == "remap")
+        {
+            benchmarkRemap(argc == 4 ? atoi(argv[3]) : 4000000);
+            return 0;
+        }
+        if (string(argv[1]) == "benchmark" && string(argv[2]) == "curves" && argc == 4)
+        {
+            benchmarkCurves(argv[3]);
+            return 0;
+        }
+        if (string(argv[1]) == "benchmark" && string(argv[2]) == "normals")
+        {
+            benchmarkNormals(argc == 4 ? atol(argv[3]) : 400000000);
+            return 0;
+        }
+    }
+    if ((argc == 4 || argc == 5) && string(argv[1]) == "benchmark" &&
+        string(argv[2]) == "sinks")
+    {
+        return benchmarkSinks(argv[3], argc == 5 ? atoi(argv[4]) : 2048);
     }
 
-    string type(argv[1]);
-    if (type == "camera")
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi)
     {
-        ifstream i(argv[2]);
-        json j;
-        i >> j;
-        camera(cout, j);
+        string option(argv[argi]);
+        bool hasValue = argi + 1 < argc;
+        if (option == "--binary")
+        {
+            options.binary = true;
+        }
+        else if (option == "--compress" && hasValue)
+        {
+            options.compress = argv[++argi];
+            if (options.compress != "gzip" && options.compress != "zstd")
+            {
+                cerr << "Unknown compression " << options.compress << ", must be gzip or zstd"
+                     << endl;
+                exit(1);
+            }
+#ifndef MIS2RIB_WITH_ZSTD
+            if (options.compress == "zstd")
+            {
+                cerr << "This mis2rib was built without zstd support" << endl;
+                exit(1);
+            }
+#endif
+        }
+        else if (option == "--compress-level" && hasValue)
+        {
+            options.compressLevel = atoi(argv[++argi]);
+        }
+        else if (option == "--compress-threads" && hasValue)
+        {
+            options.compressThreads = atoi(argv[++argi]);
+        }
+        else if (option == "--precision" && hasValue)
+        {
+            // 9 significant digits already read back as the same float
+            options.precision = min(max(atoi(argv[++argi]), 1), 9);
+        }
+        else if (option == "--threads" && hasValue)
+        {
+            options.threads = atoi(argv[++argi]);
+        }
+        else if (option == "--split-obj" && hasValue)
+        {
+            options.splitObj = atoi(argv[++argi]);
+        }
+        else if (option == "--output-sink" && hasValue)
+        {
+            options.outputSink = argv[++argi];
+            if (options.outputSink != "posix" && options.outputSink != "uring" &&
+                options.outputSink != "mmap")
+            {
+                cerr << "Unknown output sink " << options.outputSink << "; use posix, uring or mmap"
+                     << endl;
+                exit(1);
+            }
+#ifndef MIS2RIB_WITH_URING
+            if (options.outputSink == "uring")
+            {
+                cerr << "This mis2rib was built without io_uring support" << endl;
+                exit(1);
+            }
+#endif
+        }
+        else if (option == "--pipeline")
+        {
+            options.pipeline = true;
+        }
+        else if (option == "--pipeline-depth" && hasValue)
+        {
+            options.pipelineDepth = atoi(argv[++argi]);
+        }
+        else if (option == "--pipeline-block" && hasValue)
+        {
+            options.pipelineBlock = atoi(argv[++argi]);
+        }
+        else if (option == "--json-window" && hasValue)
+        {
+            options.jsonWindow = atoi(argv[++argi]);
+        }
+        else if (option == "--incremental")
+        {
+            options.incremental = true;
+        }
+        else if (option == "--dedup-geometry")
+        {
+            options.dedupGeometry = true;
+        }
+        else if (option == "--instance-cache")
+        {
+            options.instanceCache = true;
+        }
+        else if (option == "--delayed")
+        {
+            options.delayed = true;
+        }
+        else if (option == "--cull-camera" && hasValue)
+        {
+            options.cullCamera = argv[++argi];
+        }
+        else if (option == "--cull-margin" && hasValue)
+        {
+            options.cullMargin = float(atof(argv[++argi]));
+        }
+        else if (option == "--facing-camera" && hasValue)
+        {
+            options.facingCamera = argv[++argi];
+        }
+        else if (option == "--decimate" && hasValue)
+        {
+            options.decimateLevels = min(max(atoi(argv[++argi]), 0), 8);
+        }
+        else if (option == "--decimate-error" && hasValue)
+        {
+            options.decimateError = float(atof(argv[++argi]));
+        }
+        else if (option == "--lod-camera" && hasValue)
+        {
+            options.lodCamera = argv[++argi];
+        }
+        else if (option == "--lod-error" && hasValue)
+        {
+            options.lodError = float(atof(argv[++argi]));
+        }
+        else if (option == "--lod-resolution" && hasValue)
+        {
+            options.lodResolution = atoi(argv[++argi]);
+        }
+        else if (option == "--lod-thin")
+        {
+            options.lodThin = true;
+        }
+        else if (option == "--obj-cache")
+        {
+            options.objCache = true;
+        }
+        else if (option == "--shared-materials")
+        {
+            options.sharedMaterials = true;
+        }
+        else if (option == "--stats" && hasValue)
+        {
+            // Scene mode changes directory to the island
+            options.stats = boost::filesystem::absolute(argv[++argi]).string();
+        }
+        else if (option == "--obj-cache-quantize")
+        {
+            options.objCache = true;
+            options.objCacheQuantize = true;
+        }
+        else
+        {
+            cerr << "Unknown option " << option << endl;
+            exit(1);
+        }
     }
-    else if (type == "lights")
+    if (argc - argi >= 2 && argc - argi <= 6 && string(argv[argi]) == "generate")
     {
-        ifstream i(argv[2]);
-        json j;
-        i >> j;
-        lights(cout, j);
+        synthparams params;
+        int* counts[] = {&params.groups, &params.faces, &params.instances, &params.curves};
+        for (int i = argi + 2; i < argc; ++i) *counts[i - argi - 2] = max(atoi(argv[i]), 1);
+        return generate(argv[argi + 1], params);
     }
-    else if (type == "element")
+    if (argc - argi == 3 && string(argv[argi]) == "benchmark" &&
+        string(argv[argi + 1]) == "stages")
     {
-        ifstream i(argv[2]);
-        json j;
-        i >> j;
-        element(cout, j);
+        return benchmarkStages(argv[argi + 2]);
     }
-    else
+    if (argc - argi != 2)
+    {
+        cerr << "Usage: " << argv[0] << " [options] (camera|lights|element) filename.json" << endl;
+        cerr << "       " << argv[0] << " [options] scene islandroot" << endl;
+        cerr << "       " << argv[0] << " benchmark remap [nfaces]" << endl;
+        cerr << "       " << argv[0] << " benchmark curves curves.json" << endl;
+        cerr << "       " << argv[0] << " benchmark normals [ncvs]" << endl;
+        cerr << "       " << argv[0] << " benchmark sinks dir [MB]" << endl;
+        cerr << "       " << argv[0] << " [options] benchmark stages islandroot" << endl;
+        cerr << "       " << argv[0] << " generate islandroot [groups [faces [instances [curves]]]]"
+             << endl;
+        cerr << "Options:" << endl;
+        cerr << "    --binary                 write binary encoded RIB" << endl;
+        cerr << "    --compress gzip|zstd     compress all RIB output" << endl;
+        cerr << "    --compress-level n       compression level" << endl;
+        cerr << "    --compress-threads n     number of compression threads" << endl;
+        cerr << "    --precision n            write floats with n significant digits" << endl;
+        cerr << "    --threads n              number of conversion threads" << endl;
+        cerr << "    --split-obj n            convert OBJ files in parallel parts of n MB" << endl;
+        cerr << "    --output-sink name       write files with posix, uring or mmap" << endl;
+        cerr << "    --pipeline               overlap reading, converting and writing OBJ files"
+             << endl;
+        cerr << "    --pipeline-depth n       blocks each stage of the pipeline may run ahead"
+             << endl;
+        cerr << "    --pipeline-block n       size of the blocks of the pipeline in MB" << endl;
+        cerr << "    --json-window n          read curve and instance files n KB at a time" << endl;
+        cerr << "    --incremental            only convert what changed since the last scene"
+             << endl;
+        cerr << "    --dedup-geometry         instance groups of faces with identical geometry"
+             << endl;
+        cerr << "    --instance-cache         write archive instances to binary caches read by"
+             << endl;
+        cerr << "                             the mis2rib_instancer procedural" << endl;
+        cerr << "    --delayed                read archives and curves only when their bounds"
+             << endl;
+        cerr << "                             are reached" << endl;
+        cerr << "    --cull-camera file.json  leave out geometry outside the view of a camera"
+             << endl;
+        cerr << "    --cull-margin d          keep geometry within d of the view (default 0)"
+             << endl;
+        cerr << "    --facing-camera file     give curves normals facing a camera" << endl;
+        cerr << "    --decimate n             give archive masters n simplified levels of detail"
+             << endl;
+        cerr << "    --decimate-error f       error of the first level, as a fraction of the"
+             << endl;
+        cerr << "                             size of the master (default 0.01)" << endl;
+        cerr << "    --lod-camera file        simplify curves which are small in a camera" << endl;
+        cerr << "    --lod-error n            pixel error allowed by simplification (default 1)"
+             << endl;
+        cerr << "    --lod-resolution n       image width in pixels (default 2444)" << endl;
+        cerr << "    --lod-thin               thin out curves thinner than the pixel error" << endl;
+        cerr << "    --obj-cache              convert OBJ files from binary caches under rib/"
+             << endl;
+        cerr << "    --obj-cache-quantize     store the points of OBJ caches in 16 bits" << endl;
+        cerr << "    --stats file.json        write times and counts of the conversion to a file"
+             << endl;
+        cerr << "    --shared-materials       define each material once per element" << endl;
+        exit(1);
+    }
+
+    string type(argv[argi]);
+    string filename(argv[argi + 1]);
+    if (type == "scene")
     {
-        cerr << "Unknown type " << type << ", must be camera, lights, or element";
+        return scene(filename);
+    }
+    if (type != "camera" && type != "lights" && type != "element")
+    {
+        cerr << "Unknown type " << type << ", must be camera, lights, element or scene" << endl;
         exit(1);
     }
+    double start = seconds();
+    {
+        statsscope stats(type == "element" ? statsUnit(elementStats, filename) : nullptr, true);
+        ribstream out;
+        RibWriter rib(out.stream(), options.binary);
+        convert(rib, type, filename);
+        rib.flush();
+        if (!out.commit()) cerr << "Unable to write standard output" << endl;
+    }
+    reportDedup();
+    reportCull();
+    reportLod();
+    reportDecimation();
+    reportObjCache();
+    reportCompression(filename);
+    writeStats(seconds() - start);
 }
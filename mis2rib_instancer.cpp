@@ -0,0 +1,93 @@
+/*
+ * mis2rib_instancer.cpp
+ *
+ * Copyright (C) 2018 by Julian Fong. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * The RenderMan (R) Interface Procedures and RIB Protocol are:
+ * Copyright 1988, 1989, Pixar. All rights reserved.
+ * RenderMan (R) is a registered trademark of Pixar.
+ *
+ * A RenderMan procedural which creates the instances in an instance
+ * cache written by mis2rib --instance-cache:
+ *
+ *   Procedural "DynamicLoad" ["mis2rib_instancer" "cache.inst"] [bound]
+ *
+ * Each master is defined from its archive, and then instanced once
+ * for every matrix in the cache, exactly as mis2rib would otherwise
+ * have written in the RIB.
+ */
+
+#include <ri.h>
+#include <iostream>
+#include "instancecache.h"
+
+extern "C" {
+
+RtPointer ConvertParameters(RtString paramstr)
+{
+    instancecache::reader* cache = new instancecache::reader;
+    if (!cache->open(paramstr))
+    {
+        std::cerr << "mis2rib_instancer: " << cache->error() << std::endl;
+        delete cache;
+        return 0;
+    }
+    return cache;
+}
+
+RtVoid Subdivide(RtPointer data, RtFloat)
+{
+    const instancecache::reader* cache = static_cast<const instancecache::reader*>(data);
+    if (!cache) return;
+    for (uint32_t i = 0; i < cache->masterCount(); ++i)
+    {
+        const instancecache::master& m = cache->masters()[i];
+        const char* archive = cache->string(m.archive);
+        if (!*archive) continue;
+
+        RtObjectHandle object = RiObjectBegin();
+        RiReadArchive(const_cast<RtToken>(archive), 0, RI_NULL);
+        RiObjectEnd();
+
+        for (uint64_t k = m.first; k < m.first + m.count; ++k)
+        {
+            RtString name = const_cast<RtString>(cache->name(k));
+            RtMatrix matrix;
+            memcpy(matrix, cache->matrix(k), sizeof(matrix));
+            RiAttributeBegin();
+            RiAttribute(
+                const_cast<RtToken>("identifier"),
+                const_cast<RtToken>("string name"), &name, RI_NULL);
+            RiConcatTransform(matrix);
+            RiObjectInstance(object);
+            RiAttributeEnd();
+        }
+    }
+}
+
+RtVoid Free(RtPointer data)
+{
+    delete static_cast<instancecache::reader*>(data);
+}
+
+}
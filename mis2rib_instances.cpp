@@ -0,0 +1,238 @@
+/*
+ * mis2rib_instances.cpp
+ *
+ * Copyright (C) 2018 by Julian Fong. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Reads the instance caches written by mis2rib --instance-cache:
+ *
+ *   mis2rib_instances cache.inst
+ *       lists the masters and their number of instances
+ *   mis2rib_instances --dump cache.inst
+ *       writes the instances back out as an archive instance JSON file
+ *   mis2rib_instances --verify cache.inst instances.json
+ *       checks that the cache holds exactly the instances of the JSON
+ *       file it was written from, with the matrices rounded to float,
+ *       and exits with a non zero status if not
+ */
+
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "json.hpp"
+#include "instancecache.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+static void list(const instancecache::reader& cache)
+{
+    for (uint32_t i = 0; i < cache.masterCount(); ++i)
+    {
+        const instancecache::master& m = cache.masters()[i];
+        cout << cache.string(m.name) << ": " << m.count << " instances of "
+             << cache.string(m.archive) << endl;
+    }
+    cout << cache.masterCount() << " masters, " << cache.instanceCount() << " instances"
+         << endl;
+}
+
+static void dump(const instancecache::reader& cache)
+{
+    cout << "{";
+    for (uint32_t i = 0; i < cache.masterCount(); ++i)
+    {
+        const instancecache::master& m = cache.masters()[i];
+        cout << (i ? ", " : "") << json(cache.string(m.name)) << ": {";
+        for (uint64_t k = m.first; k < m.first + m.count; ++k)
+        {
+            cout << (k > m.first ? ", " : "") << json(cache.name(k)) << ": [";
+            const float* matrix = cache.matrix(k);
+            for (int e = 0; e < 16; ++e)
+            {
+                // Shortest form which reads back as the same float
+                char buffer[32];
+                *to_chars(buffer, buffer + sizeof(buffer) - 1, matrix[e]).ptr = 0;
+                cout << (e ? ", " : "") << buffer;
+            }
+            cout << "]";
+        }
+        cout << "}";
+    }
+    cout << "}" << endl;
+}
+
+// SAX handler which walks the cache alongside an archive instance
+// file, which maps master names to objects mapping instance names to
+// matrices, and stops at the first difference
+struct verifier
+{
+    verifier(const instancecache::reader& cache) : cache(cache) {}
+
+    bool null() { return fail("unexpected null"); }
+    bool boolean(bool) { return fail("unexpected boolean"); }
+    bool number_integer(json::number_integer_t v) { return number(float(v)); }
+    bool number_unsigned(json::number_unsigned_t v) { return number(float(v)); }
+    bool number_float(json::number_float_t v, const string&) { return number(float(v)); }
+    bool string(std::string&) { return fail("unexpected string"); }
+    bool binary(json::binary_t&) { return fail("unexpected binary"); }
+    bool key(std::string& k)
+    {
+        if (depth == 1)
+        {
+            if (master >= cache.masterCount()) return fail("extra master " + k);
+            const instancecache::master& m = cache.masters()[master];
+            if (k != cache.string(m.name)) return fail("master " + k + " is missing");
+            instance = m.first;
+            end = m.first + m.count;
+        }
+        else if (depth == 2)
+        {
+            if (instance >= end) return fail("extra instance " + k);
+            if (k != cache.name(instance)) return fail("instance " + k + " is missing");
+            element = 0;
+        }
+        return true;
+    }
+    bool start_object(size_t)
+    {
+        if (++depth > 2) return fail("unexpected object");
+        return true;
+    }
+    bool end_object()
+    {
+        if (--depth == 1)
+        {
+            if (instance != end) return fail("missing instances at the end of a master");
+            master++;
+        }
+        return true;
+    }
+    bool start_array(size_t)
+    {
+        if (++depth != 3) return fail("unexpected array");
+        return true;
+    }
+    bool end_array()
+    {
+        --depth;
+        if (element != 16)
+        {
+            return fail(std::string("matrix of ") + cache.name(instance) + " has " +
+                        to_string(element) + " elements");
+        }
+        instance++;
+        return true;
+    }
+    bool parse_error(size_t, const std::string&, const json::exception& e)
+    {
+        return fail(e.what());
+    }
+
+    bool number(float f)
+    {
+        if (depth != 3) return fail("unexpected number");
+        if (element++ >= 16) return true;
+        float c = cache.matrix(instance)[element - 1];
+        if (c != f && !(std::isnan(c) && std::isnan(f)))
+        {
+            ostringstream ostr;
+            ostr << setprecision(9) << "matrix of " << cache.name(instance)
+                 << " differs at element " << element - 1 << ": " << c << " instead of " << f;
+            return fail(ostr.str());
+        }
+        return true;
+    }
+
+    bool fail(const std::string& error)
+    {
+        if (this->error.empty()) this->error = error;
+        return false;
+    }
+
+    const instancecache::reader& cache;
+    int depth = 0;
+    uint32_t master = 0;
+    uint64_t instance = 0, end = 0;
+    int element = 0;
+    std::string error;
+};
+
+static bool verify(const instancecache::reader& cache, const std::string& filename)
+{
+    ifstream file(filename.c_str(), ios::binary);
+    if (!file)
+    {
+        cerr << "Unable to open " << filename << endl;
+        return false;
+    }
+    verifier v(cache);
+    if (json::sax_parse(file, &v) && v.master != cache.masterCount())
+    {
+        v.fail("masters missing at the end");
+    }
+    if (!v.error.empty())
+    {
+        cerr << filename << ": " << v.error << endl;
+        return false;
+    }
+    cout << filename << ": " << cache.masterCount() << " masters, " << cache.instanceCount()
+         << " instances match" << endl;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string mode = argc > 1 && argv[1][0] == '-' ? argv[1] : "";
+    int argi = mode.empty() ? 1 : 2;
+    int nargs = mode == "--verify" ? 2 : 1;
+    if ((!mode.empty() && mode != "--dump" && mode != "--verify") || argc - argi != nargs)
+    {
+        cerr << "Usage: " << argv[0] << " cache.inst" << endl;
+        cerr << "       " << argv[0] << " --dump cache.inst" << endl;
+        cerr << "       " << argv[0] << " --verify cache.inst instances.json" << endl;
+        return 1;
+    }
+
+    instancecache::reader cache;
+    if (!cache.open(argv[argi]))
+    {
+        cerr << cache.error() << endl;
+        return 1;
+    }
+    if (mode == "--dump")
+    {
+        dump(cache);
+    }
+    else if (mode == "--verify")
+    {
+        return verify(cache, argv[argi + 1]) ? 0 : 1;
+    }
+    else
+    {
+        list(cache);
+    }
+    return 0;
+}